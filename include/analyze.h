@@ -0,0 +1,52 @@
+#pragma once
+
+#include "fsck.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// 树中一层节点的统计,填充率是孩子数(叶子是key数)除以节点容量
+struct LevelStats {
+  static constexpr uint32_t kFillBuckets = 10;
+
+  uint64_t nodes = 0;
+  uint64_t entries = 0;
+  uint32_t min_entries = 0;
+  uint32_t max_entries = 0;
+  double fill = 0;
+  // 填充率的分布,第i个桶是[i*10%, (i+1)*10%),满的节点算在最后一个桶
+  uint64_t fill_histogram[kFillBuckets] = {};
+};
+
+struct TreeStats {
+  uint32_t block_size = 0;
+  uint32_t max_index_num = 0;
+  uint32_t max_data_num = 0;
+  uint64_t file_size = 0;
+  uint64_t pages = 0;
+  uint32_t height = 0;
+  std::vector<LevelStats> levels; // 从根开始,最后一层是叶子
+  uint64_t leaves = 0;
+  uint64_t keys = 0;
+  // 叶子链表按key顺序走一遍时,相邻两个叶子在文件中的位置
+  uint64_t leaf_sequential = 0; // 下一个叶子紧挨在后面
+  uint64_t leaf_forward = 0;    // 往后跳
+  uint64_t leaf_backward = 0;   // 往回跳
+  uint64_t leaf_runs = 0;       // 物理上连续的叶子段数
+  double leaf_avg_jump = 0;     // 不连续时平均跳过的页数
+  // 空闲空间
+  uint64_t free_blocks = 0;
+  uint64_t free_extents = 0;
+  uint64_t largest_free_extent = 0; // 页数
+  uint64_t bytes_read = 0;
+  double seconds = 0;
+};
+
+// 直接读树文件统计树高、每层的填充率、叶子链表的碎片和空闲空间,
+// 不经过页缓存。链表有环或者指向文件外时返回1,文件读不了返回-1
+int AnalyzeTree(int fd, const Boot &boot,
+                const PageScanner::PhysicalFn &physical, uint32_t threads,
+                TreeStats *stats);
+// 离线统计file_name(不带.boot)对应的文件,只读不写
+int AnalyzeFile(const std::string &file_name, uint32_t threads,
+                TreeStats *stats);
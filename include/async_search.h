@@ -0,0 +1,57 @@
+#pragma once
+
+#include "data_format/boot.h"
+#include <deque>
+#include <functional>
+#include <stdint.h>
+#include <unistd.h>
+#include <vector>
+
+class BMap;
+
+// 在一个线程里交错执行很多个查找,由BMap::AsyncSearcher创建
+// 查找走到不在缓存里的节点时不阻塞在pread上,而是用Linux原生AIO在O_DIRECT
+// 打开的文件上发出读请求(见PageLruCache::FetchPage),先去推进别的查找,
+// 这样一个线程就能让很多个读同时在盘上排队,不需要额外的线程。
+// 只能在写操作的线程用;还有没完成的查找时不能修改树
+class BAsyncSearcher {
+public:
+  // 查找完成时在Poll或Run里调用,不能在里面修改树
+  using Callback = std::function<void(key_t key, long value, bool found)>;
+
+  BAsyncSearcher(const BAsyncSearcher &) = delete;
+  BAsyncSearcher &operator=(const BAsyncSearcher &) = delete;
+  // 没完成的查找会先跑完
+  ~BAsyncSearcher();
+  // 提交一个查找;同时在跑的查找已经有max_inflight个(最多缓存页数的一半)时,
+  // 先推进到有空位
+  void Search(key_t key, Callback callback);
+  // 推进所有能推进的查找,不等IO,返回这次完成的查找数
+  uint32_t Poll();
+  // 一直推进到所有查找都完成
+  void Run();
+  uint32_t Pending() const { return ready_.size() + waiting_.size(); }
+  // 节点读不到(缓存用完或者页校验失败)的查找数,它们的回调里found是false,
+  // 但不代表key不存在
+  uint64_t Errors() const { return errors_; }
+
+private:
+  friend class BMap;
+  struct Lookup {
+    key_t key = 0;
+    off_t offset = 0;      // 下一步要访问的节点
+    bool fetching = false; // 节点是FetchPage发出去读的,还引用着
+    Callback callback;
+  };
+
+  BAsyncSearcher(BMap *bmap, uint32_t max_inflight);
+  // 往下走到叶子或者不在缓存里的节点,查找完成返回true
+  bool Advance(Lookup &lookup);
+
+private:
+  BMap *bmap_ = nullptr;
+  uint32_t max_inflight_ = 0;
+  std::deque<Lookup> ready_;    // 可以继续往下走的
+  std::vector<Lookup> waiting_; // 在等AIO读节点的
+  uint64_t errors_ = 0;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+// 分块的Bloom过滤器,每个key的所有位都落在同一个64字节的块里,
+// 一次查询只访问一条缓存行。只能加不能删,删掉的key要靠重建清掉
+class BloomFilter {
+public:
+  // bytes是内存预算,按预计的key数选哈希函数个数;bytes为0时不过滤
+  void Init(uint64_t bytes, uint64_t expected_keys);
+  void Clear();
+  void Add(key_t key);
+  // 返回false时key一定不存在
+  bool MayContain(key_t key) const;
+  bool Enabled() const { return !blocks_.empty(); }
+  uint64_t Bytes() const { return blocks_.size() * sizeof(Block); }
+  uint32_t Hashes() const { return hashes_; }
+
+private:
+  static constexpr uint32_t kBlockBits = 512;
+  struct alignas(64) Block {
+    uint64_t words[kBlockBits / 64];
+  };
+
+  // 高32位选块,低32位选块内的位
+  static uint64_t Hash(key_t key);
+  size_t BlockIndex(uint64_t hash) const {
+    return (hash >> 32) * blocks_.size() >> 32;
+  }
+
+private:
+  std::vector<Block> blocks_;
+  uint32_t hashes_ = 0;
+};
+
+struct FilterStats {
+  uint64_t bytes = 0;
+  uint32_t hashes = 0;
+  uint64_t keys = 0;            // 上次重建时加进去的key数
+  uint64_t rejects = 0;         // 直接判定不存在、没有往下走的查找数
+  uint64_t false_positives = 0; // 过滤器放过了但是没找到的查找数
+  uint64_t rebuilds = 0;        // 包括BOpen时的那次
+};
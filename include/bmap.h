@@ -1,48 +1,277 @@
 #pragma once
 
+#include "async_search.h"
+#include "bloom_filter.h"
 #include "bpnode_ptr.h"
 #include "data_format/boot.h"
+#include "analyze.h"
+#include "extent_allocator.h"
+#include "fsck.h"
 #include "page_cache.h"
+#include "snapshot.h"
+#include "transaction.h"
+#include "wal.h"
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
 #include <stdint.h>
 #include <string>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 
 #define offset_ptr(node) ((char *)(node) + sizeof(*node))
 
+// 修改怎么落盘
+enum DurabilityMode {
+  // 原地写回页,没有崩溃原子性:写到一半的分裂或合并没法修复
+  DURABILITY_IN_PLACE = 0,
+  // 影子分页:修改过的页写到新块上,每次修改结束时原子切换boot文件,
+  // 崩溃后回到上一次提交的状态
+  DURABILITY_SHADOW = 1,
+};
+
+// 节点内怎么找key
+enum NodeSearchMode {
+  NODE_SEARCH_BINARY = 0, // 二分查找
+  // 按节点首尾的key插值估计位置,再在附近缩小范围,最后退回二分查找;
+  // key分布接近均匀时比较次数少很多
+  NODE_SEARCH_INTERPOLATION = 1,
+};
+
 struct BConfig {
   uint32_t block_size = 0; // 块大小
   std::string file_name;   // 文件名
   uint32_t cache_size = 0; // 缓存大小
+  uint32_t readahead_pages = 32; // 最大预读窗口(页数),0表示关闭预读
+  bool keep_warm_list = false; // BClose时保存缓存中的页,BOpen时后台重新加载
+  HugePageMode huge_page = HUGE_PAGE_NONE; // 页缓冲区是否用大页
+  NumaPolicy numa_policy = NUMA_DEFAULT;   // 页缓冲区的NUMA策略
+  uint64_t numa_nodes = 0;      // NUMA节点掩码,0表示所有节点
+  bool prefault_cache = false;  // BOpen时预先分配好页缓冲区的物理内存
+  // 缓存满了并且都被引用住时最多临时多用的页数,用完后访问节点会失败
+  uint32_t max_overflow_pages = 256;
+  DurabilityMode durability = DURABILITY_IN_PLACE;
+  // 删除后节点不多于这个百分比才和兄弟合并,最多50(半满)
+  // 调小可以减少增删交替时同一批页反复分裂合并,再用Rebalance分批整理
+  uint32_t merge_percent = 50;
+  uint32_t vacuum_rate = 0; // Vacuum每秒最多搬的页数,0表示不限
+  uint32_t extent_pages = 256; // 文件每次扩展的页数,原地写模式下用fallocate预分配
+  // 新建文件时每页带CRC32C和LSN,已有的文件按文件本身的格式
+  bool page_checksum = false;
+  bool verify_on_read = true; // 带校验的文件缺页读入时校验,失败时访问节点会失败
+  // 新建文件时非叶子节点记下每个子树的key数,支持O(log n)的Rank/Select和
+  // 范围计数;每次增删都要改路径上所有的索引页,索引节点的容量也会变小
+  bool subtree_counts = false;
+  // 查找前先查的Bloom过滤器的内存字节数,0表示不用。BOpen时扫一遍文件建好,
+  // 删掉或者新加的key多了以后自动重建
+  uint64_t filter_bytes = 0;
+  NodeSearchMode node_search = NODE_SEARCH_BINARY; // 只影响查找,不影响文件格式
+  // 异步查找同时在读的页数(原生AIO的队列深度,不开线程),
+  // 0表示异步查找退化成同步读
+  uint32_t async_io_depth = 32;
+};
+
+// BplusTreeWriteBatch里的一个写操作
+struct BWriteOp {
+  enum Type { INSERT, UPSERT, DELETE };
+  Type type = INSERT;
+  key_t key = 0;
+  long value = 0;
 };
 
 class BMap {
 public:
+  friend class BAsyncSearcher;
   friend class BMapVisualizer;
+  friend class BpNodePtr;
+  friend class BSnapshot;
+  friend class BTransaction;
   BMap(const BConfig &conf) : conf_(conf) {}
   int BOpen();
   int BClose();
   int BplusTreeInsert(key_t key, long ldata);
-  std::pair<long, bool> BplusTreeSearch(key_t key);
+  // 读节点失败(缓存用完或者页校验失败)时*error置为-1,这时返回的false
+  // 不代表key不存在
+  std::pair<long, bool> BplusTreeSearch(key_t key, int *error = nullptr);
+  // 批量查找num个key,结果放在values和found里,返回找到的个数,
+  // 有节点读不到时返回-1
+  // 一组查找一起一层层往下走,先预取所有节点再比较,节点都在缓存里时
+  // 访存延迟可以互相重叠
+  int BplusTreeMultiSearch(const key_t *keys, uint32_t num, long *values,
+                           bool *found);
   int BplusTreeDelete(key_t key);
+  // 删除[start, end]里所有的key:整个落在范围里的子树直接摘掉,块还给空闲空间,
+  // 只调整两端的叶子和路径上的分隔key,代价和碰到的页数成正比。
+  // deleted不为空时返回删掉的条数,这时要读被摘掉的叶子来计数
+  int BplusTreeDeleteRange(key_t start, key_t end,
+                           uint64_t *deleted = nullptr);
+  // [start, end]里key的个数。有子树计数时只走两条路径,
+  // 否则中间的叶子直接用孩子数,只在两端的叶子里查找
+  uint64_t BplusTreeCountRange(key_t start, key_t end);
+  // 比key小的key的个数
+  uint64_t BplusTreeRank(key_t key);
+  // 从0开始第k小的key和它的值,k超出范围返回-1;
+  // 百分位数是Select(p * CountRange(最小, 最大))
+  int BplusTreeSelect(uint64_t k, key_t *key, long *value);
+  // 一批写按key排好序(同一个key的保持原来的顺序)后依次做,只提交一次,
+  // 每个操作的返回值放在rets里。影子分页下整批一起落盘,提交失败时整批都
+  // 不生效并返回-1;原地写模式下整批先写进日志,做完后把页和boot落盘再清空
+  // 日志,返回0时整批都已经落盘,返回-1时可能已经部分或者全部改到树上,
+  // 日志留着,重新打开时重做整批
+  int BplusTreeWriteBatch(const BWriteOp *ops, uint32_t num, int *rets);
+  // 改写已有key的值,key不存在返回-1
+  int BplusTreeUpdate(key_t key, long ldata);
+  // key存在就改写,不存在就插入
+  int BplusTreeUpsert(key_t key, long ldata);
+  // 用fn(旧值)的结果改写已有key的值,key不存在返回-1,result返回新值
+  int BplusTreeMerge(key_t key, const std::function<long(long)> &fn,
+                     long *result = nullptr);
+  // 原子加delta,key不存在时插入delta,result返回新值
+  int BplusTreeIncrement(key_t key, long delta, long *result = nullptr);
+  // 按key升序扫描[start, end],fn返回false时停止,返回扫描到的条数,
+  // 中途有节点读不到时返回-1
+  int BplusTreeScan(key_t start, key_t end,
+                    const std::function<bool(key_t, long)> &fn);
+  // 预热缓存:并行读入所有非叶子层,以及最左边的leaf_num个叶子
+  // 返回预热的页中在缓存里的页数
+  uint32_t Warm(uint32_t leaf_num = 0, uint32_t threads = 4);
+  CacheStats GetCacheStats() { return cache_.Stats(); }
+  FilterStats GetFilterStats() const;
+  // 直接读文件重建过滤器,不经过页缓存;没开过滤器时什么都不做
+  int RebuildFilter(uint32_t threads = 4);
+  // 当前已提交状态的快照,只支持影子分页,否则返回空
+  // 要在写操作的线程创建,之后可以交给别的线程读
+  std::unique_ptr<BSnapshot> Snapshot();
+  // 交错执行批量查找,见BAsyncSearcher;max_inflight是同时在跑的查找数
+  std::unique_ptr<BAsyncSearcher> AsyncSearcher(uint32_t max_inflight = 256);
+  // 开始一个事务,提交前不能BClose
+  std::unique_ptr<BTransaction> Begin();
+  // 切换到同一个文件里名字为name的树,空名字是默认树;不存在时create为true
+  // 新建一棵空树,为false返回-1。之后所有的读写(包括快照、异步查找和事务)
+  // 都对这棵树,所有树共用页缓存、空闲段和日志。
+  // Begin出来的事务还没提交或者放弃时不能切换,返回-1
+  int UseTree(const std::string &name, bool create = true);
+  // 删掉一棵命名树,页都还给空闲段;不能删默认树和当前的树
+  int DropTree(const std::string &name);
+  // 所有命名树的名字,不含默认树
+  std::vector<std::string> ListTrees() const;
+  const std::string &TreeName() const { return tree_name_; }
+  // 从上次停下的地方往后检查max_leaves个叶子,把不到半满的叶子和它上面
+  // 不到半满的索引节点与兄弟合并或者从兄弟借,返回整理的节点数;
+  // 由调用方在空闲时分批调用,一次最多走到最后一个叶子
+  uint32_t Rebalance(uint32_t max_leaves = 64);
+  // 在线整理文件(只支持原地写):先把叶子按key顺序搬到文件前部,
+  // 再把尾部的节点搬进前面的空闲块,最后截断文件。每次最多搬max_moves个页,
+  // 可以和读写交替调用;返回这次搬的页数,一轮整理完时done置为true
+  int Vacuum(uint32_t max_moves = 64, bool *done = nullptr);
+  // 在线检查树的结构,见Fsck;原地写模式下会先写回脏页
+  int Check(FsckReport *report, uint32_t threads = 4);
+  // 统计树高、每层填充率、叶子链表碎片和空闲空间,见AnalyzeTree
+  // 直接顺序读文件,不经过也不影响页缓存
+  int AnalyzeTree(TreeStats *stats, uint32_t threads = 4);
+  // 在线调整缓存页数,成功返回0
+  int ResizeCache(uint32_t cache_size);
   uint32_t GetMaxIndexNum() const { return max_index_num_; }
   uint32_t GetMaxDataNum() const { return max_data_num_; }
+  // 在有序的arr[0, len)中找target,找到返回下标,没找到返回-(第一个比它大的
+  // 下标)-1
+  static int KeySearch(const key_t *arr, int len, key_t target,
+                       NodeSearchMode mode = NODE_SEARCH_BINARY);
+  static int KeyInterpolationSearch(const key_t *arr, int len, key_t target);
 
 private:
   static constexpr uint64_t INVALID_OFFSET = 0xdeadbeef;
   off_t ReadOffset(int fd);
+  void WarmListSave();
+  void WarmListLoad();
+  int TreeInsert(key_t key, long ldata);
+  // removed不为空时在删掉之前用key原来的值调用
+  int TreeDelete(key_t key,
+                 const std::function<void(long)> &removed = nullptr);
+  int TreeDeleteRange(key_t start, key_t end, uint64_t *deleted);
+  // key数不大于(inclusive时)或者小于key的key的个数
+  uint64_t TreeRank(key_t key, bool inclusive);
+  // 子树里的key数:叶子是孩子数,非叶子节点是各个子树计数的和
+  uint64_t SubtreeCount(const BpNodePtr &node) const;
+  void SubCountUpdate(BpNodePtr &parent, int index, const BpNodePtr &sub_node);
+  // 增删之后从叶子往上重新算key所在路径上的子树计数,
+  // 分裂合并时动到的兄弟节点由各自的函数算好
+  void SubCountFix(key_t key);
+  // 搬num个子节点偏移,有子树计数时计数跟着一起搬
+  void SubMove(BpNodePtr &dst, int dst_index, const BpNodePtr &src,
+               int src_index, int num);
+  // 摘掉parent的第index个孩子为根的整个子树
+  int RangeDrop(BpNodePtr &node, BpNodePtr &parent, int index,
+                uint64_t *deleted);
+  // 释放offset为根、高level层(叶子为0)的子树的所有块
+  int RangeFree(off_t offset, uint32_t level, uint64_t *deleted);
+  // 参数是旧值,key不存在时是nullptr,返回新值
+  using UpdateFn = std::function<long(const long *)>;
+  // 一次下降到叶子,key存在时原地改值,不存在时insert为true就插入
+  int TreeUpdate(key_t key, const UpdateFn &fn, bool insert, long *result);
+  // 一次修改开始:清掉读节点失败的标记,返回现在的boot用来回滚
+  Boot WriteBegin();
+  // 提交一次修改。读节点失败时树可能只改了一半,影子分页下和提交失败
+  // 一样回到saved;原地写模式下已经写下去的页收不回来,只能返回-1
+  int CommitWrite(int ret, const Boot &saved);
+  // 影子分页下提交这次修改,原地写模式什么都不做
+  int ShadowCommit();
+  // 影子提交失败时丢掉没提交的页,boot回到修改前的saved,空闲块回到上次提交时
+  void ShadowRollback(const Boot &saved);
+  int BootCommit();
+  // undo不为空时,PUT和DELETE在同一次下降里读到原来的值后,把撤销这个修改
+  // 的操作追加进去;没读到叶子就失败时不追加
+  int ApplyEntry(const WriteAheadLog::Entry &entry,
+                 std::vector<WriteAheadLog::Entry> *undo = nullptr);
+  // 写进日志的一批:前面加上当前树的名字
+  std::vector<WriteAheadLog::Entry>
+  WalBatch(const std::vector<WriteAheadLog::Entry> &entries) const;
+  // 只切换内存里的根,不落盘
+  void TreeSwitch(const std::string &name);
+  int TxnApply(const std::map<key_t, BTransaction::Write> &writes);
+  // 原地写模式下把缓存和boot落盘,清空事务日志
+  int WalCheckpoint();
+  // 直接读文件前的准备:写回脏页,生成和内存一致的boot
+  int ScanSource(Boot *boot, PageScanner::PhysicalFn *physical);
+  // 过滤器判定key一定不存在时返回false
+  bool FilterPass(key_t key);
+  // 修改提交之后调用,删掉的key超过重建时的一半,或者新加的key超过
+  // 重建时的key数就重建
+  void FilterMaintain();
+  static uint32_t MergeThreshold(uint32_t max_num, uint32_t percent,
+                                 uint32_t min_num);
+  // 只读下降到key所在的叶子
+  BpNodePtr LeafSeek(key_t key);
+  // 不到半满的节点和同一个父节点下的右兄弟合并或者从它借,
+  // 最右边的子节点找左兄弟;合并到左兄弟时node换成左兄弟
+  int RebalanceLeaf(BpNodePtr &leaf);
+  int RebalanceIndex(BpNodePtr &node);
+  // 把节点从from搬到空闲块to,修正父节点,兄弟和子节点里的偏移
+  int NodeMove(off_t from, off_t to);
+  int VacuumCluster(std::set<uint64_t> &free, uint32_t budget, uint32_t *moved);
+  int VacuumShrink(std::set<uint64_t> &free, uint32_t budget, uint32_t *moved);
   int BCheckConfig(const BConfig &conf) const;
   int BNodeBinarySearch(const BpNodePtr &node, key_t target) const;
+  // 预取二分查找前几次比较会访问的key
+  static void PrefetchKeys(const key_t *arr, int len);
   int IsLeaf(const BpNodePtr &node) const;
   int ParentKeyIndex(BpNodePtr &parent, key_t key) const;
   void NodeNew(NodeType type, BpNodePtr &node);
   BpNodePtr NodeFetch(off_t offset);
   BpNodePtr NodeSeek(off_t offset);
   void NodeFlush(BpNodePtr &node);
-  BpNodePtr GetFreeNode();
+  // 分配一个离hint最近的空闲块,hint为-1表示不在意位置
+  BpNodePtr GetFreeNode(off_t hint = -1);
+  int ExtendFile();
+  // 把空闲块同步到boot再写文件
+  int BootWrite(int fd);
   void NodeDelete(BpNodePtr &node, BpNodePtr &left, BpNodePtr &right);
   void SubNodeUpdate(BpNodePtr &parent, int index, BpNodePtr &sub_node);
-  void SubNodeFlush(BpNodePtr &parent, off_t sub_offset);
+  int SubNodeFlush(BpNodePtr &parent, off_t sub_offset);
   void LeftNodeAdd(BpNodePtr &node, BpNodePtr &left);
   void RightNodeAdd(BpNodePtr &node, BpNodePtr &right);
   int ParentNodeBuild(BpNodePtr &l_ch, BpNodePtr &r_ch, key_t key);
@@ -73,7 +302,7 @@ private:
   void NonLeafMergeFromRight(BpNodePtr &node, BpNodePtr &right,
                              BpNodePtr &parent, int parent_key_index);
   void NonLeafSimpleRemove(BpNodePtr &node, int remove);
-  void NonLeafRemove(BpNodePtr &node, int remove);
+  int NonLeafRemove(BpNodePtr &node, int remove);
   int LeafRemove(BpNodePtr &leaf, key_t key);
   void LeafSimpleRemove(BpNodePtr &leaf, int remove);
   void LeafMergeFromRight(BpNodePtr &leaf, BpNodePtr &right);
@@ -89,9 +318,37 @@ private:
   Boot boot_;
   uint32_t max_index_num_ = 0;
   uint32_t max_data_num_ = 0;
+  uint32_t leaf_merge_num_ = 0;  // 删除前不多于这么多就要合并
+  uint32_t index_merge_num_ = 0;
+  bool counted_ = false; // 非叶子节点带子树计数
+  // 当前的树,它的根在boot_.root_offset,其他树(包括默认树)的根在boot_.trees
+  std::string tree_name_;
+  bool trees_changed_ = false; // 新建或删掉了树,boot要重新提交
+  uint32_t open_txns_ = 0;      // 还没提交或者放弃的事务数
+  // 这次修改中有节点读不到或者分配不出来(缓存用完,页校验失败,文件扩不了)
+  bool node_error_ = false;
+  BloomFilter filter_;
+  FilterStats filter_stats_;
+  uint64_t filter_removed_ = 0; // 上次重建以后删掉的key数
+  uint64_t filter_added_ = 0;   // 上次重建以后新加的key数
+  key_t rebalance_key_ = std::numeric_limits<key_t>::min();
+  // Vacuum的进度:下一个叶子的key和它要搬到的位置
+  key_t vacuum_key_ = std::numeric_limits<key_t>::min();
+  uint64_t vacuum_pos_ = 0;
+  bool vacuum_shrinking_ = false;
+  double vacuum_tokens_ = 0;
+  std::chrono::steady_clock::time_point vacuum_time_;
   int tree_fd_ = -1;
   int boot_fd_ = -1;
   PageLruCache cache_;
+  ExtentAllocator extents_; // 空闲块,只在写boot时同步到boot_.free_blocks
+  // 原地写模式下事务和批量写的redo日志,每次提交后落盘清空
+  WriteAheadLog wal_;
+  // 上一次提交的boot,用来判断boot是否变过
+  uint64_t committed_root_ = INVALID_OFFSET;
+  uint64_t committed_file_size_ = 0;
+  // 上一次提交时的空闲块,提交失败时恢复;修改中途释放的块还在提交过的树上
+  ExtentAllocator committed_extents_;
 };
 
 struct NodeBackLog {
@@ -108,7 +365,7 @@ public:
 
   void Visualize();
   void NodeKeyDraw(const BpNodePtr &node);
-  void Draw(const BpNodePtr &node, NodeBackLog *stack, int level);
+  void Draw(const BpNodePtr &node, const NodeBackLog *stack, int level);
 
 private:
   BMap &bmap_;
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "bmap.h"
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// bmap_server的二进制协议,只在本机用,整数都按本机字节序。
+// 每帧是ProtoHeader加上length字节的内容。一个连接上可以连续发多个请求
+// 不等应答,应答按请求的顺序返回,id原样带回
+//
+// 请求内容                                   应答内容(PROTO_OK时)
+// GET        key_t key                       long value
+// PUT        key_t key, long value           无
+// DELETE     key_t key                       无,key不存在时PROTO_NOT_FOUND
+// SCAN       key_t start, key_t end,         uint32_t n, n个(key_t, long)
+//            uint32_t limit(0表示服务端上限)
+// MULTI_GET  uint32_t n, n个key_t            uint32_t n, n个(uint8_t found, long)
+enum ProtoOp : int32_t {
+  PROTO_GET = 1,
+  PROTO_PUT = 2,
+  PROTO_DELETE = 3,
+  PROTO_SCAN = 4,
+  PROTO_MULTI_GET = 5,
+};
+
+// 服务端不用影子分页(没有-s)时,PUT和DELETE的PROTO_ERROR表示结果不确定:
+// 同一批的写可能已经生效,之后的GET能看到,重新打开时也会按日志重做
+enum ProtoStatus : int32_t {
+  PROTO_OK = 0,
+  PROTO_NOT_FOUND = 1,
+  PROTO_ERROR = -1, // 请求格式不对或者读写失败
+};
+
+struct ProtoHeader {
+  uint32_t length = 0; // 帧头之后的字节数
+  uint32_t id = 0;
+  int32_t code = 0; // 请求里是ProtoOp,应答里是ProtoStatus
+};
+
+// 一帧最多的内容字节数,超过时服务端断开连接
+constexpr uint32_t kProtoMaxFrame = 1 << 20;
+// MULTI_GET一次最多的key数,SCAN一次最多返回的条数
+constexpr uint32_t kProtoMaxKeys = 16384;
+
+// 往buf后面追加一帧
+class ProtoWriter {
+public:
+  ProtoWriter(std::string *buf, uint32_t id, int32_t code) : buf_(buf) {
+    start_ = buf_->size();
+    ProtoHeader header;
+    header.id = id;
+    header.code = code;
+    Put(header);
+  }
+  // 内容写完后回填长度
+  ~ProtoWriter() {
+    uint32_t length = buf_->size() - start_ - sizeof(ProtoHeader);
+    memcpy(&(*buf_)[start_], &length, sizeof(length));
+  }
+
+  template <typename T> void Put(const T &value) {
+    buf_->append((const char *)&value, sizeof(value));
+  }
+
+private:
+  std::string *buf_;
+  size_t start_ = 0;
+};
+
+// 从一帧的内容里按顺序读,越界时返回false
+class ProtoReader {
+public:
+  ProtoReader(const char *data, uint32_t length)
+      : data_(data), length_(length) {}
+
+  template <typename T> bool Get(T *value) {
+    if (length_ - pos_ < sizeof(T)) {
+      return false;
+    }
+    memcpy(value, data_ + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return true;
+  }
+  bool Done() const { return pos_ == length_; }
+
+private:
+  const char *data_;
+  uint32_t length_;
+  uint32_t pos_ = 0;
+};
+
+// buf[pos, )里有完整的一帧时取出帧头,pos移到下一帧,返回内容的起点;
+// 不完整时返回nullptr
+inline const char *ProtoNextFrame(const std::string &buf, size_t *pos,
+                                  ProtoHeader *header) {
+  if (buf.size() - *pos < sizeof(ProtoHeader)) {
+    return nullptr;
+  }
+  memcpy(header, buf.data() + *pos, sizeof(ProtoHeader));
+  if (buf.size() - *pos - sizeof(ProtoHeader) < header->length) {
+    return nullptr;
+  }
+  const char *body = buf.data() + *pos + sizeof(ProtoHeader);
+  *pos += sizeof(ProtoHeader) + header->length;
+  return body;
+}
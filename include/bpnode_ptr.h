@@ -35,9 +35,16 @@ public:
   key_t *Key();
   const off_t *Sub() const;
   off_t *Sub();
+  // 子树的key数,只有带子树计数的文件才有
+  const uint64_t *Count() const;
+  uint64_t *Count();
   const long *Data() const;
   long *Data();
 
+private:
+  // 释放对页的引用
+  void Release();
+
 private:
   BMap *bmap_ = nullptr;
   PageCacheIter cache_iter_;
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C(Castagnoli),CPU支持SSE4.2时用crc32指令,否则查表
+uint32_t Crc32c(const void *data, size_t len, uint32_t crc = 0);
+
+// 带校验的文件每页最后的尾部
+// crc覆盖页里除了crc本身以外的所有字节,lsn是写回时的序号,越大越新
+struct PageTrailer {
+  uint64_t lsn = 0;
+  uint32_t magic = 0;
+  uint32_t crc = 0;
+};
+constexpr uint32_t kPageTrailerMagic = 0x62706167; // "bpag"
+
+// 写回前填好尾部
+void PageSeal(char *page, uint32_t page_size, uint64_t lsn);
+// 校验读到的页,成功返回0,lsn返回页的序号
+int PageVerify(const char *page, uint32_t page_size, uint64_t *lsn);
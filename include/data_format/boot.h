@@ -1,5 +1,6 @@
 #pragma once
 #include <list>
+#include <map>
 #include <stdint.h>
 #include <string>
 #include <unistd.h>
@@ -9,11 +10,23 @@ extern off_t INVALID_OFFSET;
 extern off_t ReadOffset(int fd);
 extern off_t WriteOffset(int fd, uint64_t offset);
 
+enum BootFlag : uint64_t {
+  BOOT_PAGE_CHECKSUM = 1, // 每页最后是PageTrailer
+  BOOT_SUBTREE_COUNT = 2, // 非叶子节点带每个子树的key数
+};
+
 struct Boot {
   uint64_t root_offset = INVALID_OFFSET;
   uint64_t file_size = 0;
   uint64_t block_size = 0;
   std::list<uint64_t> free_blocks;
+  // 影子分页的页表日志,map_gen为0表示没有
+  uint64_t map_gen = 0;
+  uint64_t map_len = 0;
+  uint64_t flags = 0; // BootFlag
+  uint64_t lsn = 0;   // 上次写回页用到的序号
+  // 同一个文件里的命名树和它们的根,默认树(名字为空)的根是root_offset
+  std::map<std::string, uint64_t> trees;
 
   int ParseFromFile(int fd);
   int WriteToFile(int fd);
@@ -28,4 +41,31 @@ struct BpNode {
   off_t next;        // 后一个节点在文件中的偏移
   NodeType type;     // 节点类型
   uint32_t children; // 节点中包含的子节点数量
-};
\ No newline at end of file
+};
+
+// 节点在页里的布局:BpNode头,然后是key数组,再是子节点偏移或者值,
+// 带子树计数的文件非叶子节点在偏移后面是每个子树的key数
+// 带校验的文件页尾留给PageTrailer
+struct NodeLayout {
+  uint32_t block_size = 0;
+  uint32_t max_index_num = 0;
+  uint32_t max_data_num = 0;
+  bool checksum = false;
+  bool counts = false;
+
+  static NodeLayout FromBoot(const Boot &boot);
+  const key_t *Key(const BpNode *node) const {
+    return (const key_t *)(node + 1);
+  }
+  const off_t *Sub(const BpNode *node) const {
+    return (const off_t *)((const char *)(node + 1) +
+                           (max_index_num - 1) * sizeof(key_t));
+  }
+  const uint64_t *Count(const BpNode *node) const {
+    return (const uint64_t *)(Sub(node) + max_index_num);
+  }
+  const long *Data(const BpNode *node) const {
+    return (const long *)((const char *)(node + 1) +
+                          max_data_num * sizeof(key_t));
+  }
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+// 按extent管理文件中的空闲块
+// 空闲空间按起始偏移记成一段段连续的块,释放时和前后相邻的段合并;
+// 分配时取离hint最近的块,让分裂出来的节点落在兄弟旁边。
+// 不做IO,文件不够时由调用方扩展文件后AddRange进来
+class ExtentAllocator {
+public:
+  void Init(uint32_t block_size) { block_size_ = block_size; }
+  // 分配一个空闲块,hint为负数时取偏移最小的,没有空闲块返回-1
+  off_t Alloc(off_t hint);
+  void Free(off_t block) { AddRange(block, 1); }
+  void AddRange(off_t start, uint64_t blocks);
+  // 把指定的空闲块拿掉,不是空闲块返回false
+  bool Remove(off_t block);
+  void Clear();
+  uint64_t FreeBlocks() const { return free_num_; }
+  // 空闲段数,相邻的段总是合并的
+  uint64_t Extents() const { return extents_.size(); }
+  // 所有空闲块,按偏移排好
+  std::vector<off_t> Blocks() const;
+  // 每次修改加1,用来判断空闲块有没有变过
+  uint64_t Version() const { return version_; }
+
+private:
+  off_t End(std::map<off_t, uint64_t>::const_iterator iter) const {
+    return iter->first + (off_t)iter->second * block_size_;
+  }
+  void Take(std::map<off_t, uint64_t>::iterator iter, off_t block);
+
+private:
+  uint32_t block_size_ = 0;
+  std::map<off_t, uint64_t> extents_; // 起始偏移 -> 块数
+  uint64_t free_num_ = 0;
+  uint64_t version_ = 0;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "data_format/boot.h"
+#include "shadow_table.h"
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// 多线程读出树文件里的所有页
+// 物理位置和逻辑偏移一致时按大块顺序读,否则按physical逐页读
+class PageScanner {
+public:
+  // 逻辑偏移到文件中物理位置
+  using PhysicalFn = std::function<off_t(off_t logical)>;
+  // 在扫描线程里调用,page读失败时为nullptr
+  using PageFn = std::function<void(off_t logical, const char *page)>;
+
+  PageScanner(int fd, uint32_t block_size, uint64_t file_size,
+              PhysicalFn physical = nullptr)
+      : fd_(fd), block_size_(block_size), file_size_(file_size),
+        physical_(std::move(physical)) {}
+  // 返回读到的字节数,失败返回-1
+  int64_t Scan(uint32_t threads, const PageFn &fn);
+
+private:
+  static constexpr uint32_t kChunkPages = 256;
+
+  int fd_ = -1;
+  uint32_t block_size_ = 0;
+  uint64_t file_size_ = 0;
+  PhysicalFn physical_;
+};
+
+// 只读打开离线的树文件(不带.boot的文件名),影子分页的文件同时读入页表
+// direct为true时用O_DIRECT读,不占用系统的页缓存
+class TreeFile {
+public:
+  TreeFile() = default;
+  TreeFile(const TreeFile &) = delete;
+  ~TreeFile();
+  int Open(const std::string &file_name, bool direct = true);
+  int Fd() const { return fd_; }
+  const Boot &GetBoot() const { return boot_; }
+  // 普通文件返回空,按偏移顺序读
+  PageScanner::PhysicalFn Physical();
+
+private:
+  int fd_ = -1;
+  Boot boot_;
+  ShadowTable shadow_;
+};
+
+struct FsckReport {
+  uint64_t pages = 0;        // 文件中的页数
+  uint64_t leaves = 0;
+  uint64_t index_nodes = 0;
+  uint64_t keys = 0;
+  uint64_t free_blocks = 0;
+  uint64_t leaked_pages = 0; // 既不在树上也不在空闲列表里的页
+  uint64_t checksum_failures = 0;
+  uint32_t depth = 0;
+  double leaf_fill = 0;  // 叶子平均填充率
+  double index_fill = 0; // 非叶子节点平均填充率
+  uint64_t bytes_read = 0;
+  double seconds = 0;
+  uint64_t error_count = 0;
+  std::vector<std::string> errors; // 只保留前面的一部分
+  std::vector<off_t> leaked;       // 只保留前面的一部分
+};
+
+// 检查树的结构:节点内和节点间key的顺序,父节点分隔key的范围,
+// parent/prev/next指针,填充率,以及可达的页,free_blocks和file_size是否一致
+// 没有问题返回0,发现问题返回1,文件读不了返回-1
+int Fsck(int fd, const Boot &boot, const PageScanner::PhysicalFn &physical,
+         uint32_t threads, FsckReport *report);
+// 离线检查file_name(不带.boot)对应的文件,只读不写
+int FsckFile(const std::string &file_name, uint32_t threads,
+             FsckReport *report);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <utility>
+
+// 有界的多生产者单消费者无锁环形队列
+// 每个槽带一个序号:序号等于写位置时槽是空的,等于写位置+1时里面有数据。
+// 生产者用CAS抢写位置,消费者只有一个,不用CAS
+template <typename T> class MpscRing {
+public:
+  // 容量向上取到2的幂
+  explicit MpscRing(uint32_t capacity) {
+    uint64_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    slots_.reset(new Slot[size]);
+    for (uint64_t i = 0; i < size; i++) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  MpscRing(const MpscRing &) = delete;
+  MpscRing &operator=(const MpscRing &) = delete;
+
+  // 满了返回false,这时value不会被移走
+  bool TryPush(T &&value) {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &slot = slots_[pos & mask_];
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      int64_t diff = (int64_t)(seq - pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          slot.value = std::move(value);
+          slot.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        // 消费者还没取走上一圈的数据
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // 只能在消费者线程调用,空的时候返回false
+  bool TryPop(T *value) {
+    Slot &slot = slots_[head_ & mask_];
+    if (slot.seq.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+    }
+    *value = std::move(slot.value);
+    slot.seq.store(head_ + mask_ + 1, std::memory_order_release);
+    head_++;
+    return true;
+  }
+
+  // 只能在消费者线程调用;生产者抢到位置但还没写完时也算空
+  bool Empty() const {
+    return slots_[head_ & mask_].seq.load(std::memory_order_acquire) !=
+           head_ + 1;
+  }
+
+private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> seq{0};
+    T value;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  uint64_t mask_ = 0;
+  // 生产者和消费者的位置放在不同的缓存行上
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  alignas(64) uint64_t head_ = 0;
+};
@@ -1,9 +1,57 @@
 #pragma once
 
+#include "readahead.h"
+#include "shadow_table.h"
+#include <condition_variable>
+#include <functional>
+#include <linux/aio_abi.h>
+#include <mutex>
 #include <stdint.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// 页缓冲区的大页选项
+enum HugePageMode {
+  HUGE_PAGE_NONE = 0, // 普通页
+  HUGE_PAGE_THP = 1,  // 透明大页(madvise)
+  HUGE_PAGE_2M = 2,   // MAP_HUGETLB 2MiB,失败退回透明大页
+  HUGE_PAGE_1G = 3,   // MAP_HUGETLB 1GiB,失败退回2MiB
+};
+
+// 页缓冲区的NUMA策略
+enum NumaPolicy {
+  NUMA_DEFAULT = 0,    // 不设置,按首次访问分配
+  NUMA_INTERLEAVE = 1, // 在numa_nodes里交错分配
+  NUMA_BIND = 2,       // 绑定在numa_nodes上
+};
+
+// 页缓冲区实际拿到的内存
+enum ArenaBacking {
+  ARENA_MALLOC = 0,
+  ARENA_MMAP = 1,
+  ARENA_THP = 2,
+  ARENA_HUGETLB_2M = 3,
+  ARENA_HUGETLB_1G = 4,
+};
+
+struct ArenaOptions {
+  HugePageMode huge_page = HUGE_PAGE_NONE;
+  NumaPolicy numa_policy = NUMA_DEFAULT;
+  uint64_t numa_nodes = 0; // 节点掩码,第i位表示节点i
+  bool prefault = false;   // Init时把所有页先访问一遍
+};
+
+struct ArenaInfo {
+  ArenaBacking backing = ARENA_MALLOC;
+  bool numa_applied = false; // NUMA策略是否设置成功
+  bool prefaulted = false;
+  uint64_t size = 0;      // 映射的字节数
+  uint64_t thp_bytes = 0; // 实际用上透明大页的字节数
+};
 
 class PageList {
 public:
@@ -43,8 +91,18 @@ public:
 public:
   PageList() = default;
   PageList(const PageList &) = delete;
-  int Init(uint32_t capacity, uint32_t page_size);
+  int Init(uint32_t capacity, uint32_t page_size,
+           const ArenaOptions &options = ArenaOptions());
   ~PageList();
+  ArenaInfo GetArenaInfo() const;
+  // 扩容:新加一段内存,已有的页不移动
+  int Grow(uint32_t capacity);
+  // 只改容量,不申请也不释放内存,capacity不能超过已有的页帧数
+  int SetCapacity(uint32_t capacity);
+  // 缩容:页数必须已经不超过capacity,要释放的段上的页搬到留下的页帧上,
+  // 每搬一个页调用一次moved(旧idx, 新idx)
+  int Shrink(uint32_t capacity,
+             const std::function<void(uint32_t, uint32_t)> &moved);
   Iterator PushFront(std::string &data);
   Iterator PushFront();
   Iterator PushBack(std::string &data);
@@ -52,6 +110,9 @@ public:
 
   bool Full() const { return size_ >= capacity_; };
   bool Empty() const { return size_ == 0; }
+  uint32_t Size() const { return size_; }
+  uint32_t Capacity() const { return capacity_; }
+  uint32_t FrameNum() const { return frame_num_; }
   Iterator Erase(Iterator iter);
   Iterator End() { return Iterator(*this, 0); }
   uint32_t GetPageSize() const { return page_size_; }
@@ -66,7 +127,16 @@ public:
   Iterator MoveToBack(Iterator iter);
 
 private:
-  char *GetPage(uint32_t idx) { return page_buffer_ + idx * page_size_; }
+  char *GetPage(uint32_t idx) {
+    if (idx < base_frame_num_) {
+      return page_buffer_ + (size_t)idx * page_size_;
+    }
+    return SegmentPage(idx);
+  }
+  char *SegmentPage(uint32_t idx);
+  static char *AllocArena(size_t size, const ArenaOptions &options,
+                          ArenaInfo *arena);
+  static void FreeArena(char *buffer, const ArenaInfo &arena);
   uint32_t NextIdx(uint32_t idx) const { return link_info_[idx].next_idx; }
   uint32_t PrevIdx(uint32_t idx) const { return link_info_[idx].prev_idx; }
 
@@ -75,6 +145,13 @@ private:
     uint32_t prev_idx = 0;
     uint32_t next_idx = 0;
   };
+  // 扩容时新加的一段页帧
+  struct Segment {
+    char *buffer = nullptr;
+    uint32_t first_idx = 0;
+    uint32_t count = 0;
+    ArenaInfo arena;
+  };
 
   uint32_t capacity_ = 0;       // 最大容量
   char *page_buffer_ = nullptr; // 数据数组，地址必须是已经对齐的
@@ -84,6 +161,11 @@ private:
   uint32_t size_ = 0;                   // 已经使用的size
   uint32_t page_size_ = 0;              // 一个page的大小
   uint32_t using_tail_ = kInvaildIndex; // 正在使用的尾部idx
+  ArenaInfo arena_;                     // page_buffer_的内存来源
+  ArenaOptions options_;                // 扩容时按同样的方式分配
+  uint32_t base_frame_num_ = 0;         // page_buffer_里的页帧数
+  uint32_t frame_num_ = 0;              // 所有段的页帧数
+  std::vector<Segment> segments_;       // 扩容出来的段
 };
 
 using PageIter = PageList::Iterator;
@@ -93,29 +175,183 @@ struct PageInfo {
   PageList::Iterator iter;
   uint32_t in_use_count = 0;
   bool dirty = false;
+  bool loading = false; // 后台还在读
 };
 
 using PageCacheIter = std::unordered_map<off_t, PageInfo>::iterator;
 
+struct CacheStats {
+  uint64_t hits = 0;            // 命中次数
+  uint64_t misses = 0;          // 未命中次数
+  uint64_t readahead_pages = 0; // 后台预读的页数
+  uint64_t readahead_hits = 0;  // 未命中但从预读暂存区拿到的次数
+  uint32_t readahead_window = 0; // 当前预读窗口
+  uint64_t preload_pages = 0;    // 通过Preload读进来的页数
+  uint32_t capacity = 0;         // 当前缓存页数上限
+  uint32_t resident = 0;         // 当前缓存中的页数
+  uint64_t pressure_events = 0;  // 缓存满了并且没有可淘汰的页的次数
+  uint64_t pressure_flushes = 0; // 因此同步写回的脏页数
+  uint64_t overflow_allocs = 0;  // 因此借用溢出页帧的次数
+  uint64_t alloc_failures = 0;   // 溢出页帧也用完,GetPage失败的次数
+  uint32_t overflow_pages = 0;   // 当前借用的溢出页帧数
+  uint64_t retained_blocks = 0;  // 为快照保留的旧块数
+  uint64_t page_writes = 0;      // 写回磁盘的页数
+  uint64_t async_reads = 0;      // FetchPage发出的后台读页数
+  uint64_t checksum_pages = 0;    // 读入时校验过的页数
+  uint64_t checksum_failures = 0; // 校验失败的页数
+  uint64_t checksum_ns = 0;       // 计算和校验CRC花的时间(纳秒)
+  ArenaInfo arena;               // 页缓冲区的内存来源
+};
+
 class PageLruCache {
 public:
 public:
   PageLruCache() : unused_head_(page_list_.End()){};
   ~PageLruCache();
-  int Init(const std::string &file_name, uint32_t page_size, uint32_t capacity);
+  int Init(const std::string &file_name, uint32_t page_size, uint32_t capacity,
+           const ArenaOptions &options = ArenaOptions());
   PageCacheIter GetPage(off_t page_offset, bool is_new);
   int UnusePage(off_t page_offset);
+  // 释放GetPage拿到的引用,dirty表示页被改过
+  int Unpin(PageCacheIter iter, bool dirty);
   int SyncPage(off_t page_offset);
+  int FlushPage(PageCacheIter iter);
+  // 写回所有脏页
+  int FlushAll();
+  // 在线调整缓存页数,不能和树操作并发调用
+  // 扩容不移动已有的页;缩容先写回脏页并淘汰没在用的页
+  int Resize(uint32_t capacity);
+  uint32_t Capacity() const { return page_list_.Capacity(); }
+  // 缓存满了并且所有页都被引用住时,最多临时多用多少个页帧
+  void SetOverflowLimit(uint32_t pages);
+  PageCacheIter End() { return page_info_.end(); }
+  int EnableReadahead(uint32_t max_window, Readahead::NextFn next_fn);
+  // 打开影子分页,之后页不再原地写回,见ShadowTable
+  int EnableShadow(const std::string &file_name, uint64_t logical_size,
+                   uint64_t gen, uint64_t len);
+  bool Shadow() const { return shadow_.Enabled(); }
+  // 页在文件中的物理位置,影子分页下按页表转换
+  off_t PhysicalBlock(off_t page_offset) const {
+    return ReadBlock(page_offset);
+  }
+  // 把脏页写到新块上并提交页表,返回页表日志的代数和长度
+  // 没有要提交的页返回1
+  int ShadowCommit(uint64_t *gen, uint64_t *len);
+  // boot文件切换之后调用,回收旧块
+  void ShadowPublish();
+  // 丢掉上次提交之后的所有修改,页都不能被引用着
+  void ShadowAbort();
+  // 页尾带PageTrailer,写回时填好;verify为true时缺页读入后校验,
+  // 校验失败GetPage返回End()。lsn是上次写回用到的序号
+  void EnableChecksum(bool verify, uint64_t lsn);
+  uint64_t Lsn() const { return lsn_; }
+  // 从缓存中丢掉页,不写回,用于已经释放或者被截断的块;页不能被引用着
+  void Discard(off_t page_offset);
+  // 影子分页下的快照,可以在别的线程读
+  uint64_t AcquireSnapshot() { return shadow_.AcquireSnapshot(); }
+  void ReleaseSnapshot(uint64_t seq) { shadow_.ReleaseSnapshot(seq); }
+  int ReadSnapshotPage(off_t page_offset, uint64_t seq, char *page);
+  // 批量把页读进缓存,放在LRU最冷的一端,返回这些页中已经在缓存里的页数
+  // async为false时用threads个线程并行读完才返回;
+  // 为true时只占好位置,由后台线程读,读完之前访问这些页会等待
+  uint32_t Preload(const std::vector<off_t> &offsets, uint32_t threads,
+                   bool async);
+  void StopPreload();
+  // 打开FetchPage,depth是同时在读的页数上限;用Linux原生AIO,
+  // 文件是O_DIRECT打开的,不需要额外的线程
+  void SetFetchDepth(uint32_t depth);
+  // 异步把页读进缓存并引用住,读完之前访问这个页会等待,用完调UnusePage
+  // 页已经在缓存里返回1(不引用),发出读请求或者已经在读返回0,
+  // 没有页帧返回-1,这时调用方应该同步读
+  int FetchPage(off_t page_offset);
+  // 页是否还在后台读,结果只在ReapLoads之后更新
+  bool Loading(off_t page_offset) const;
+  // 取回后台读完的页;wait为true并且有页在读时,至少等到一个读完
+  void ReapLoads(bool wait);
+  // 页在缓存里时把页头预取到CPU缓存,不改LRU顺序也不加引用
+  void PrefetchPage(off_t page_offset) const {
+    auto iter = page_info_.find(page_offset);
+    if (iter != page_info_.end() && !iter->second.loading) {
+      __builtin_prefetch(*iter->second.iter);
+    }
+  }
+  // 缓存中的页的偏移,最近使用的在前
+  std::vector<off_t> ResidentPages();
+  CacheStats Stats();
   uint32_t GetPageSize() const { return page_list_.GetPageSize(); }
   int Fd() const { return fd_; }
 
 private:
+  // 一段文件中连续的页,一次preadv读完
+  struct PreloadRun {
+    off_t offset = 0; // 文件中的位置
+    std::vector<char *> pages;
+    std::vector<off_t> page_offsets;
+  };
+
+  off_t ReadBlock(off_t page_offset) const {
+    return shadow_.Enabled() ? shadow_.Physical(page_offset) : page_offset;
+  }
+  off_t WriteBlock(off_t page_offset) {
+    return shadow_.Enabled() ? shadow_.PendingBlock(page_offset)
+                             : page_offset;
+  }
   int CheckAlignMem(uint32_t page_size) const;
   int CheckAlignFile(uint32_t page_size) const;
+  bool EvictUnused();
+  PageIter AllocFrame();
+  PageIter ReclaimFrame();
+  void ReturnOverflow();
+  void MoveToUnusedTail(PageInfo &page_info);
+  void MoveToUnusedHead(PageInfo &page_info);
+  void DropPage(PageCacheIter iter);
+  void SealPage(char *page);
+  int VerifyPage(const char *page);
+  void LoadRuns(std::vector<PreloadRun> runs, uint32_t threads,
+                std::vector<std::pair<off_t, bool>> *loaded);
+  void JoinLoaders();
+  void FinishLoad(off_t page_offset, bool ok);
+  void ReapLoaded();
+  void WaitLoaded(off_t page_offset);
+  // 取回AIO读完的页,wait为true时至少等到一个,返回取回的页数
+  int ReapFetched(bool wait);
+  bool IsFetching(off_t page_offset) const;
+  // 等页读完,Preload和FetchPage读的都可以
+  void WaitPage(off_t page_offset);
 
 private:
   int fd_ = -1;
   std::unordered_map<off_t, PageInfo> page_info_;
+  // dirty的页,写回或者丢掉时去掉,提交和FlushAll不用扫整个page_info_
+  std::unordered_set<off_t> dirty_pages_;
   PageList page_list_;
   PageIter unused_head_;
+  std::vector<off_t> frame_offset_; // 每个页帧当前存的页的偏移
+  Readahead readahead_;
+  ShadowTable shadow_;
+  CacheStats stats_;
+  uint32_t base_capacity_ = 0;     // 不算溢出页帧的容量
+  uint32_t max_overflow_pages_ = 0;
+  bool checksum_ = false;
+  bool verify_ = false;
+  uint64_t lsn_ = 0;
+
+  // 后台Preload的状态,loaded_由load_mutex_保护
+  uint32_t loading_num_ = 0;
+  bool load_stop_ = false;
+  std::mutex load_mutex_;
+  std::condition_variable load_cond_;
+  std::vector<std::pair<off_t, bool>> loaded_;
+  std::vector<std::thread> loaders_;
+
+  // FetchPage发出的AIO,aio_data是槽位号
+  struct FetchSlot {
+    iocb cb;
+    off_t page_offset = -1; // -1表示空闲
+  };
+  aio_context_t aio_ctx_ = 0;
+  uint32_t fetching_num_ = 0;
+  std::vector<FetchSlot> fetch_slots_;
+  std::vector<uint32_t> free_slots_;
+  std::vector<io_event> fetch_events_;
 };
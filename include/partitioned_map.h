@@ -0,0 +1,84 @@
+#pragma once
+
+#include "bmap.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// key怎么分到各个分区
+enum PartitionMode {
+  PARTITION_HASH = 0,  // 按key的哈希,写最均匀,范围扫描要归并所有分区
+  PARTITION_RANGE = 1, // 按splits切成连续的区间,范围扫描只走相关的分区
+};
+
+struct PartitionConfig {
+  BConfig conf; // 每个分区的配置,分区i的文件是conf.file_name + "." + i
+  uint32_t partitions = 4;
+  PartitionMode mode = PARTITION_HASH;
+  // 按范围分区时升序的分界,共partitions-1个,分区i是[splits[i-1], splits[i])
+  std::vector<key_t> splits;
+};
+
+// 把key分到N个独立的BMap上,每个分区有自己的文件、缓存和线程,
+// 一个分区的操作都在它自己的线程里按提交的顺序做,不同分区的写互不等待。
+// 所有接口都可以在多个线程里同时调用
+class BPartitionedMap {
+public:
+  explicit BPartitionedMap(const PartitionConfig &conf) : conf_(conf) {}
+  BPartitionedMap(const BPartitionedMap &) = delete;
+  BPartitionedMap &operator=(const BPartitionedMap &) = delete;
+  ~BPartitionedMap();
+  // 启动分区线程并在各自的线程里打开,有一个失败就返回-1,之后要Close
+  int Open();
+  int Close();
+  uint32_t Partitions() const { return shards_.size(); }
+  uint32_t Partition(key_t key) const;
+
+  int Insert(key_t key, long value);
+  int Upsert(key_t key, long value);
+  int Delete(key_t key);
+  std::pair<long, bool> Search(key_t key);
+  // 按分区拆开后各分区同时插入,返回插入成功的条数
+  uint32_t MultiInsert(const std::vector<std::pair<key_t, long>> &entries);
+  // 按key升序扫描所有分区的[start, end],fn返回false时停止,返回扫描到的条数;
+  // 有分区读不到节点时返回-1,这之前fn可能已经收到一部分结果。
+  // fn在调用线程里执行;扫描期间别的线程的写可能看到也可能看不到
+  int Scan(key_t start, key_t end,
+           const std::function<bool(key_t, long)> &fn);
+  // 在分区的线程里执行fn,等它做完返回fn的返回值
+  int Run(uint32_t partition, const std::function<int(BMap &)> &fn);
+  // 在所有分区的线程里同时执行fn,都做完后返回,有一个失败就返回-1
+  int RunAll(const std::function<int(uint32_t partition, BMap &)> &fn);
+
+private:
+  struct Shard {
+    std::unique_ptr<BMap> bmap;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::function<void()>> tasks;
+    bool stop = false;
+    bool opened = false;
+  };
+  // 范围扫描时一个分区的游标,每次从分区里取一批
+  struct Cursor {
+    std::vector<std::pair<key_t, long>> entries;
+    size_t pos = 0;
+    int64_t from = 0; // 下一批从这里开始
+  };
+  static constexpr uint32_t kScanBatch = 256;
+
+  void Work(Shard *shard);
+  void Post(uint32_t partition, std::function<void()> task);
+  int Fill(uint32_t partition, Cursor *cursor, key_t end);
+
+private:
+  PartitionConfig conf_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
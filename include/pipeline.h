@@ -0,0 +1,82 @@
+#pragma once
+
+#include "bmap.h"
+#include "mpsc_ring.h"
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// 流水线里一个请求的结果
+struct BResult {
+  // 写操作的返回值,查找时读节点失败为-1。写所在的那批提交失败时也是-1,
+  // 原地写模式下这时结果不确定,修改可能已经生效,见BplusTreeWriteBatch
+  int ret = 0;
+  long value = 0; // 查找到的值
+  bool found = false;
+};
+
+struct PipelineStats {
+  uint64_t requests = 0;
+  uint64_t batches = 0; // 平均每批的请求数是requests / batches
+};
+
+// 单写者模式:一个线程独占一个BMap,别的线程通过无锁队列提交请求,拿到future。
+// 这个线程每次取出一批请求,连续的查找用BplusTreeMultiSearch一起往下走,
+// 连续的写用BplusTreeWriteBatch按key排好序一起做、只提交一次。
+// 同一个线程提交的请求按提交的顺序生效;所有接口都可以在多个线程里同时调用
+class BPipeline {
+public:
+  // ring_size是队列的容量,满了提交的线程会等;max_batch是一批最多的请求数
+  explicit BPipeline(const BConfig &conf, uint32_t ring_size = 4096,
+                     uint32_t max_batch = 256)
+      : bmap_(conf), ring_(ring_size), max_batch_(max_batch) {}
+  BPipeline(const BPipeline &) = delete;
+  BPipeline &operator=(const BPipeline &) = delete;
+  ~BPipeline() { Close(); }
+  // 打开树并启动处理线程
+  int Open();
+  // 处理完已经提交的请求后关闭,之后不能再提交
+  int Close();
+
+  std::future<BResult> Insert(key_t key, long value);
+  std::future<BResult> Upsert(key_t key, long value);
+  std::future<BResult> Delete(key_t key);
+  std::future<BResult> Search(key_t key);
+  PipelineStats Stats() const;
+
+private:
+  enum Op { OP_SEARCH, OP_INSERT, OP_UPSERT, OP_DELETE };
+  struct Request {
+    Op op = OP_SEARCH;
+    key_t key = 0;
+    long value = 0;
+    std::promise<BResult> result;
+  };
+  // 队列空了以后先空转这么多次再睡
+  static constexpr uint32_t kSpins = 1024;
+
+  std::future<BResult> Submit(Op op, key_t key, long value);
+  void Work();
+  void Wait();
+  // 处理batch[begin, end),都是查找或者都是写
+  void ApplySearches(std::vector<Request> &batch, size_t begin, size_t end);
+  void ApplyWrites(std::vector<Request> &batch, size_t begin, size_t end);
+
+private:
+  BMap bmap_;
+  MpscRing<Request> ring_;
+  uint32_t max_batch_ = 0;
+  std::thread worker_;
+  bool running_ = false;
+  std::atomic<bool> stop_{false};
+  // 处理线程睡着时提交的线程要叫醒它
+  std::atomic<bool> sleeping_{false};
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> batches_{0};
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// 自适应预读
+// 识别按文件偏移顺序或者按页内next指针顺序的访问,
+// 由后台线程把后续的页读到暂存区,缺页时直接从暂存区拷贝,不再同步pread
+class Readahead {
+public:
+  // 从页内容中解析出下一个页的偏移,没有返回-1
+  using NextFn = std::function<off_t(const char *page)>;
+
+  Readahead() = default;
+  Readahead(const Readahead &) = delete;
+  ~Readahead();
+  int Init(int fd, uint32_t page_size, uint32_t max_window, NextFn next_fn);
+  void Stop();
+  bool Enabled() const { return max_window_ > 0; }
+  // 通知一次页访问,hit表示页已经在缓存里;顺序流上的页不在缓存里
+  // 也不是从暂存区取的,说明预读落后了,从这里重新开始(只在缓存线程调用)
+  void OnAccess(off_t offset, const char *page, bool hit);
+  // 从暂存区取页,取到返回true
+  bool Take(off_t offset, char *page);
+  // 页被写回磁盘后调用,丢弃暂存区中的旧内容
+  void Invalidate(off_t offset);
+  uint64_t PrefetchedPages();
+  uint32_t Window() const { return window_; }
+
+private:
+  static constexpr uint32_t kMinWindow = 4;
+  static constexpr uint32_t kHistoryNum = 8;
+  static constexpr off_t kNoCursor = -1; // 从顺序流的下一页开始
+  static constexpr off_t kEndCursor = -2; // 链表已经读到头了
+
+  struct Job {
+    off_t start = -1;
+    uint32_t count = 0;
+    bool chain = false; // true按next指针,false按偏移
+    uint64_t gen = 0;
+  };
+  struct Access {
+    off_t offset = -1;
+    off_t next = -1;
+  };
+
+  bool ValidOffset(off_t offset) const {
+    return offset >= 0 && offset % page_size_ == 0;
+  }
+  bool Reading(off_t offset) const {
+    return offset >= reading_begin_ && offset < reading_end_;
+  }
+  void Restart();
+  void Issue();
+  void Worker();
+  void RunJob(const Job &job);
+  void Stage(off_t offset, const char *page);
+
+private:
+  int fd_ = -1;
+  uint32_t page_size_ = 0;
+  uint32_t max_window_ = 0;
+  NextFn next_fn_;
+
+  // 以下只在缓存线程访问
+  Access history_[kHistoryNum];
+  uint32_t history_pos_ = 0;
+  off_t stream_pos_ = -1;  // 当前顺序流最后访问的页
+  off_t stream_next_ = -1; // 当前顺序流期望的下一页
+  bool stream_chain_ = false;
+  uint32_t window_ = 0;      // 当前预读窗口
+  uint32_t issued_ahead_ = 0; // 已经发出还没被访问到的页数
+  off_t last_taken_ = -1;     // 最近一次从暂存区取走的页
+
+  // 以下由mutex_保护
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Job> jobs_;
+  bool busy_ = false;
+  bool stop_ = false;
+  uint64_t gen_ = 0;         // 顺序流的代数,换流后旧任务不再更新cursor_
+  off_t cursor_ = kNoCursor; // 上一个任务读到的位置之后的下一页
+  off_t reading_begin_ = 0;
+  off_t reading_end_ = 0;
+  std::unordered_set<off_t> stale_;
+  std::unordered_map<off_t, char *> staged_;
+  std::deque<off_t> staged_order_;
+  std::vector<char *> free_bufs_;
+  uint64_t prefetched_pages_ = 0;
+
+  char *io_buffer_ = nullptr;   // 后台线程读盘用
+  char *pool_buffer_ = nullptr; // 暂存区
+  std::thread worker_;
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// fsync路径所在的目录,让新建和rename的文件落盘
+int SyncParentDir(const std::string &path);
+
+// 影子分页的页表
+// 树里的节点偏移是逻辑页号,页表把它映射到文件中的物理块。
+// 修改过的页不覆盖原来的块,而是写到新分配的块上,提交时先把映射追加到
+// 页表日志,再由调用方原子替换boot文件完成切换;旧的块在切换之后才回收。
+// 没有映射过的逻辑页(打开影子分页之前就有的页)物理块就是它自己。
+class ShadowTable {
+public:
+  ShadowTable() = default;
+  ShadowTable(const ShadowTable &) = delete;
+  ~ShadowTable();
+  // gen为0表示还没有页表日志,logical_size是当前逻辑文件大小
+  // read_only时不清理日志的尾巴,只能用来读
+  int Open(const std::string &file_name, int fd, uint32_t page_size,
+           uint64_t logical_size, uint64_t gen, uint64_t len,
+           bool read_only = false);
+  bool Enabled() const { return page_size_ > 0; }
+  // 读页时用的物理块
+  off_t Physical(off_t logical) const;
+  // 这次提交中逻辑页要写到的块,第一次调用时分配新块
+  off_t PendingBlock(off_t logical);
+  bool HasPending() const { return !pending_.empty(); }
+  bool IsPending(off_t logical) const { return pending_.count(logical); }
+  // 把这次提交的映射写进页表日志并落盘,返回日志的代数和有效长度
+  int Commit(uint64_t *gen, uint64_t *len);
+  // boot文件切换成功后调用,旧块可以回收了
+  void Publish();
+  // 放弃这次提交分配的块
+  void Abort();
+  // 快照:记住当前提交的版本,之后被替换掉的块在快照释放前不回收
+  // 这几个函数可以在别的线程调用
+  uint64_t AcquireSnapshot();
+  void ReleaseSnapshot(uint64_t seq);
+  // 快照seq看到的逻辑页所在的块
+  off_t SnapshotBlock(off_t logical, uint64_t seq);
+  // 文件中在用的块数和空闲块数
+  uint64_t UsedBlocks() const;
+  uint64_t FreeBlocks() const { return free_.size(); }
+  // 为快照保留的旧块数
+  uint64_t RetainedBlocks();
+
+private:
+  struct Header {
+    uint64_t magic = 0;
+    uint64_t identity_limit = 0;
+  };
+  struct Entry {
+    int64_t logical = 0;
+    int64_t physical = 0;
+  };
+  // 被替换掉的旧块,对提交序号在[from, to)之间的快照可见
+  struct Retired {
+    off_t physical = 0;
+    uint64_t from = 0;
+    uint64_t to = 0;
+  };
+  static constexpr uint64_t kMagic = 0x73686d6170763031; // "shmapv01"
+
+  std::string JournalName(uint64_t gen) const;
+  off_t CommittedBlock(off_t logical) const;
+  bool SnapshotNeeds(uint64_t from, uint64_t to) const;
+  int WriteJournal(int fd, off_t pos, const std::vector<Entry> &entries,
+                   uint64_t *len);
+
+private:
+  std::string file_name_;
+  int fd_ = -1;         // 树文件
+  int journal_fd_ = -1; // 当前页表日志
+  uint32_t page_size_ = 0;
+  uint64_t identity_limit_ = 0; // 小于它且没有映射的逻辑页就在原位置
+  uint64_t gen_ = 0;
+  uint64_t len_ = 0;
+  uint64_t journal_entries_ = 0;
+  // Commit写好的日志状态,Publish后生效
+  int new_journal_fd_ = -1; // 压缩出的下一代日志
+  uint64_t new_len_ = 0;
+  uint64_t new_entries_ = 0;
+  off_t file_end_ = 0;   // 物理块分配到的位置
+  std::unordered_map<off_t, off_t> committed_;
+  std::unordered_map<off_t, off_t> pending_;
+  std::set<off_t> free_; // 按偏移排序,优先用前面的块
+
+  // 快照相关,由mutex_保护;committed_只在写线程修改,修改时也要加锁
+  std::mutex mutex_;
+  uint64_t seq_ = 0; // 已经提交的次数
+  std::unordered_map<off_t, uint64_t> since_; // 映射从第几次提交开始生效
+  std::unordered_multimap<off_t, Retired> retired_;
+  std::multiset<uint64_t> snapshots_;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "data_format/boot.h"
+#include <functional>
+#include <stdint.h>
+#include <unistd.h>
+#include <utility>
+
+class BMap;
+
+// 某次提交时整棵树的只读视图,由BMap::Snapshot创建
+// 读的是提交时的块,写操作不会改到它们,所以可以在别的线程和写操作同时用;
+// 释放之前这些块不会被回收。不能比创建它的BMap活得长
+class BSnapshot {
+public:
+  BSnapshot(const BSnapshot &) = delete;
+  BSnapshot &operator=(const BSnapshot &) = delete;
+  ~BSnapshot();
+  std::pair<long, bool> Search(key_t key);
+  // 和BMap::BplusTreeScan一样
+  int Scan(key_t start, key_t end,
+           const std::function<bool(key_t, long)> &fn);
+
+private:
+  friend class BMap;
+  BSnapshot(BMap *bmap, uint64_t seq, off_t root);
+  const BpNode *ReadNode(off_t offset);
+  const BpNode *FindLeaf(key_t key);
+  const key_t *Key(const BpNode *node) const;
+  const off_t *Sub(const BpNode *node) const;
+  const long *Data(const BpNode *node) const;
+
+private:
+  BMap *bmap_ = nullptr;
+  uint64_t seq_ = 0;
+  off_t root_ = 0;
+  char *page_ = nullptr; // 一次只用一个页
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <sys/types.h>
+#include <utility>
+
+class BMap;
+
+// 多个操作的原子事务,由BMap::Begin创建
+// 修改先缓存在事务里,Commit时按key顺序一起应用,只落盘一次;
+// Abort或者没提交就析构时什么都不会写到树上。
+// 只有影子分页下崩溃后是原子的,原地写模式下日志只能重做逻辑上的修改,
+// 修不好写到一半的页
+// 多个事务之间不做冲突检测,后提交的覆盖先提交的
+class BTransaction {
+public:
+  BTransaction(const BTransaction &) = delete;
+  BTransaction &operator=(const BTransaction &) = delete;
+  ~BTransaction() { Abort(); }
+  // key存在就覆盖
+  int Put(key_t key, long value);
+  // key不存在时提交也不报错
+  int Delete(key_t key);
+  // 先看事务里的修改,再看树
+  std::pair<long, bool> Get(key_t key);
+  // 成功返回0,失败时树回到事务开始前的状态
+  int Commit();
+  void Abort();
+  size_t Size() const { return writes_.size(); }
+
+private:
+  friend class BMap;
+  // first为true表示写入second,false表示删除
+  using Write = std::pair<bool, long>;
+
+  explicit BTransaction(BMap *bmap) : bmap_(bmap) {}
+  // 提交或者放弃之后不再占着BMap,可以切换树
+  void Finish();
+
+private:
+  BMap *bmap_ = nullptr;
+  std::map<key_t, Write> writes_;
+  bool done_ = false;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+// 逻辑redo日志
+// 每次追加一批操作并落盘,一批要么全部重做要么全部不做
+class WriteAheadLog {
+public:
+  enum Op : int32_t {
+    OP_PUT = 0,
+    OP_DELETE = 1,
+    // 之后的修改属于哪棵命名树:名字按8字节一段放在value里,key是这段在名字
+    // 中的位置,key为0时开始一个新名字
+    OP_TREE = 2,
+    // 只在key不存在时插入,BplusTreeWriteBatch的INSERT
+    OP_INSERT = 3,
+  };
+  struct Entry {
+    key_t key = 0;
+    Op op = OP_PUT;
+    long value = 0;
+  };
+  using ReplayFn = std::function<void(const Entry &entry)>;
+
+  WriteAheadLog() = default;
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  ~WriteAheadLog();
+  int Open(const std::string &file_name);
+  bool Opened() const { return fd_ >= 0; }
+  int Append(const std::vector<Entry> &entries);
+  // 按顺序重做所有完整的批,返回重做的批数
+  int Replay(const ReplayFn &fn);
+  // 日志里的修改都已经落盘,清空日志
+  int Reset();
+  uint64_t Size() const { return size_; }
+
+private:
+  struct BatchHeader {
+    uint64_t magic = 0;
+    uint32_t count = 0;
+    uint32_t checksum = 0;
+  };
+  static constexpr uint64_t kMagic = 0x62776c6f67763031; // "bwlogv01"
+  static uint32_t Checksum(const std::vector<Entry> &entries);
+
+private:
+  int fd_ = -1;
+  uint64_t size_ = 0;
+};
@@ -0,0 +1,156 @@
+#include "analyze.h"
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+
+namespace {
+
+// 扫描时从页里取出来的信息,统计时只用它,不再读盘
+struct PageInfo {
+  bool read = false;
+  int type = -1;
+  uint32_t children = 0;
+  off_t next = INVALID_OFFSET;
+  off_t first_sub = INVALID_OFFSET; // 非叶子节点最左边的孩子
+};
+
+void AddNode(LevelStats *level, uint32_t entries, uint32_t max) {
+  if (level->nodes == 0 || entries < level->min_entries) {
+    level->min_entries = entries;
+  }
+  level->max_entries = std::max(level->max_entries, entries);
+  level->nodes++;
+  level->entries += entries;
+  uint32_t bucket = max ? (uint64_t)entries * LevelStats::kFillBuckets / max
+                        : 0;
+  level->fill_histogram[std::min(bucket, LevelStats::kFillBuckets - 1)]++;
+}
+
+void CountFreeExtents(const Boot &boot, uint32_t block_size,
+                      TreeStats *stats) {
+  std::vector<uint64_t> blocks(boot.free_blocks.begin(),
+                               boot.free_blocks.end());
+  std::sort(blocks.begin(), blocks.end());
+  uint64_t length = 0;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    if (i > 0 && blocks[i] == blocks[i - 1] + block_size) {
+      length++;
+    } else {
+      stats->free_extents++;
+      length = 1;
+    }
+    stats->largest_free_extent = std::max(stats->largest_free_extent, length);
+  }
+  stats->free_blocks = blocks.size();
+}
+
+} // namespace
+
+int AnalyzeTree(int fd, const Boot &boot,
+                const PageScanner::PhysicalFn &physical, uint32_t threads,
+                TreeStats *stats) {
+  auto start = std::chrono::steady_clock::now();
+  *stats = TreeStats();
+  NodeLayout layout = NodeLayout::FromBoot(boot);
+  if (layout.block_size == 0) {
+    return -1;
+  }
+  stats->block_size = layout.block_size;
+  stats->max_index_num = layout.max_index_num;
+  stats->max_data_num = layout.max_data_num;
+  stats->file_size = boot.file_size;
+  stats->pages = boot.file_size / layout.block_size;
+  CountFreeExtents(boot, layout.block_size, stats);
+
+  std::vector<PageInfo> infos(stats->pages);
+  PageScanner scanner(fd, layout.block_size, boot.file_size, physical);
+  int64_t bytes = scanner.Scan(threads, [&](off_t offset, const char *page) {
+    if (page == nullptr) {
+      return;
+    }
+    const BpNode *node = (const BpNode *)page;
+    PageInfo &info = infos[offset / layout.block_size];
+    info.read = true;
+    info.type = node->type;
+    info.children = node->children;
+    info.next = node->next;
+    if (node->type == NON_LEAF && node->children > 0) {
+      info.first_sub = layout.Sub(node)[0];
+    }
+  });
+  if (bytes < 0) {
+    return -1;
+  }
+  stats->bytes_read = bytes;
+
+  // 每层从最左边的节点开始沿next走,步数超过页数说明有环
+  constexpr size_t kMaxHeight = 64;
+  auto valid = [&](off_t offset) {
+    return offset >= 0 && offset % layout.block_size == 0 &&
+           (uint64_t)offset < boot.file_size &&
+           infos[offset / layout.block_size].read;
+  };
+  off_t first = (off_t)boot.root_offset;
+  uint64_t jump_pages = 0;
+  int ret = 0;
+  while (first != INVALID_OFFSET && ret == 0) {
+    if (!valid(first) || stats->levels.size() >= kMaxHeight) {
+      ret = 1;
+      break;
+    }
+    int type = infos[first / layout.block_size].type;
+    bool leaf = type == LEAF;
+    uint32_t max = leaf ? layout.max_data_num : layout.max_index_num;
+    LevelStats level;
+    off_t prev_block = -1;
+    for (off_t cur = first; cur != INVALID_OFFSET;) {
+      if (!valid(cur) || level.nodes >= stats->pages) {
+        ret = 1;
+        break;
+      }
+      const PageInfo &info = infos[cur / layout.block_size];
+      AddNode(&level, info.children, max);
+      if (leaf) {
+        // 碎片按文件中实际的位置算,影子分页时是物理块
+        off_t block = physical ? physical(cur) : cur;
+        off_t delta = block - prev_block;
+        if (prev_block >= 0 && delta == (off_t)layout.block_size) {
+          stats->leaf_sequential++;
+        } else {
+          stats->leaf_runs++;
+          if (prev_block >= 0) {
+            (delta > 0 ? stats->leaf_forward : stats->leaf_backward)++;
+            jump_pages += labs(delta) / layout.block_size;
+          }
+        }
+        prev_block = block;
+      }
+      cur = info.next;
+    }
+    level.fill = level.nodes ? (double)level.entries / (level.nodes * max) : 0;
+    stats->levels.push_back(level);
+    if (leaf) {
+      stats->leaves = level.nodes;
+      stats->keys = level.entries;
+      break;
+    }
+    first = infos[first / layout.block_size].first_sub;
+  }
+  stats->height = stats->levels.size();
+  uint64_t jumps = stats->leaf_forward + stats->leaf_backward;
+  stats->leaf_avg_jump = jumps ? (double)jump_pages / jumps : 0;
+  stats->seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return ret;
+}
+
+int AnalyzeFile(const std::string &file_name, uint32_t threads,
+                TreeStats *stats) {
+  TreeFile file;
+  if (file.Open(file_name) != 0) {
+    return -1;
+  }
+  return AnalyzeTree(file.Fd(), file.GetBoot(), file.Physical(), threads,
+                     stats);
+}
@@ -0,0 +1,90 @@
+#include "async_search.h"
+#include "bmap.h"
+#include <algorithm>
+#include <utility>
+
+BAsyncSearcher::BAsyncSearcher(BMap *bmap, uint32_t max_inflight)
+    : bmap_(bmap) {
+  // 每个在等IO的查找引用着一个页,不能把缓存占满,否则热的非叶子节点会被挤掉
+  max_inflight = std::min(max_inflight, bmap_->cache_.Capacity() / 2);
+  max_inflight_ = std::max(1u, max_inflight);
+}
+
+BAsyncSearcher::~BAsyncSearcher() { Run(); }
+
+void BAsyncSearcher::Search(key_t key, Callback callback) {
+  while (Pending() >= max_inflight_ && Poll() == 0) {
+    bmap_->cache_.ReapLoads(true);
+  }
+  // 过滤器判定不存在的直接从无效偏移开始,下次Poll时完成
+  off_t root = bmap_->FilterPass(key) ? (off_t)bmap_->boot_.root_offset
+                                      : (off_t)BMap::INVALID_OFFSET;
+  ready_.push_back(Lookup{key, root, false, std::move(callback)});
+}
+
+bool BAsyncSearcher::Advance(Lookup &lookup) {
+  PageLruCache &cache = bmap_->cache_;
+  for (;;) {
+    if ((uint64_t)lookup.offset == BMap::INVALID_OFFSET) {
+      lookup.callback(lookup.key, 0, false);
+      return true;
+    }
+    if (lookup.fetching) {
+      // 先放掉FetchPage的引用,马上NodeSeek的时候页还在;AIO读失败时
+      // 页已经不在缓存里了,NodeSeek会同步再读一次
+      cache.UnusePage(lookup.offset);
+      lookup.fetching = false;
+    } else if (cache.FetchPage(lookup.offset) == 0) {
+      lookup.fetching = true;
+      return false;
+    }
+    BpNodePtr node = bmap_->NodeSeek(lookup.offset);
+    if (node == NULL) {
+      errors_++;
+      lookup.callback(lookup.key, 0, false);
+      return true;
+    }
+    // 只读,不能把页标成脏页
+    const BpNodePtr &cur = node;
+    int i = bmap_->BNodeBinarySearch(node, lookup.key);
+    if (bmap_->IsLeaf(node)) {
+      lookup.callback(lookup.key, i >= 0 ? cur.Data()[i] : 0, i >= 0);
+      return true;
+    }
+    lookup.offset = cur.Sub()[i >= 0 ? i + 1 : -i - 1];
+  }
+}
+
+uint32_t BAsyncSearcher::Poll() {
+  // 读完的节点可以接着走
+  PageLruCache &cache = bmap_->cache_;
+  cache.ReapLoads(false);
+  for (size_t i = 0; i < waiting_.size();) {
+    if (!cache.Loading(waiting_[i].offset)) {
+      ready_.push_back(std::move(waiting_[i]));
+      waiting_[i] = std::move(waiting_.back());
+      waiting_.pop_back();
+    } else {
+      i++;
+    }
+  }
+  uint32_t done = 0;
+  while (!ready_.empty()) {
+    Lookup lookup = std::move(ready_.front());
+    ready_.pop_front();
+    if (Advance(lookup)) {
+      done++;
+    } else {
+      waiting_.push_back(std::move(lookup));
+    }
+  }
+  return done;
+}
+
+void BAsyncSearcher::Run() {
+  while (Pending() > 0) {
+    if (Poll() == 0) {
+      bmap_->cache_.ReapLoads(true);
+    }
+  }
+}
@@ -0,0 +1,62 @@
+#include "bloom_filter.h"
+#include <algorithm>
+#include <math.h>
+
+void BloomFilter::Init(uint64_t bytes, uint64_t expected_keys) {
+  uint64_t num = bytes / sizeof(Block);
+  // 块下标用哈希的高32位乘块数取高位,块数不能超过2^32
+  num = std::min<uint64_t>(num, 1ull << 32);
+  blocks_.assign(num, Block());
+  if (num == 0) {
+    hashes_ = 0;
+    return;
+  }
+  // 每个key的位数乘ln2是最优的哈希函数个数
+  double bits_per_key =
+      (double)num * kBlockBits / std::max<uint64_t>(expected_keys, 1);
+  hashes_ = std::clamp<uint32_t>(lround(bits_per_key * M_LN2), 1, 16);
+}
+
+void BloomFilter::Clear() {
+  std::fill(blocks_.begin(), blocks_.end(), Block());
+}
+
+uint64_t BloomFilter::Hash(key_t key) {
+  // splitmix64的收尾,相邻的key也能散开
+  uint64_t h = (uint64_t)(uint32_t)key + 0x9e3779b97f4a7c15ull;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+void BloomFilter::Add(key_t key) {
+  if (blocks_.empty()) {
+    return;
+  }
+  uint64_t hash = Hash(key);
+  Block &block = blocks_[BlockIndex(hash)];
+  // 块内的位置用低32位做双重哈希
+  uint32_t h1 = hash & 0xffff;
+  uint32_t h2 = ((hash >> 16) & 0xffff) | 1;
+  for (uint32_t i = 0; i < hashes_; i++) {
+    uint32_t bit = (h1 + i * h2) % kBlockBits;
+    block.words[bit / 64] |= 1ull << (bit % 64);
+  }
+}
+
+bool BloomFilter::MayContain(key_t key) const {
+  if (blocks_.empty()) {
+    return true;
+  }
+  uint64_t hash = Hash(key);
+  const Block &block = blocks_[BlockIndex(hash)];
+  uint32_t h1 = hash & 0xffff;
+  uint32_t h2 = ((hash >> 16) & 0xffff) | 1;
+  for (uint32_t i = 0; i < hashes_; i++) {
+    uint32_t bit = (h1 + i * h2) % kBlockBits;
+    if (!(block.words[bit / 64] & (1ull << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
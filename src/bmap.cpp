@@ -1,13 +1,17 @@
 #include "bmap.h"
+#include <algorithm>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <vector>
 
 int BMap::BCheckConfig(const BConfig &conf) const {
   // 文件名不能太长
@@ -61,19 +65,109 @@ int BMap::BOpen() {
     boot_.WriteToFile(boot_fd_);
   }
 
-  if (cache_.Init(conf_.file_name, conf_.block_size, conf_.cache_size)) {
+  ArenaOptions arena;
+  arena.huge_page = conf_.huge_page;
+  arena.numa_policy = conf_.numa_policy;
+  arena.numa_nodes = conf_.numa_nodes;
+  arena.prefault = conf_.prefault_cache;
+  if (cache_.Init(conf_.file_name, conf_.block_size, conf_.cache_size,
+                  arena)) {
     return -1;
   }
+  cache_.SetOverflowLimit(conf_.max_overflow_pages);
+  cache_.SetFetchDepth(conf_.async_io_depth);
+  // 页尾的校验只能在还没有节点的时候打开,否则节点能放的key数会变
+  if (conf_.page_checksum && boot_.file_size == 0) {
+    boot_.flags |= BOOT_PAGE_CHECKSUM;
+  }
+  if (boot_.flags & BOOT_PAGE_CHECKSUM) {
+    cache_.EnableChecksum(conf_.verify_on_read, boot_.lsn);
+  }
+  // 子树计数同样只能在新文件上打开
+  if (conf_.subtree_counts && boot_.file_size == 0) {
+    boot_.flags |= BOOT_SUBTREE_COUNT;
+  }
+  counted_ = boot_.flags & BOOT_SUBTREE_COUNT;
+  extents_.Init(conf_.block_size);
+  for (uint64_t block : boot_.free_blocks) {
+    extents_.Free(block);
+  }
+  // 之后以extents_为准,boot_复制起来也便宜
+  boot_.free_blocks.clear();
   tree_fd_ = cache_.Fd();
-  max_index_num_ =
-      (boot_.block_size - sizeof(BpNode)) / (sizeof(key_t) + sizeof(off_t));
-  max_data_num_ =
-      (boot_.block_size - sizeof(BpNode)) / (sizeof(key_t) + sizeof(long));
+  // 已经是影子分页的文件只能按影子分页打开
+  if (conf_.durability == DURABILITY_SHADOW || boot_.map_gen > 0) {
+    if (cache_.EnableShadow(conf_.file_name, boot_.file_size, boot_.map_gen,
+                            boot_.map_len)) {
+      return -1;
+    }
+    committed_root_ = boot_.root_offset;
+    committed_file_size_ = boot_.file_size;
+    committed_extents_ = extents_;
+  }
+  // 叶子按next串成链表,预读沿着next走
+  auto next_fn = [](const char *page) -> off_t {
+    const BpNode *node = (const BpNode *)page;
+    return node->next == INVALID_OFFSET ? -1 : node->next;
+  };
+  // 影子分页下页的物理位置和逻辑偏移不一致,不做预读
+  if (!cache_.Shadow() &&
+      cache_.EnableReadahead(conf_.readahead_pages, next_fn)) {
+    return -1;
+  }
+  NodeLayout layout = NodeLayout::FromBoot(boot_);
+  max_index_num_ = layout.max_index_num;
+  max_data_num_ = layout.max_data_num;
+  // 索引节点至少留两个子节点,ParentKeyIndex要用到第一个key
+  leaf_merge_num_ = MergeThreshold(max_data_num_, conf_.merge_percent, 1);
+  index_merge_num_ = MergeThreshold(max_index_num_, conf_.merge_percent, 2);
+  if (!cache_.Shadow()) {
+    // 重做上次没来得及落盘的事务
+    if (wal_.Open(conf_.file_name + ".wal")) {
+      return -1;
+    }
+    if (wal_.Size() > 0) {
+      // 每批前面记着是哪棵树的修改,重做完回到默认树
+      std::string name;
+      wal_.Replay([this, &name](const WriteAheadLog::Entry &entry) {
+        if (entry.op == WriteAheadLog::OP_TREE) {
+          char chunk[sizeof(entry.value)];
+          memcpy(chunk, &entry.value, sizeof(chunk));
+          name.resize(entry.key);
+          name.append(chunk, strnlen(chunk, sizeof(chunk)));
+          return;
+        }
+        TreeSwitch(name);
+        ApplyEntry(entry);
+      });
+      TreeSwitch("");
+      if (WalCheckpoint()) {
+        return -1;
+      }
+    }
+  }
+  if (conf_.filter_bytes > 0 && RebuildFilter() != 0) {
+    return -1;
+  }
+  if (conf_.keep_warm_list) {
+    WarmListLoad();
+  }
   return 0;
 }
 
 int BMap::BClose() {
-  boot_.WriteToFile(boot_fd_);
+  if (conf_.keep_warm_list) {
+    WarmListSave();
+  }
+  cache_.StopPreload();
+  if (cache_.Shadow()) {
+    ShadowCommit();
+  } else if (wal_.Opened()) {
+    WalCheckpoint();
+  } else {
+    cache_.FlushAll();
+    BootWrite(boot_fd_);
+  }
   if (boot_fd_ > 0) {
     close(boot_fd_);
   }
@@ -83,14 +177,106 @@ int BMap::BClose() {
   return 0;
 }
 
+void BMap::WarmListSave() {
+  std::string warm_file = conf_.file_name + ".warm";
+  int fd = open(warm_file.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) {
+    return;
+  }
+  for (off_t offset : cache_.ResidentPages()) {
+    WriteOffset(fd, offset);
+  }
+  close(fd);
+}
+
+void BMap::WarmListLoad() {
+  constexpr uint32_t kWarmThreads = 4;
+  std::string warm_file = conf_.file_name + ".warm";
+  int fd = open(warm_file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  std::vector<off_t> offsets;
+  off_t offset;
+  while ((offset = ReadOffset(fd)) != INVALID_OFFSET &&
+         offsets.size() < conf_.cache_size) {
+    if ((uint64_t)offset < boot_.file_size) {
+      offsets.push_back(offset);
+    }
+  }
+  close(fd);
+  // 只占好缓存位置,真正的读在后台做
+  cache_.Preload(offsets, kWarmThreads, true);
+}
+
+uint32_t BMap::Warm(uint32_t leaf_num, uint32_t threads) {
+  // 先沿最左边走一遍得到树高
+  uint32_t height = 0;
+  for (BpNodePtr node = NodeSeek(boot_.root_offset); node != NULL;
+       node = IsLeaf(node) ? BpNodePtr()
+                           : NodeSeek(std::as_const(node).Sub()[0])) {
+    height++;
+  }
+
+  // 再一层一层往下,每层的页一起读
+  uint32_t resident = 0;
+  std::vector<off_t> level;
+  if (height > 0) {
+    level.push_back(boot_.root_offset);
+  }
+  for (uint32_t depth = 0; depth < height && !level.empty(); depth++) {
+    // 叶子层只读前leaf_num个
+    if (depth == height - 1 && level.size() > leaf_num) {
+      level.resize(leaf_num);
+    }
+    uint32_t num = cache_.Preload(level, threads, false);
+    resident += num;
+    if (num < level.size() || depth == height - 1) {
+      // 缓存放不下了或者已经到叶子层
+      break;
+    }
+    std::vector<off_t> next_level;
+    for (off_t offset : level) {
+      const BpNodePtr node = NodeSeek(offset);
+      next_level.insert(next_level.end(), node.Sub(),
+                        node.Sub() + node->children);
+    }
+    level.swap(next_level);
+  }
+  return resident;
+}
+
+std::unique_ptr<BSnapshot> BMap::Snapshot() {
+  if (!cache_.Shadow()) {
+    return nullptr;
+  }
+  uint64_t seq = cache_.AcquireSnapshot();
+  return std::unique_ptr<BSnapshot>(new BSnapshot(this, seq, committed_root_));
+}
+
+int BMap::ResizeCache(uint32_t cache_size) {
+  if (cache_.Resize(cache_size) != 0) {
+    return -1;
+  }
+  conf_.cache_size = cache_size;
+  return 0;
+}
+
 // 是否叶子节点
 int BMap::IsLeaf(const BpNodePtr &node) const { return node->type == LEAF; }
 
 // 二分查找，如果找到了，返回index
 // 如果没找到，返回比target大的index的负数-1
 int BMap::BNodeBinarySearch(const BpNodePtr &node, key_t target) const {
-  const key_t *arr = node.Key();
   int len = IsLeaf(node) ? node->children : node->children - 1;
+  return KeySearch(node.Key(), len, target, conf_.node_search);
+}
+
+int BMap::KeySearch(const key_t *arr, int len, key_t target,
+                    NodeSearchMode mode) {
+  if (mode == NODE_SEARCH_INTERPOLATION) {
+    return KeyInterpolationSearch(arr, len, target);
+  }
   int low = -1;
   int high = len;
 
@@ -110,6 +296,60 @@ int BMap::BNodeBinarySearch(const BpNodePtr &node, key_t target) const {
   }
 }
 
+int BMap::KeyInterpolationSearch(const key_t *arr, int len, key_t target) {
+  // 插值最多估计这么多次,每次估计后在左右kWindow内夹住target
+  constexpr int kProbes = 2;
+  constexpr int kWindow = 8;
+  if (len == 0 || target <= arr[0]) {
+    return len > 0 && arr[0] == target ? 0 : -1;
+  }
+  if (target > arr[len - 1]) {
+    return -len - 1;
+  }
+  // 始终保持arr[low] < target <= arr[high]
+  int low = 0;
+  int high = len - 1;
+  for (int probe = 0; probe < kProbes && high - low > 2 * kWindow; probe++) {
+    int64_t span = (int64_t)arr[high] - arr[low];
+    int mid = low + (int)((int64_t)(target - (int64_t)arr[low]) *
+                          (high - low) / span);
+    mid = std::min(std::max(mid, low + 1), high - 1);
+    if (arr[mid] < target) {
+      low = mid;
+      int next = std::min(mid + kWindow, high);
+      if (arr[next] >= target) {
+        high = next;
+      }
+    } else {
+      high = mid;
+      int prev = std::max(mid - kWindow, low);
+      if (arr[prev] < target) {
+        low = prev;
+      }
+    }
+  }
+  // 估计得不准(分布很不均匀)时剩下的范围用二分查找
+  while (low + 1 < high) {
+    int mid = low + (high - low) / 2;
+    if (target > arr[mid]) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return arr[high] == target ? high : -high - 1;
+}
+
+void BMap::PrefetchKeys(const key_t *arr, int len) {
+  // 前几次比较的位置和key无关,之后的范围已经很小
+  constexpr int kLevels = 3;
+  for (int step = 2; step <= (1 << kLevels); step *= 2) {
+    for (int j = 1; j < step; j += 2) {
+      __builtin_prefetch(&arr[(int64_t)len * j / step]);
+    }
+  }
+}
+
 // 当前key在父节点中的index
 // 如果找到了,直接返回index
 // 如果没找到,返回-index - 2
@@ -120,6 +360,24 @@ int BMap::ParentKeyIndex(BpNodePtr &parent, key_t key) const {
   return index >= 0 ? index : -index - 2;
 }
 
+uint32_t BMap::MergeThreshold(uint32_t max_num, uint32_t percent,
+                              uint32_t min_num) {
+  uint32_t half = (max_num + 1) / 2;
+  if (percent >= 50) {
+    return half;
+  }
+  return std::min(half, std::max(min_num, max_num * percent / 100));
+}
+
+BpNodePtr BMap::LeafSeek(key_t key) {
+  BpNodePtr node = NodeSeek(boot_.root_offset);
+  while (node != NULL && !IsLeaf(node)) {
+    int i = BNodeBinarySearch(node, key);
+    node = NodeSeek(std::as_const(node).Sub()[i >= 0 ? i + 1 : -i - 1]);
+  }
+  return node;
+}
+
 void BMap::NodeNew(NodeType type, BpNodePtr &node) {
   node->parent = INVALID_OFFSET;
   node->prev = INVALID_OFFSET;
@@ -135,6 +393,11 @@ BpNodePtr BMap::NodeFetch(off_t offset) {
     return BpNodePtr();
   }
   auto iter = cache_.GetPage(offset, false);
+  if (iter == cache_.End()) {
+    // 缓存页帧用完了(见CacheStats::alloc_failures)或者页校验失败
+    node_error_ = true;
+    return BpNodePtr();
+  }
   return BpNodePtr(this, iter);
 }
 
@@ -144,35 +407,155 @@ BpNodePtr BMap::NodeSeek(off_t offset) {
   }
 
   auto iter = cache_.GetPage(offset, false);
+  if (iter == cache_.End()) {
+    // 缓存页帧用完了(见CacheStats::alloc_failures)或者页校验失败
+    node_error_ = true;
+    return BpNodePtr();
+  }
   return BpNodePtr(this, iter);
 }
 
 void BMap::NodeFlush(BpNodePtr &node) {
-  if (node != NULL) {
-    int len = pwrite(tree_fd_, &*node, conf_.block_size, node->self);
-    assert(len == conf_.block_size);
+  // 影子分页下脏页留在缓存里,提交时一起写到新块上
+  if (node != NULL && !cache_.Shadow()) {
+    int ret = cache_.FlushPage(node.cache_iter_);
+    assert(ret == 0);
+    std::ignore = ret;
     // 临时写法
     node.dirty_ = false;
   }
 }
 
-BpNodePtr BMap::GetFreeNode() {
-  PageCacheIter iter;
+BpNodePtr BMap::GetFreeNode(off_t hint) {
   BpNodePtr node_ptr;
-  if (boot_.free_blocks.empty()) {
-    iter = cache_.GetPage(boot_.file_size, true);
-    node_ptr = BpNodePtr(this, iter);
-    node_ptr->self = boot_.file_size;
-    boot_.file_size += conf_.block_size;
-  } else {
-    auto block = boot_.free_blocks.front();
-    boot_.free_blocks.pop_front();
-    iter = cache_.GetPage(block, false);
-    node_ptr = BpNodePtr(this, iter);
+  off_t block = extents_.Alloc(hint);
+  if (block < 0) {
+    if (ExtendFile() != 0) {
+      node_error_ = true;
+      return node_ptr;
+    }
+    block = extents_.Alloc(hint);
   }
+  // 空闲块的旧内容没用,不用从磁盘读
+  cache_.Discard(block);
+  auto iter = cache_.GetPage(block, true);
+  if (iter == cache_.End()) {
+    extents_.Free(block);
+    node_error_ = true;
+    return node_ptr;
+  }
+  node_ptr = BpNodePtr(this, iter);
+  node_ptr->self = block;
   return node_ptr;
 }
 
+int BMap::ExtendFile() {
+  // 影子分页下是逻辑空间,物理块由页表分配,一次扩一页就行
+  uint64_t blocks =
+      cache_.Shadow() ? 1 : std::max<uint32_t>(conf_.extent_pages, 1);
+  uint64_t len = blocks * conf_.block_size;
+  if (blocks > 1 && fallocate(tree_fd_, 0, boot_.file_size, len) != 0 &&
+      errno != EOPNOTSUPP) {
+    return -1;
+  }
+  extents_.AddRange(boot_.file_size, blocks);
+  boot_.file_size += len;
+  return 0;
+}
+
+int BMap::BootWrite(int fd) {
+  auto blocks = extents_.Blocks();
+  boot_.free_blocks.assign(blocks.begin(), blocks.end());
+  boot_.lsn = cache_.Lsn();
+  if (tree_name_.empty()) {
+    int ret = boot_.WriteToFile(fd);
+    boot_.free_blocks.clear();
+    return ret;
+  }
+  // 文件里root_offset是默认树的根,写完再换回来
+  uint64_t root = boot_.root_offset;
+  boot_.root_offset = boot_.trees[""];
+  boot_.trees.erase("");
+  boot_.trees[tree_name_] = root;
+  int ret = boot_.WriteToFile(fd);
+  boot_.trees.erase(tree_name_);
+  boot_.trees[""] = boot_.root_offset;
+  boot_.root_offset = root;
+  boot_.free_blocks.clear();
+  return ret;
+}
+
+void BMap::TreeSwitch(const std::string &name) {
+  if (name == tree_name_) {
+    return;
+  }
+  boot_.trees[tree_name_] = boot_.root_offset;
+  auto iter = boot_.trees.find(name);
+  if (iter == boot_.trees.end()) {
+    boot_.root_offset = INVALID_OFFSET;
+    trees_changed_ = true;
+  } else {
+    boot_.root_offset = iter->second;
+    boot_.trees.erase(iter);
+  }
+  tree_name_ = name;
+  // 修改都已经提交,快照从新的树的根开始
+  committed_root_ = boot_.root_offset;
+  // 分批整理的进度是按上一棵树的key记的
+  rebalance_key_ = std::numeric_limits<key_t>::min();
+  vacuum_key_ = std::numeric_limits<key_t>::min();
+  vacuum_pos_ = 0;
+  vacuum_shrinking_ = false;
+}
+
+int BMap::UseTree(const std::string &name, bool create) {
+  // 名字在日志里按'\0'结尾
+  if (name.find('\0') != std::string::npos) {
+    return -1;
+  }
+  // 事务提交时写到当前的树上,切换了就写错树了
+  if (open_txns_ > 0) {
+    return -1;
+  }
+  if (!create && name != tree_name_ && boot_.trees.count(name) == 0) {
+    return -1;
+  }
+  TreeSwitch(name);
+  return 0;
+}
+
+int BMap::DropTree(const std::string &name) {
+  if (name.empty() || name == tree_name_ || boot_.trees.count(name) == 0) {
+    return -1;
+  }
+  // 切过去删掉所有key,所有的页都会还给空闲段
+  std::string current = tree_name_;
+  TreeSwitch(name);
+  int ret = BplusTreeDeleteRange(std::numeric_limits<key_t>::min(),
+                                 std::numeric_limits<key_t>::max());
+  TreeSwitch(current);
+  if (ret != 0) {
+    return -1;
+  }
+  boot_.trees.erase(name);
+  trees_changed_ = true;
+  return cache_.Shadow() ? ShadowCommit() : WalCheckpoint();
+}
+
+std::vector<std::string> BMap::ListTrees() const {
+  std::vector<std::string> names;
+  for (auto &[name, root] : boot_.trees) {
+    if (!name.empty()) {
+      names.push_back(name);
+    }
+  }
+  if (!tree_name_.empty()) {
+    names.insert(std::lower_bound(names.begin(), names.end(), tree_name_),
+                 tree_name_);
+  }
+  return names;
+}
+
 void BMap::NodeDelete(BpNodePtr &node, BpNodePtr &left, BpNodePtr &right) {
   // 先修改左右相邻节点的prev和next指针
   if (left != NULL) {
@@ -190,53 +573,248 @@ void BMap::NodeDelete(BpNodePtr &node, BpNodePtr &left, BpNodePtr &right) {
       NodeFlush(right);
     }
   }
-  // 再修改boot的free_blocks
+  // 再把块还给空闲空间
   assert(node->self != INVALID_OFFSET);
-  boot_.free_blocks.push_back(node->self);
+  extents_.Free(node->self);
 }
 
 void BMap::SubNodeUpdate(BpNodePtr &parent, int index, BpNodePtr &sub_node) {
   assert(sub_node->self != INVALID_OFFSET);
   parent.Sub()[index] = sub_node->self;
+  SubCountUpdate(parent, index, sub_node);
   sub_node->parent = parent->self;
   NodeFlush(sub_node);
 }
 
-void BMap::SubNodeFlush(BpNodePtr &parent, off_t sub_offset) {
+uint64_t BMap::SubtreeCount(const BpNodePtr &node) const {
+  if (IsLeaf(node)) {
+    return node->children;
+  }
+  uint64_t count = 0;
+  for (uint32_t i = 0; i < node->children; i++) {
+    count += node.Count()[i];
+  }
+  return count;
+}
+
+void BMap::SubCountUpdate(BpNodePtr &parent, int index,
+                          const BpNodePtr &sub_node) {
+  if (counted_) {
+    parent.Count()[index] = SubtreeCount(sub_node);
+  }
+}
+
+void BMap::SubCountFix(key_t key) {
+  if (!counted_) {
+    return;
+  }
+  std::vector<BpNodePtr> path;
+  std::vector<int> index;
+  BpNodePtr node = NodeSeek(boot_.root_offset);
+  while (node != NULL && !IsLeaf(node)) {
+    int i = BNodeBinarySearch(node, key);
+    i = i >= 0 ? i + 1 : -i - 1;
+    BpNodePtr sub = NodeSeek(std::as_const(node).Sub()[i]);
+    path.push_back(std::move(node));
+    index.push_back(i);
+    node = std::move(sub);
+  }
+  if (node == NULL) {
+    return;
+  }
+  // 从下往上,孩子的计数改好了才能算父节点的
+  uint64_t count = SubtreeCount(node);
+  for (int level = (int)path.size() - 1; level >= 0; level--) {
+    BpNodePtr &parent = path[level];
+    if (std::as_const(parent).Count()[index[level]] != count) {
+      parent.Count()[index[level]] = count;
+      NodeFlush(parent);
+    }
+    count = SubtreeCount(parent);
+  }
+}
+
+void BMap::SubMove(BpNodePtr &dst, int dst_index, const BpNodePtr &src,
+                   int src_index, int num) {
+  memmove(&dst.Sub()[dst_index], &src.Sub()[src_index], num * sizeof(off_t));
+  if (counted_) {
+    memmove(&dst.Count()[dst_index], &src.Count()[src_index],
+            num * sizeof(uint64_t));
+  }
+}
+
+int BMap::SubNodeFlush(BpNodePtr &parent, off_t sub_offset) {
   BpNodePtr sub_node = NodeFetch(sub_offset);
-  assert(sub_node != NULL);
+  if (sub_node == NULL) {
+    return -1;
+  }
   sub_node->parent = parent->self;
   NodeFlush(sub_node);
+  return 0;
 }
 
-std::pair<long, bool> BMap::BplusTreeSearch(key_t key) {
+std::pair<long, bool> BMap::BplusTreeSearch(key_t key, int *error) {
   long vaule;
   bool find = false;
+  if (!FilterPass(key)) {
+    return {0, false};
+  }
   BpNodePtr node = NodeSeek(boot_.root_offset);
+  // 只读,不能把页标成脏页
+  const BpNodePtr &cur = node;
   while (node != NULL) {
     // 找到第一个大于等于key的
     int i = BNodeBinarySearch(node, key);
     if (IsLeaf(node)) {
       if (i >= 0) {
         find = true;
-        vaule = node.Data()[i];
+        vaule = cur.Data()[i];
       }
       break;
     } else {
       if (i >= 0) {
         // 非叶子节点,key的index比data的index少1
-        node = NodeSeek(node.Sub()[i + 1]);
+        node = NodeSeek(cur.Sub()[i + 1]);
       } else {
         i = -i - 1; // 找到第一个大于key的
         // 非叶子节点,key的index比data的index少1,所以i是小于key的最大的节点
-        node = NodeSeek(node.Sub()[i]);
+        node = NodeSeek(cur.Sub()[i]);
       }
     }
   }
+  // 只有节点读不到时才会在叶子之前走到空
+  if (node == NULL && boot_.root_offset != INVALID_OFFSET) {
+    if (error) {
+      *error = -1;
+    }
+    return {0, false};
+  }
 
+  if (!find && filter_.Enabled()) {
+    filter_stats_.false_positives++;
+  }
   return {vaule, find};
 }
 
+int BMap::BplusTreeMultiSearch(const key_t *keys, uint32_t num, long *values,
+                               bool *found) {
+  // 一组同时走的查找数,大致是CPU能同时挂着的缓存缺失数
+  constexpr uint32_t kGroup = 16;
+  BpNodePtr nodes[kGroup];
+  off_t offsets[kGroup];
+  int slots[kGroup];
+  int count = 0;
+  bool failed = false;
+  for (uint32_t base = 0; base < num; base += kGroup) {
+    uint32_t n = std::min(kGroup, num - base);
+    uint32_t passed = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      // 过滤器判定不存在的不用往下走
+      bool pass = FilterPass(keys[base + i]);
+      offsets[i] = pass ? boot_.root_offset : INVALID_OFFSET;
+      slots[i] = -1;
+      passed += pass;
+    }
+    // 树是平衡的,同一组的查找在同一层走到叶子
+    bool leaf = false;
+    while (!leaf) {
+      bool any = false;
+      // 先预取这一层所有节点的页头
+      for (uint32_t i = 0; i < n; i++) {
+        if (offsets[i] != INVALID_OFFSET) {
+          cache_.PrefetchPage(offsets[i]);
+        }
+      }
+      // 再拿到节点,预取二分会访问的key
+      for (uint32_t i = 0; i < n; i++) {
+        if (offsets[i] == INVALID_OFFSET) {
+          continue;
+        }
+        nodes[i] = NodeSeek(offsets[i]);
+        const BpNodePtr &cur = nodes[i];
+        if (cur == NULL) {
+          offsets[i] = INVALID_OFFSET;
+          failed = true;
+          continue;
+        }
+        any = true;
+        PrefetchKeys(cur.Key(), cur->children);
+      }
+      if (!any) {
+        break;
+      }
+      // 最后比较,走到下一层
+      for (uint32_t i = 0; i < n; i++) {
+        const BpNodePtr &cur = nodes[i];
+        if (cur == NULL) {
+          continue;
+        }
+        int k = BNodeBinarySearch(cur, keys[base + i]);
+        if (IsLeaf(cur)) {
+          leaf = true;
+          slots[i] = k;
+          if (k >= 0) {
+            __builtin_prefetch(&cur.Data()[k]);
+          }
+        } else {
+          offsets[i] = cur.Sub()[k >= 0 ? k + 1 : -k - 1];
+          nodes[i] = BpNodePtr();
+        }
+      }
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      const BpNodePtr &cur = nodes[i];
+      found[base + i] = cur != NULL && slots[i] >= 0;
+      values[base + i] = found[base + i] ? cur.Data()[slots[i]] : 0;
+      passed -= found[base + i];
+      count += found[base + i];
+      nodes[i] = BpNodePtr();
+    }
+    if (filter_.Enabled()) {
+      filter_stats_.false_positives += passed;
+    }
+  }
+  return failed ? -1 : count;
+}
+
+int BMap::BplusTreeScan(key_t start, key_t end,
+                        const std::function<bool(key_t, long)> &fn) {
+  if (start > end) {
+    return 0;
+  }
+  // 先找到start所在的叶子
+  BpNodePtr node = LeafSeek(start);
+  if (node == NULL) {
+    // 空树,或者节点读不到
+    return boot_.root_offset == INVALID_OFFSET ? 0 : -1;
+  }
+  int i = BNodeBinarySearch(node, start);
+  i = i >= 0 ? i : -i - 1;
+
+  // 再沿着叶子链表往后走
+  int count = 0;
+  while (node != NULL) {
+    const BpNodePtr &leaf = node;
+    for (; i < (int)leaf->children; i++) {
+      key_t key = leaf.Key()[i];
+      if (key > end) {
+        return count;
+      }
+      count++;
+      if (!fn(key, leaf.Data()[i])) {
+        return count;
+      }
+    }
+    off_t next = leaf->next;
+    node = NodeSeek(next);
+    if (node == NULL && next != INVALID_OFFSET) {
+      return -1;
+    }
+    i = 0;
+  }
+  return count;
+}
+
 void BMap::LeftNodeAdd(BpNodePtr &node, BpNodePtr &left) {
   BpNodePtr prev = NodeFetch(node->prev);
   if (prev != NULL) {
@@ -265,11 +843,16 @@ void BMap::RightNodeAdd(BpNodePtr &node, BpNodePtr &right) {
 int BMap::ParentNodeBuild(BpNodePtr &l_ch, BpNodePtr &r_ch, key_t key) {
   if (l_ch->parent == INVALID_OFFSET && r_ch->parent == INVALID_OFFSET) {
     /* new parent */
-    BpNodePtr parent = GetFreeNode();
+    BpNodePtr parent = GetFreeNode(r_ch->self);
+    if (parent == NULL) {
+      return -1;
+    }
     NodeNew(NON_LEAF, parent);
     parent.Key()[0] = key;
     parent.Sub()[0] = l_ch->self;
     parent.Sub()[1] = r_ch->self;
+    SubCountUpdate(parent, 0, l_ch);
+    SubCountUpdate(parent, 1, r_ch);
 
     parent->children = 2;
     /* write new parent and update root */
@@ -283,9 +866,15 @@ int BMap::ParentNodeBuild(BpNodePtr &l_ch, BpNodePtr &r_ch, key_t key) {
     return 0;
   } else if (r_ch->parent == INVALID_OFFSET) {
     BpNodePtr tmp_pa = NodeFetch(l_ch->parent);
+    if (tmp_pa == NULL) {
+      return -1;
+    }
     return NonLeafInsert(tmp_pa, l_ch, r_ch, key);
   } else {
-    BpNodePtr tmp_pa = NodeFetch(l_ch->parent);
+    BpNodePtr tmp_pa = NodeFetch(r_ch->parent);
+    if (tmp_pa == NULL) {
+      return -1;
+    }
     return NonLeafInsert(tmp_pa, l_ch, r_ch, key);
   }
 }
@@ -309,13 +898,12 @@ key_t BMap::NonLeafSplitLeft(BpNodePtr &node, BpNodePtr &left, BpNodePtr &l_ch,
   /* sum = left->children = pivot + (split - pivot) + 1 */
   /* replicate from key[0] to key[insert] in original node */
   memmove(&left.Key()[0], &node.Key()[0], pivot * sizeof(key_t));
-  memmove(&left.Sub()[0], &node.Sub()[0], pivot * sizeof(off_t));
+  SubMove(left, 0, node, 0, pivot);
 
   /* replicate from key[insert] to key[split] in original node */
   memmove(&left.Key()[pivot + 1], &node.Key()[pivot],
           (split - pivot) * sizeof(key_t));
-  memmove(&left.Sub()[pivot + 1], &node.Sub()[pivot],
-          (split - pivot) * sizeof(off_t));
+  SubMove(left, pivot + 1, node, pivot, split - pivot);
 
   /* flush sub-nodes of the new splitted left node */
   for (i = 0; i < left->children; i++) {
@@ -333,7 +921,7 @@ key_t BMap::NonLeafSplitLeft(BpNodePtr &node, BpNodePtr &left, BpNodePtr &l_ch,
   /* right node left shift from key[split] to key[children - 2] */
   memmove(&node.Key()[0], &node.Key()[split],
           (node->children - 1) * sizeof(key_t));
-  memmove(&node.Sub()[0], &node.Sub()[split], (node->children) * sizeof(off_t));
+  SubMove(node, 0, node, split, node->children);
 
   return split_key;
 }
@@ -363,8 +951,7 @@ key_t BMap::NonLeafSplitMiddle(BpNodePtr &node, BpNodePtr &right,
   /* replicate from key[split] to key[_max_order - 2] */
   memmove(&right.Key()[pivot + 1], &node.Key()[split],
           (right->children - 2) * sizeof(key_t));
-  memmove(&right.Sub()[pivot + 2], &node.Sub()[split + 1],
-          (right->children - 2) * sizeof(off_t));
+  SubMove(right, pivot + 2, node, split + 1, right->children - 2);
 
   /* flush sub-nodes of the new splitted right node */
   for (i = pivot + 2; i < right->children; i++) {
@@ -393,7 +980,7 @@ key_t BMap::NonLeafSplitRight(BpNodePtr &node, BpNodePtr &right,
   /* sum = right->children = pivot + 2 + (_max_order - insert - 1) */
   /* replicate from key[split + 1] to key[insert] */
   memmove(&right.Key()[0], &node.Key()[split + 1], pivot * sizeof(key_t));
-  memmove(&right.Sub()[0], &node.Sub()[split + 1], pivot * sizeof(off_t));
+  SubMove(right, 0, node, split + 1, pivot);
 
   /* insert new key and sub-node */
   right.Key()[pivot] = key;
@@ -403,8 +990,7 @@ key_t BMap::NonLeafSplitRight(BpNodePtr &node, BpNodePtr &right,
   /* replicate from key[insert] to key[order - 1] */
   memmove(&right.Key()[pivot + 1], &node.Key()[insert],
           (max_index_num_ - insert - 1) * sizeof(key_t));
-  memmove(&right.Sub()[pivot + 2], &node.Sub()[insert + 1],
-          (max_index_num_ - insert - 1) * sizeof(off_t));
+  SubMove(right, pivot + 2, node, insert + 1, max_index_num_ - insert - 1);
 
   /* flush sub-nodes of the new splitted right node */
   for (i = 0; i < right->children; i++) {
@@ -420,8 +1006,7 @@ void BMap::NonLeafSimpleInsert(BpNodePtr &node, BpNodePtr &l_ch,
                                BpNodePtr &r_ch, key_t key, int insert) {
   memmove(&node.Key()[insert + 1], &node.Key()[insert],
           (node->children - 1 - insert) * sizeof(key_t));
-  memmove(&node.Sub()[insert + 2], &node.Sub()[insert + 1],
-          (node->children - 1 - insert) * sizeof(off_t));
+  SubMove(node, insert + 2, node, insert + 1, node->children - 1 - insert);
   /* insert new key and sub-nodes */
   node.Key()[insert] = key;
   SubNodeUpdate(node, insert, l_ch);
@@ -442,7 +1027,10 @@ int BMap::NonLeafInsert(BpNodePtr &node, BpNodePtr &l_ch, BpNodePtr &r_ch,
     /* split = [m/2] */
     // 这里split是分裂后右边的第一个位置
     int split = node->children / 2;
-    BpNodePtr sibling = GetFreeNode();
+    BpNodePtr sibling = GetFreeNode(node->self);
+    if (sibling == NULL) {
+      return -1;
+    }
     NodeNew(NON_LEAF, sibling);
     if (insert < split) {
       split_key =
@@ -454,6 +1042,10 @@ int BMap::NonLeafInsert(BpNodePtr &node, BpNodePtr &l_ch, BpNodePtr &r_ch,
       split_key =
           NonLeafSplitRight(node, sibling, l_ch, r_ch, key, insert, split);
     }
+    if (node_error_) {
+      // 兄弟或者搬走的孩子读不到,这一层已经不完整了
+      return -1;
+    }
 
     /* build new parent */
     if (insert < split) {
@@ -479,7 +1071,7 @@ key_t BMap::LeafSplitLeft(BpNodePtr &leaf, BpNodePtr &left, key_t key,
   /* calculate split leaves' children (sum as (entries + 1)) */
   int pivot = insert;
   left->children = split;
-  leaf->children = max_index_num_ - split + 1;
+  leaf->children = max_data_num_ - split + 1;
 
   /* sum = left->children = pivot + 1 + (split - pivot - 1) */
   /* replicate from key[0] to key[insert] */
@@ -529,9 +1121,9 @@ key_t BMap::LeafSplitRight(BpNodePtr &leaf, BpNodePtr &right, key_t key,
 
   /* replicate from key[insert] to key[children - 1] in original leaf */
   memmove(&right.Key()[pivot + 1], &leaf.Key()[insert],
-          (max_index_num_ - insert) * sizeof(key_t));
+          (max_data_num_ - insert) * sizeof(key_t));
   memmove(&right.Data()[pivot + 1], &leaf.Data()[insert],
-          (max_index_num_ - insert) * sizeof(long));
+          (max_data_num_ - insert) * sizeof(long));
 
   return right.Key()[0];
 }
@@ -557,13 +1149,19 @@ int BMap::LeafInsert(BpNodePtr &leaf, key_t key, long data) {
   }
   // insert是第一个比key大的index,也就是要插入的index
   insert = -insert - 1;
+  filter_.Add(key);
+  filter_added_++;
 
   /* leaf is full */
   if (leaf->children == max_data_num_) {
     key_t split_key;
     /* split = [m/2] */
     int split = (max_data_num_ + 1) / 2;
-    BpNodePtr sibling = GetFreeNode();
+    // 新叶子放在原来的叶子旁边,扫描时还是顺序读
+    BpNodePtr sibling = GetFreeNode(leaf->self);
+    if (sibling == NULL) {
+      return -1;
+    }
     NodeNew(LEAF, sibling);
     /* sibling leaf replication due to location of insertion */
     if (insert < split) {
@@ -571,6 +1169,9 @@ int BMap::LeafInsert(BpNodePtr &leaf, key_t key, long data) {
     } else {
       split_key = LeafSplitRight(leaf, sibling, key, data, insert);
     }
+    if (node_error_) {
+      return -1;
+    }
 
     /* build new parent */
     if (insert < split) {
@@ -587,28 +1188,178 @@ int BMap::LeafInsert(BpNodePtr &leaf, key_t key, long data) {
 }
 
 int BMap::BplusTreeInsert(key_t key, long ldata) {
+  Boot saved = WriteBegin();
+  int ret = CommitWrite(TreeInsert(key, ldata), saved);
+  FilterMaintain();
+  return ret;
+}
+
+int BMap::BplusTreeWriteBatch(const BWriteOp *ops, uint32_t num, int *rets) {
+  // 按key顺序做,相邻的操作大多落在刚访问过的叶子上
+  std::vector<uint32_t> order(num);
+  for (uint32_t i = 0; i < num; i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [ops](uint32_t a, uint32_t b) {
+    return ops[a].key < ops[b].key;
+  });
+  // 原地写模式先写redo日志,做了一部分再重做整批和只做一次的结果一样
+  bool shadow = cache_.Shadow();
+  if (!shadow) {
+    std::vector<WriteAheadLog::Entry> entries;
+    for (uint32_t i : order) {
+      const BWriteOp &op = ops[i];
+      WriteAheadLog::Op type = op.type == BWriteOp::INSERT
+                                   ? WriteAheadLog::OP_INSERT
+                               : op.type == BWriteOp::UPSERT
+                                   ? WriteAheadLog::OP_PUT
+                                   : WriteAheadLog::OP_DELETE;
+      entries.push_back(WriteAheadLog::Entry{op.key, type, op.value});
+    }
+    if (wal_.Append(WalBatch(entries)) != 0) {
+      return -1;
+    }
+  }
+  Boot saved = WriteBegin();
+  for (uint32_t i : order) {
+    const BWriteOp &op = ops[i];
+    long value = op.value;
+    if (op.type == BWriteOp::INSERT) {
+      rets[i] = TreeInsert(op.key, value);
+    } else if (op.type == BWriteOp::UPSERT) {
+      rets[i] = TreeUpdate(
+          op.key, [value](const long *) { return value; }, true, nullptr);
+    } else {
+      rets[i] = TreeDelete(op.key);
+    }
+  }
+  // 失败时这批还在日志里,重新打开时重做
+  if (CommitWrite(0, saved) != 0 || (!shadow && WalCheckpoint() != 0)) {
+    return -1;
+  }
+  FilterMaintain();
+  return 0;
+}
+
+int BMap::BplusTreeUpdate(key_t key, long ldata) {
+  Boot saved = WriteBegin();
+  int ret = TreeUpdate(
+      key, [ldata](const long *) { return ldata; }, false, nullptr);
+  return CommitWrite(ret, saved);
+}
+
+int BMap::BplusTreeUpsert(key_t key, long ldata) {
+  Boot saved = WriteBegin();
+  int ret = TreeUpdate(
+      key, [ldata](const long *) { return ldata; }, true, nullptr);
+  ret = CommitWrite(ret, saved);
+  FilterMaintain();
+  return ret;
+}
+
+int BMap::BplusTreeMerge(key_t key, const std::function<long(long)> &fn,
+                         long *result) {
+  Boot saved = WriteBegin();
+  int ret = TreeUpdate(
+      key, [&fn](const long *old) { return fn(*old); }, false, result);
+  return CommitWrite(ret, saved);
+}
+
+int BMap::BplusTreeIncrement(key_t key, long delta, long *result) {
+  Boot saved = WriteBegin();
+  int ret = TreeUpdate(
+      key, [delta](const long *old) { return old ? *old + delta : delta; },
+      true, result);
+  ret = CommitWrite(ret, saved);
+  FilterMaintain();
+  return ret;
+}
+
+Boot BMap::WriteBegin() {
+  node_error_ = false;
+  return boot_;
+}
+
+int BMap::CommitWrite(int ret, const Boot &saved) {
+  bool failed = node_error_;
+  node_error_ = false;
+  if (cache_.Shadow() && (failed || ShadowCommit() != 0)) {
+    ShadowRollback(saved);
+    return -1;
+  }
+  return failed ? -1 : ret;
+}
+
+int BMap::TreeUpdate(key_t key, const UpdateFn &fn, bool insert,
+                     long *result) {
+  // 只读下降,路上的索引页不会变成脏页
+  BpNodePtr node = LeafSeek(key);
+  if (node != NULL) {
+    int i = BNodeBinarySearch(node, key);
+    if (i >= 0) {
+      // 原地改值,只写这一个叶子
+      long value = fn(&std::as_const(node).Data()[i]);
+      node.Data()[i] = value;
+      NodeFlush(node);
+      if (result) {
+        *result = value;
+      }
+      return 0;
+    }
+  }
+  if (!insert) {
+    return -1;
+  }
+  long value = fn(nullptr);
+  if (result) {
+    *result = value;
+  }
+  if (node == NULL) {
+    return TreeInsert(key, value);
+  }
+  int ret = LeafInsert(node, key, value);
+  if (ret == 0) {
+    SubCountFix(key);
+  }
+  return ret;
+}
+
+int BMap::TreeInsert(key_t key, long ldata) {
   BpNodePtr node = NodeSeek(boot_.root_offset);
   while (node != NULL) {
     if (IsLeaf(node)) {
-      return LeafInsert(node, key, ldata);
+      int ret = LeafInsert(node, key, ldata);
+      if (ret == 0) {
+        SubCountFix(key);
+      }
+      return ret;
     } else {
       int i = BNodeBinarySearch(node, key);
       if (i >= 0) {
-        node = NodeSeek(node.Sub()[i + 1]);
+        node = NodeSeek(std::as_const(node).Sub()[i + 1]);
       } else {
         i = -i - 1;
-        node = NodeSeek(node.Sub()[i]);
+        node = NodeSeek(std::as_const(node).Sub()[i]);
       }
     }
   }
 
+  if (boot_.root_offset != INVALID_OFFSET) {
+    // 往下走时节点读不到
+    return -1;
+  }
   /* new root */
   BpNodePtr root = GetFreeNode();
+  if (root == NULL) {
+    return -1;
+  }
   NodeNew(LEAF, root);
 
   root.Key()[0] = key;
   root.Data()[0] = ldata;
   root->children = 1;
+  filter_.Add(key);
+  filter_added_++;
   boot_.root_offset = root->self;
   cache_.SyncPage(root->self);
   return 0;
@@ -635,14 +1386,14 @@ void BMap::NonLeafShiftFromLeft(BpNodePtr &node, BpNodePtr &left,
                                 int remove) {
   /* node's elements right shift */
   memmove(&node.Key()[1], &node.Key()[0], remove * sizeof(key_t));
-  memmove(&node.Sub()[1], &node.Sub()[0], (remove + 1) * sizeof(off_t));
+  SubMove(node, 1, node, 0, remove + 1);
 
   /* parent key right rotation */
   node.Key()[0] = parent.Key()[parent_key_index];
   parent.Key()[parent_key_index] = left.Key()[left->children - 2];
 
   /* borrow the last sub-node from left sibling */
-  node.Sub()[0] = left.Sub()[left->children - 1];
+  SubMove(node, 0, left, left->children - 1, 1);
   SubNodeFlush(node, node.Sub()[0]);
 
   left->children--;
@@ -657,14 +1408,13 @@ void BMap::NonLeafMergeIntoLeft(BpNodePtr &node, BpNodePtr &left,
   /* merge into left sibling */
   /* key sum = node->children - 2 */
   memmove(&left.Key()[left->children], &node.Key()[0], remove * sizeof(key_t));
-  memmove(&left.Sub()[left->children], &node.Sub()[0],
-          (remove + 1) * sizeof(off_t));
+  SubMove(left, left->children, node, 0, remove + 1);
 
   /* sub-node sum = node->children - 1 */
   memmove(&left.Key()[left->children + remove], &node.Key()[remove + 1],
           (node->children - remove - 2) * sizeof(key_t));
-  memmove(&left.Sub()[left->children + remove + 1], &node.Sub()[remove + 2],
-          (node->children - remove - 2) * sizeof(off_t));
+  SubMove(left, left->children + remove + 1, node, remove + 2,
+          node->children - remove - 2);
 
   /* flush sub-nodes of the new merged left node */
   int i, j;
@@ -682,15 +1432,14 @@ void BMap::NonLeafShiftFromRight(BpNodePtr &node, BpNodePtr &right,
   parent.Key()[parent_key_index] = right.Key()[0];
 
   /* borrow the frist sub-node from right sibling */
-  node.Sub()[node->children] = right.Sub()[0];
+  SubMove(node, node->children, right, 0, 1);
   SubNodeFlush(node, node.Sub()[node->children]);
   node->children++;
 
   /* right sibling left shift*/
   memmove(&right.Key()[0], &right.Key()[1],
           (right->children - 2) * sizeof(key_t));
-  memmove(&right.Sub()[0], &right.Sub()[1],
-          (right->children - 1) * sizeof(off_t));
+  SubMove(right, 0, right, 1, right->children - 1);
 
   right->children--;
 }
@@ -704,8 +1453,7 @@ void BMap::NonLeafMergeFromRight(BpNodePtr &node, BpNodePtr &right,
   /* merge from right sibling */
   memmove(&node.Key()[node->children - 1], &right.Key()[0],
           (right->children - 1) * sizeof(key_t));
-  memmove(&node.Sub()[node->children - 1], &right.Sub()[0],
-          right->children * sizeof(off_t));
+  SubMove(node, node->children - 1, right, 0, right->children);
 
   /* flush sub-nodes of the new merged node */
   int i, j;
@@ -720,17 +1468,19 @@ void BMap::NonLeafSimpleRemove(BpNodePtr &node, int remove) {
   assert(node->children >= 2);
   memmove(&node.Key()[remove], &node.Key()[remove + 1],
           (node->children - remove - 2) * sizeof(key_t));
-  memmove(&node.Sub()[remove + 1], &node.Sub()[remove + 2],
-          (node->children - remove - 2) * sizeof(off_t));
+  SubMove(node, remove + 1, node, remove + 2, node->children - remove - 2);
   node->children--;
 }
 
-void BMap::NonLeafRemove(BpNodePtr &node, int remove) {
+int BMap::NonLeafRemove(BpNodePtr &node, int remove) {
   if (node->parent == INVALID_OFFSET) {
     /* node is the root */
     if (node->children == 2) {
       /* replace old root with the first sub-node */
       BpNodePtr root = NodeFetch(node.Sub()[0]);
+      if (root == NULL) {
+        return -1;
+      }
       root->parent = INVALID_OFFSET;
       boot_.root_offset = root->self;
       BpNodePtr null_node;
@@ -740,10 +1490,15 @@ void BMap::NonLeafRemove(BpNodePtr &node, int remove) {
       NonLeafSimpleRemove(node, remove);
       NodeFlush(node);
     }
-  } else if (node->children <= (max_index_num_ + 1) / 2) {
+  } else if (node->children <= index_merge_num_) {
     BpNodePtr l_sib = NodeFetch(node->prev);
     BpNodePtr r_sib = NodeFetch(node->next);
     BpNodePtr parent = NodeFetch(node->parent);
+    // 读不到时还什么都没改
+    if (parent == NULL || (l_sib == NULL && node->prev != INVALID_OFFSET) ||
+        (r_sib == NULL && node->next != INVALID_OFFSET)) {
+      return -1;
+    }
 
     int i = ParentKeyIndex(parent, node.Key()[0]);
 
@@ -751,6 +1506,8 @@ void BMap::NonLeafRemove(BpNodePtr &node, int remove) {
     if (SiblingSelect(l_sib, r_sib, parent, i) == LEFT_SIBLING) {
       if (l_sib->children > (max_index_num_ + 1) / 2) {
         NonLeafShiftFromLeft(node, l_sib, parent, i, remove);
+        SubCountUpdate(parent, i, l_sib);
+        SubCountUpdate(parent, i + 1, node);
         /* flush nodes */
         NodeFlush(node);
         NodeFlush(l_sib);
@@ -758,17 +1515,28 @@ void BMap::NonLeafRemove(BpNodePtr &node, int remove) {
         NodeFlush(parent);
       } else {
         NonLeafMergeIntoLeft(node, l_sib, parent, i, remove);
+        SubCountUpdate(parent, i, l_sib);
         /* delete empty node and flush */
         NodeDelete(node, l_sib, r_sib);
         /* trace upwards */
-        NonLeafRemove(parent, i);
+        return NonLeafRemove(parent, i);
       }
     } else {
+      BpNodePtr rr_sib;
+      if (r_sib->children <= (max_index_num_ + 1) / 2) {
+        // 要和右兄弟合并,先读它的右邻居
+        rr_sib = NodeFetch(r_sib->next);
+        if (rr_sib == NULL && r_sib->next != INVALID_OFFSET) {
+          return -1;
+        }
+      }
       /* remove at first in case of overflow during merging with sibling */
       NonLeafSimpleRemove(node, remove);
 
       if (r_sib->children > (max_index_num_ + 1) / 2) {
         NonLeafShiftFromRight(node, r_sib, parent, i + 1);
+        SubCountUpdate(parent, i + 1, node);
+        SubCountUpdate(parent, i + 2, r_sib);
         /* flush nodes */
         NodeFlush(node);
         NodeFlush(l_sib);
@@ -776,18 +1544,19 @@ void BMap::NonLeafRemove(BpNodePtr &node, int remove) {
         NodeFlush(parent);
       } else {
         NonLeafMergeFromRight(node, r_sib, parent, i + 1);
+        SubCountUpdate(parent, i + 1, node);
         /* delete empty right sibling and flush */
-        BpNodePtr rr_sib = NodeFetch(r_sib->next);
         NodeDelete(r_sib, node, rr_sib);
         NodeFlush(l_sib);
         /* trace upwards */
-        NonLeafRemove(parent, i + 1);
+        return NonLeafRemove(parent, i + 1);
       }
     }
   } else {
     NonLeafSimpleRemove(node, remove);
     NodeFlush(node);
   }
+  return 0;
 }
 
 void BMap::LeafShiftFromLeft(BpNodePtr &leaf, BpNodePtr &left,
@@ -872,10 +1641,15 @@ int BMap::LeafRemove(BpNodePtr &leaf, key_t key) {
       LeafSimpleRemove(leaf, remove);
       NodeFlush(leaf);
     }
-  } else if (leaf->children <= (max_data_num_ + 1) / 2) {
+  } else if (leaf->children <= leaf_merge_num_) {
     BpNodePtr l_sib = NodeFetch(leaf->prev);
     BpNodePtr r_sib = NodeFetch(leaf->next);
     BpNodePtr parent = NodeFetch(leaf->parent);
+    // 读不到时还什么都没改
+    if (parent == NULL || (l_sib == NULL && leaf->prev != INVALID_OFFSET) ||
+        (r_sib == NULL && leaf->next != INVALID_OFFSET)) {
+      return -1;
+    }
 
     int i = ParentKeyIndex(parent, leaf.Key()[0]);
 
@@ -883,6 +1657,8 @@ int BMap::LeafRemove(BpNodePtr &leaf, key_t key) {
     if (SiblingSelect(l_sib, r_sib, parent, i) == LEFT_SIBLING) {
       if (l_sib->children > (max_data_num_ + 1) / 2) {
         LeafShiftFromLeft(leaf, l_sib, parent, i, remove);
+        SubCountUpdate(parent, i, l_sib);
+        SubCountUpdate(parent, i + 1, leaf);
         /* flush leaves */
         NodeFlush(leaf);
         NodeFlush(l_sib);
@@ -890,17 +1666,28 @@ int BMap::LeafRemove(BpNodePtr &leaf, key_t key) {
         NodeFlush(parent);
       } else {
         LeafMergeIntoLeft(leaf, l_sib, i, remove);
+        SubCountUpdate(parent, i, l_sib);
         /* delete empty leaf and flush */
         NodeDelete(leaf, l_sib, r_sib);
         /* trace upwards */
-        NonLeafRemove(parent, i);
+        return NonLeafRemove(parent, i);
       }
     } else {
+      BpNodePtr rr_sib;
+      if (r_sib->children <= (max_data_num_ + 1) / 2) {
+        // 要和右兄弟合并,先读它的右邻居
+        rr_sib = NodeFetch(r_sib->next);
+        if (rr_sib == NULL && r_sib->next != INVALID_OFFSET) {
+          return -1;
+        }
+      }
       /* remove at first in case of overflow during merging with sibling */
       LeafSimpleRemove(leaf, remove);
 
       if (r_sib->children > (max_data_num_ + 1) / 2) {
         LeafShiftFromRight(leaf, r_sib, parent, i + 1);
+        SubCountUpdate(parent, i + 1, leaf);
+        SubCountUpdate(parent, i + 2, r_sib);
         /* flush leaves */
         NodeFlush(leaf);
         NodeFlush(l_sib);
@@ -908,12 +1695,12 @@ int BMap::LeafRemove(BpNodePtr &leaf, key_t key) {
         NodeFlush(parent);
       } else {
         LeafMergeFromRight(leaf, r_sib);
+        SubCountUpdate(parent, i + 1, leaf);
         /* delete empty right sibling flush */
-        BpNodePtr rr_sib = NodeFetch(r_sib->next);
         NodeDelete(r_sib, leaf, rr_sib);
         NodeFlush(l_sib);
         /* trace upwards */
-        NonLeafRemove(parent, i + 1);
+        return NonLeafRemove(parent, i + 1);
       }
     }
   } else {
@@ -924,41 +1711,966 @@ int BMap::LeafRemove(BpNodePtr &leaf, key_t key) {
   return 0;
 }
 
-int BMap::BplusTreeDelete(key_t key) {
-  BpNodePtr node = NodeSeek(boot_.root_offset);
-  while (node != NULL) {
-    if (IsLeaf(node)) {
-      return LeafRemove(node, key);
-    } else {
-      int i = BNodeBinarySearch(node, key);
-      if (i >= 0) {
-        node = NodeSeek(node.Sub()[i + 1]);
-      } else {
-        i = -i - 1;
-        node = NodeSeek(node.Sub()[i]);
-      }
+uint32_t BMap::Rebalance(uint32_t max_leaves) {
+  uint32_t half = (max_data_num_ + 1) / 2;
+  uint32_t index_half = (max_index_num_ + 1) / 2;
+  uint32_t fixed = 0;
+  Boot saved = WriteBegin();
+  for (uint32_t n = 0; n < max_leaves; n++) {
+    BpNodePtr leaf = LeafSeek(rebalance_key_);
+    if (leaf == NULL) {
+      break;
+    }
+    if (std::as_const(leaf)->children < half &&
+        std::as_const(leaf)->parent != INVALID_OFFSET &&
+        RebalanceLeaf(leaf) == 0) {
+      fixed++;
+    }
+    // 再往上看不到半满的索引节点,根不用管
+    BpNodePtr node = NodeFetch(std::as_const(leaf)->parent);
+    while (node != NULL && std::as_const(node)->parent != INVALID_OFFSET &&
+           std::as_const(node)->children < index_half &&
+           RebalanceIndex(node) == 0) {
+      fixed++;
+      node = NodeFetch(std::as_const(node)->parent);
+    }
+    if (node_error_) {
+      break;
+    }
+    // 一轮走完,下次从头开始
+    BpNodePtr next = NodeSeek(std::as_const(leaf)->next);
+    if (next == NULL) {
+      rebalance_key_ = std::numeric_limits<key_t>::min();
+      break;
+    }
+    rebalance_key_ = std::as_const(next).Key()[0];
+  }
+  if (CommitWrite(0, saved) != 0) {
+    return 0;
+  }
+  return fixed;
+}
+
+int BMap::RebalanceLeaf(BpNodePtr &leaf) {
+  BpNodePtr parent = NodeFetch(leaf->parent);
+  if (parent == NULL) {
+    return -1;
+  }
+  uint32_t half = (max_data_num_ + 1) / 2;
+  int i = ParentKeyIndex(parent, leaf.Key()[0]);
+  if (i + 2 < (int)parent->children) {
+    // 有右兄弟时和右兄弟合并,合不下就从右兄弟借到半满
+    BpNodePtr r_sib = NodeFetch(leaf->next);
+    if (r_sib == NULL) {
+      return -1;
+    }
+    if (leaf->children + r_sib->children <= max_data_num_) {
+      BpNodePtr rr_sib = NodeFetch(r_sib->next);
+      if (rr_sib == NULL && r_sib->next != INVALID_OFFSET) {
+        return -1;
+      }
+      LeafMergeFromRight(leaf, r_sib);
+      SubCountUpdate(parent, i + 1, leaf);
+      NodeDelete(r_sib, leaf, rr_sib);
+      return NonLeafRemove(parent, i + 1);
+    }
+    while (leaf->children < half) {
+      LeafShiftFromRight(leaf, r_sib, parent, i + 1);
+    }
+    SubCountUpdate(parent, i + 1, leaf);
+    SubCountUpdate(parent, i + 2, r_sib);
+    NodeFlush(leaf);
+    NodeFlush(r_sib);
+    NodeFlush(parent);
+    return 0;
+  }
+  // 最右边的子节点找左兄弟
+  BpNodePtr l_sib = NodeFetch(leaf->prev);
+  if (l_sib == NULL) {
+    return -1;
+  }
+  if (l_sib->children + leaf->children <= max_data_num_) {
+    BpNodePtr r_sib = NodeFetch(leaf->next);
+    if (r_sib == NULL && leaf->next != INVALID_OFFSET) {
+      return -1;
+    }
+    LeafMergeFromRight(l_sib, leaf);
+    SubCountUpdate(parent, i, l_sib);
+    NodeDelete(leaf, l_sib, r_sib);
+    // leaf已经释放,调用方接着从合并后的左兄弟往后走
+    leaf = std::move(l_sib);
+    return NonLeafRemove(parent, i);
+  }
+  while (leaf->children < half) {
+    // remove取整个叶子时整体右移一位,借来的key放在最前面
+    LeafShiftFromLeft(leaf, l_sib, parent, i, leaf->children);
+    leaf->children++;
+  }
+  SubCountUpdate(parent, i, l_sib);
+  SubCountUpdate(parent, i + 1, leaf);
+  NodeFlush(leaf);
+  NodeFlush(l_sib);
+  NodeFlush(parent);
+  return 0;
+}
+
+int BMap::RebalanceIndex(BpNodePtr &node) {
+  BpNodePtr parent = NodeFetch(node->parent);
+  if (parent == NULL) {
+    return -1;
+  }
+  uint32_t half = (max_index_num_ + 1) / 2;
+  int i = ParentKeyIndex(parent, node.Key()[0]);
+  if (i + 2 < (int)parent->children) {
+    BpNodePtr r_sib = NodeFetch(node->next);
+    if (r_sib == NULL) {
+      return -1;
+    }
+    if (node->children + r_sib->children <= max_index_num_) {
+      BpNodePtr rr_sib = NodeFetch(r_sib->next);
+      if (rr_sib == NULL && r_sib->next != INVALID_OFFSET) {
+        return -1;
+      }
+      NonLeafMergeFromRight(node, r_sib, parent, i + 1);
+      SubCountUpdate(parent, i + 1, node);
+      NodeDelete(r_sib, node, rr_sib);
+      return NonLeafRemove(parent, i + 1);
+    }
+    while (node->children < half) {
+      NonLeafShiftFromRight(node, r_sib, parent, i + 1);
+    }
+    SubCountUpdate(parent, i + 1, node);
+    SubCountUpdate(parent, i + 2, r_sib);
+    NodeFlush(node);
+    NodeFlush(r_sib);
+    NodeFlush(parent);
+    return 0;
+  }
+  BpNodePtr l_sib = NodeFetch(node->prev);
+  if (l_sib == NULL) {
+    return -1;
+  }
+  if (l_sib->children + node->children <= max_index_num_) {
+    BpNodePtr r_sib = NodeFetch(node->next);
+    if (r_sib == NULL && node->next != INVALID_OFFSET) {
+      return -1;
+    }
+    NonLeafMergeFromRight(l_sib, node, parent, i);
+    SubCountUpdate(parent, i, l_sib);
+    NodeDelete(node, l_sib, r_sib);
+    node = std::move(l_sib);
+    return NonLeafRemove(parent, i);
+  }
+  while (node->children < half) {
+    // 同叶子,所有key和子节点右移一位
+    NonLeafShiftFromLeft(node, l_sib, parent, i, node->children - 1);
+    node->children++;
+  }
+  SubCountUpdate(parent, i, l_sib);
+  SubCountUpdate(parent, i + 1, node);
+  NodeFlush(node);
+  NodeFlush(l_sib);
+  NodeFlush(parent);
+  return 0;
+}
+
+int BMap::ScanSource(Boot *boot, PageScanner::PhysicalFn *physical) {
+  // 直接读文件,先让文件和内存一致
+  if (!cache_.Shadow() && cache_.FlushAll() != 0) {
+    return -1;
+  }
+  *boot = boot_;
+  auto blocks = extents_.Blocks();
+  boot->free_blocks.assign(blocks.begin(), blocks.end());
+  if (cache_.Shadow()) {
+    *physical = [this](off_t offset) { return cache_.PhysicalBlock(offset); };
+  }
+  return 0;
+}
+
+FilterStats BMap::GetFilterStats() const {
+  FilterStats stats = filter_stats_;
+  stats.bytes = filter_.Bytes();
+  stats.hashes = filter_.Hashes();
+  return stats;
+}
+
+bool BMap::FilterPass(key_t key) {
+  if (filter_.MayContain(key)) {
+    return true;
+  }
+  filter_stats_.rejects++;
+  return false;
+}
+
+void BMap::FilterMaintain() {
+  constexpr uint64_t kMinRebuildKeys = 4096;
+  // 哈希函数个数是按重建时的key数选的,key数翻倍后也要重建
+  if (filter_.Enabled() &&
+      (filter_removed_ > std::max(filter_stats_.keys / 2, kMinRebuildKeys) ||
+       filter_added_ > std::max(filter_stats_.keys, kMinRebuildKeys))) {
+    // 重建失败时过滤器已经关掉了,查找照常往下走
+    RebuildFilter();
+  }
+}
+
+int BMap::RebuildFilter(uint32_t threads) {
+  if (conf_.filter_bytes == 0) {
+    return 0;
+  }
+  Boot boot;
+  PageScanner::PhysicalFn physical;
+  if (ScanSource(&boot, &physical) != 0) {
+    filter_.Init(0, 0);
+    return -1;
+  }
+  NodeLayout layout = NodeLayout::FromBoot(boot);
+  uint64_t pages = boot.file_size / layout.block_size;
+  std::vector<bool> free(pages);
+  for (uint64_t block : boot.free_blocks) {
+    free[block / layout.block_size] = true;
+  }
+  // 有子树计数时key数是准的,否则按叶子平均ln2满估计
+  uint64_t expected =
+      counted_ ? TreeRank(std::numeric_limits<key_t>::max(), true)
+               : (pages - boot.free_blocks.size()) * max_data_num_ * 69 / 100;
+  filter_.Init(conf_.filter_bytes, expected);
+  filter_stats_.keys = 0;
+  std::mutex mutex;
+  PageScanner scanner(tree_fd_, layout.block_size, boot.file_size, physical);
+  int64_t bytes = scanner.Scan(threads, [&](off_t offset, const char *page) {
+    if (page == nullptr || free[offset / layout.block_size]) {
+      return;
+    }
+    // 不在树上的旧叶子也加进去只会多几个误判
+    const BpNode *node = (const BpNode *)page;
+    if (node->type != LEAF || node->children > layout.max_data_num) {
+      return;
+    }
+    const key_t *keys = layout.Key(node);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint32_t i = 0; i < node->children; i++) {
+      filter_.Add(keys[i]);
+    }
+    filter_stats_.keys += node->children;
+  });
+  if (bytes < 0) {
+    filter_.Init(0, 0);
+    return -1;
+  }
+  filter_removed_ = 0;
+  filter_added_ = 0;
+  filter_stats_.rebuilds++;
+  return 0;
+}
+
+int BMap::Check(FsckReport *report, uint32_t threads) {
+  Boot boot;
+  PageScanner::PhysicalFn physical;
+  if (ScanSource(&boot, &physical) != 0) {
+    return -1;
+  }
+  return Fsck(tree_fd_, boot, physical, threads, report);
+}
+
+int BMap::AnalyzeTree(TreeStats *stats, uint32_t threads) {
+  Boot boot;
+  PageScanner::PhysicalFn physical;
+  if (ScanSource(&boot, &physical) != 0) {
+    return -1;
+  }
+  return ::AnalyzeTree(tree_fd_, boot, physical, threads, stats);
+}
+
+int BMap::Vacuum(uint32_t max_moves, bool *done) {
+  if (done) {
+    *done = false;
+  }
+  // 影子分页下物理块由页表管理,不能这样搬
+  if (cache_.Shadow()) {
+    return -1;
+  }
+  uint32_t budget = max_moves;
+  if (conf_.vacuum_rate > 0) {
+    // 令牌桶限速,最多攒一秒的量
+    auto now = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(now - vacuum_time_).count();
+    vacuum_time_ = now;
+    vacuum_tokens_ = std::min<double>(conf_.vacuum_rate,
+                                      vacuum_tokens_ + sec * conf_.vacuum_rate);
+    budget = std::min<uint32_t>(budget, vacuum_tokens_);
+  }
+
+  auto blocks = extents_.Blocks();
+  std::set<uint64_t> free(blocks.begin(), blocks.end());
+  uint32_t moved = 0;
+  int ret = 0;
+  if (!vacuum_shrinking_) {
+    ret = VacuumCluster(free, budget, &moved);
+  }
+  if (ret == 0 && vacuum_shrinking_) {
+    ret = VacuumShrink(free, budget, &moved);
+  }
+  extents_.Clear();
+  for (uint64_t block : free) {
+    extents_.Free(block);
+  }
+  vacuum_tokens_ = std::max<double>(0, vacuum_tokens_ - moved);
+  if (ret < 0) {
+    return -1;
+  }
+  if (ret > 0) {
+    // 先让boot记下新的文件大小再截断
+    if (cache_.FlushAll() != 0 || BootWrite(boot_fd_) != 0 ||
+        fsync(boot_fd_) != 0 || ftruncate(tree_fd_, boot_.file_size) != 0) {
+      return -1;
+    }
+    if (wal_.Opened() && wal_.Reset() != 0) {
+      return -1;
+    }
+    vacuum_key_ = std::numeric_limits<key_t>::min();
+    vacuum_pos_ = 0;
+    vacuum_shrinking_ = false;
+    if (done) {
+      *done = true;
+    }
+  }
+  return moved;
+}
+
+int BMap::VacuumCluster(std::set<uint64_t> &free, uint32_t budget,
+                        uint32_t *moved) {
+  while (*moved < budget) {
+    off_t self;
+    {
+      BpNodePtr leaf = LeafSeek(vacuum_key_);
+      if (leaf == NULL || vacuum_pos_ >= boot_.file_size) {
+        vacuum_shrinking_ = true;
+        return 0;
+      }
+      self = std::as_const(leaf)->self;
+    }
+    off_t target = vacuum_pos_;
+    if (self != target) {
+      if (!free.erase(target)) {
+        // 目标位置上的节点先挪到后面的空闲块,没有就追加到文件末尾
+        off_t to;
+        auto iter = free.upper_bound(target);
+        if (iter != free.end()) {
+          to = *iter;
+          free.erase(iter);
+        } else {
+          to = boot_.file_size;
+          boot_.file_size += conf_.block_size;
+        }
+        if (NodeMove(target, to) != 0) {
+          return -1;
+        }
+        (*moved)++;
+      }
+      if (NodeMove(self, target) != 0) {
+        return -1;
+      }
+      free.insert(self);
+      (*moved)++;
+    }
+    vacuum_pos_ += conf_.block_size;
+
+    BpNodePtr leaf = NodeSeek(target);
+    BpNodePtr next = NodeSeek(std::as_const(leaf)->next);
+    if (next == NULL) {
+      vacuum_shrinking_ = true;
+      return 0;
+    }
+    vacuum_key_ = std::as_const(next).Key()[0];
+  }
+  return 0;
+}
+
+int BMap::VacuumShrink(std::set<uint64_t> &free, uint32_t budget,
+                       uint32_t *moved) {
+  while (!free.empty()) {
+    // 文件末尾的块空闲就直接截掉,否则把它搬到最前面的空闲块
+    off_t tail = boot_.file_size - conf_.block_size;
+    if (free.erase(tail)) {
+      boot_.file_size = tail;
+      cache_.Discard(tail);
+      continue;
+    }
+    if (*moved >= budget) {
+      return 0;
+    }
+    off_t to = *free.begin();
+    free.erase(free.begin());
+    if (NodeMove(tail, to) != 0) {
+      return -1;
+    }
+    free.insert(tail);
+    (*moved)++;
+  }
+  return 1;
+}
+
+int BMap::NodeMove(off_t from, off_t to) {
+  BpNodePtr src = NodeFetch(from);
+  if (src == NULL) {
+    return -1;
+  }
+  // 目标块是空闲的,缓存里的旧内容不用读也不用写回
+  cache_.Discard(to);
+  auto iter = cache_.GetPage(to, true);
+  if (iter == cache_.End()) {
+    return -1;
+  }
+  BpNodePtr dst(this, iter);
+  memcpy(&*dst, &*std::as_const(src), conf_.block_size);
+  dst->self = to;
+
+  if (dst->parent == INVALID_OFFSET) {
+    // 也可能是别的命名树的根
+    if ((off_t)boot_.root_offset == from) {
+      boot_.root_offset = to;
+    }
+    for (auto &[name, root] : boot_.trees) {
+      if ((off_t)root == from) {
+        root = to;
+      }
+    }
+  } else {
+    BpNodePtr parent = NodeFetch(dst->parent);
+    if (parent == NULL) {
+      return -1;
+    }
+    off_t *sub = parent.Sub();
+    *std::find(sub, sub + parent->children, from) = to;
+    NodeFlush(parent);
+  }
+  if (dst->prev != INVALID_OFFSET) {
+    BpNodePtr prev = NodeFetch(dst->prev);
+    if (prev == NULL) {
+      return -1;
+    }
+    prev->next = to;
+    NodeFlush(prev);
+  }
+  if (dst->next != INVALID_OFFSET) {
+    BpNodePtr next = NodeFetch(dst->next);
+    if (next == NULL) {
+      return -1;
+    }
+    next->prev = to;
+    NodeFlush(next);
+  }
+  if (!IsLeaf(dst)) {
+    for (uint32_t i = 0; i < dst->children; i++) {
+      if (SubNodeFlush(dst, dst.Sub()[i]) != 0) {
+        return -1;
+      }
+    }
+  }
+  NodeFlush(dst);
+  return 0;
+}
+
+int BMap::BplusTreeDelete(key_t key) {
+  Boot saved = WriteBegin();
+  int ret = TreeDelete(key);
+  if (CommitWrite(0, saved) != 0) {
+    return -1;
+  }
+  FilterMaintain();
+  return ret;
+}
+
+int BMap::TreeDelete(key_t key, const std::function<void(long)> &removed) {
+  BpNodePtr node = NodeSeek(boot_.root_offset);
+  while (node != NULL) {
+    if (IsLeaf(node)) {
+      int i = removed ? BNodeBinarySearch(node, key) : -1;
+      if (i >= 0) {
+        removed(std::as_const(node).Data()[i]);
+      }
+      int ret = LeafRemove(node, key);
+      if (ret == 0) {
+        SubCountFix(key);
+        filter_removed_++;
+      }
+      return ret;
+    } else {
+      int i = BNodeBinarySearch(node, key);
+      if (i >= 0) {
+        node = NodeSeek(std::as_const(node).Sub()[i + 1]);
+      } else {
+        i = -i - 1;
+        node = NodeSeek(std::as_const(node).Sub()[i]);
+      }
     }
   }
   return -1;
 }
 
+int BMap::BplusTreeDeleteRange(key_t start, key_t end, uint64_t *deleted) {
+  // 开了过滤器时也要计数,用来决定什么时候重建
+  uint64_t count = 0;
+  bool counting = deleted || filter_.Enabled();
+  Boot saved = WriteBegin();
+  int ret = TreeDeleteRange(start, end, counting ? &count : nullptr);
+  if (CommitWrite(0, saved) != 0) {
+    return -1;
+  }
+  if (deleted) {
+    *deleted = count;
+  }
+  filter_removed_ += count;
+  FilterMaintain();
+  return ret;
+}
+
+// 每次从根往下走到from所在的位置:整个落在[from, end]里的子树直接摘掉,
+// 否则一直走到叶子,删掉叶子里落在范围内的key。摘掉或者删完之后from
+// 跳到这个节点的上界,再从根开始,树的调整都交给NonLeafRemove
+int BMap::TreeDeleteRange(key_t start, key_t end, uint64_t *deleted) {
+  // 节点的key范围是[lo, hi),用int64_t表示正负无穷
+  constexpr int64_t kMin = std::numeric_limits<key_t>::min();
+  constexpr int64_t kMax = (int64_t)std::numeric_limits<key_t>::max() + 1;
+  int64_t from = start;
+  while (from <= end && boot_.root_offset != INVALID_OFFSET) {
+    BpNodePtr parent;
+    BpNodePtr node = NodeFetch(boot_.root_offset);
+    if (node == NULL) {
+      return -1;
+    }
+    int index = 0;
+    int64_t lo = kMin;
+    int64_t hi = kMax;
+    while (!(lo >= from && hi - 1 <= end) && !IsLeaf(node)) {
+      const BpNodePtr &cur = node;
+      int i = BNodeBinarySearch(node, from);
+      index = i >= 0 ? i + 1 : -i - 1;
+      if (index > 0) {
+        lo = cur.Key()[index - 1];
+      }
+      if (index < (int)cur->children - 1) {
+        hi = cur.Key()[index];
+      }
+      BpNodePtr sub = NodeFetch(cur.Sub()[index]);
+      if (sub == NULL) {
+        return -1;
+      }
+      parent = std::move(node);
+      node = std::move(sub);
+    }
+
+    if (!IsLeaf(node) || (lo >= from && hi - 1 <= end)) {
+      if (RangeDrop(node, parent, index, deleted) != 0) {
+        return -1;
+      }
+    } else {
+      const BpNodePtr &leaf = node;
+      int children = leaf->children;
+      int a = BNodeBinarySearch(node, from);
+      a = a >= 0 ? a : -a - 1;
+      int b = BNodeBinarySearch(node, end);
+      b = b >= 0 ? b + 1 : -b - 1;
+      if (a == 0 && b == children) {
+        if (RangeDrop(node, parent, index, deleted) != 0) {
+          return -1;
+        }
+      } else if (a < b) {
+        memmove(&node.Key()[a], &leaf.Key()[b],
+                (children - b) * sizeof(key_t));
+        memmove(&node.Data()[a], &leaf.Data()[b],
+                (children - b) * sizeof(long));
+        node->children -= b - a;
+        if (deleted) {
+          *deleted += b - a;
+        }
+        NodeFlush(node);
+        if (parent != NULL && leaf->children < leaf_merge_num_) {
+          RebalanceLeaf(node);
+          if (node_error_) {
+            return -1;
+          }
+        }
+      }
+      // 叶子里还有比end大的key,后面不用看了
+      if (b < children) {
+        SubCountFix((key_t)from);
+        break;
+      }
+    }
+    SubCountFix((key_t)from);
+    from = hi;
+  }
+  return 0;
+}
+
+int BMap::RangeDrop(BpNodePtr &node, BpNodePtr &parent, int index,
+                    uint64_t *deleted) {
+  // 子树每一层最左和最右的节点之外的两个邻居直接连起来
+  off_t first = std::as_const(node)->self;
+  off_t last = first;
+  uint32_t level = 0;
+  for (;;) {
+    BpNodePtr l_edge = NodeSeek(first);
+    BpNodePtr r_edge = NodeSeek(last);
+    if (l_edge == NULL || r_edge == NULL) {
+      return -1;
+    }
+    const BpNodePtr &l = l_edge;
+    const BpNodePtr &r = r_edge;
+    BpNodePtr left = NodeFetch(l->prev);
+    BpNodePtr right = NodeFetch(r->next);
+    if ((left == NULL && l->prev != INVALID_OFFSET) ||
+        (right == NULL && r->next != INVALID_OFFSET)) {
+      return -1;
+    }
+    if (left != NULL) {
+      left->next = right != NULL ? right->self : INVALID_OFFSET;
+      NodeFlush(left);
+    }
+    if (right != NULL) {
+      right->prev = left != NULL ? left->self : INVALID_OFFSET;
+      NodeFlush(right);
+    }
+    if (IsLeaf(l_edge)) {
+      break;
+    }
+    first = l.Sub()[0];
+    last = r.Sub()[r->children - 1];
+    level++;
+  }
+  if (RangeFree(std::as_const(node)->self, level, deleted) != 0) {
+    return -1;
+  }
+
+  if (parent == NULL) {
+    boot_.root_offset = INVALID_OFFSET;
+    return 0;
+  }
+  // NonLeafRemove删的是第remove个key和它右边的孩子,
+  // 最左边的孩子先用右兄弟盖住,再删掉右兄弟原来的位置
+  if (index == 0) {
+    SubMove(parent, 0, parent, 1, 1);
+    index = 1;
+  }
+  return NonLeafRemove(parent, index - 1);
+}
+
+int BMap::RangeFree(off_t offset, uint32_t level, uint64_t *deleted) {
+  // 叶子只有要计数时才读
+  if (level > 0 || deleted) {
+    BpNodePtr node = NodeSeek(offset);
+    if (node == NULL) {
+      return -1;
+    }
+    const BpNodePtr &cur = node;
+    if (level == 0) {
+      *deleted += cur->children;
+    } else {
+      for (uint32_t i = 0; i < cur->children; i++) {
+        if (RangeFree(cur.Sub()[i], level - 1, deleted) != 0) {
+          return -1;
+        }
+      }
+    }
+  }
+  extents_.Free(offset);
+  return 0;
+}
+
+uint64_t BMap::BplusTreeCountRange(key_t start, key_t end) {
+  if (start > end) {
+    return 0;
+  }
+  if (counted_) {
+    return TreeRank(end, true) - TreeRank(start, false);
+  }
+  BpNodePtr node = LeafSeek(start);
+  uint64_t count = 0;
+  bool first = true;
+  while (node != NULL) {
+    const BpNodePtr &leaf = node;
+    int children = leaf->children;
+    // 中间的叶子整个都在范围里,不用查
+    int a = 0;
+    if (first) {
+      a = BNodeBinarySearch(node, start);
+      a = a >= 0 ? a : -a - 1;
+      first = false;
+    }
+    if (children > 0 && leaf.Key()[children - 1] <= end) {
+      count += children - a;
+    } else {
+      int b = BNodeBinarySearch(node, end);
+      b = b >= 0 ? b + 1 : -b - 1;
+      return count + std::max(b - a, 0);
+    }
+    node = NodeSeek(leaf->next);
+  }
+  return count;
+}
+
+uint64_t BMap::BplusTreeRank(key_t key) {
+  if (counted_) {
+    return TreeRank(key, false);
+  }
+  if (key == std::numeric_limits<key_t>::min()) {
+    return 0;
+  }
+  return BplusTreeCountRange(std::numeric_limits<key_t>::min(), key - 1);
+}
+
+uint64_t BMap::TreeRank(key_t key, bool inclusive) {
+  uint64_t rank = 0;
+  BpNodePtr node = NodeSeek(boot_.root_offset);
+  while (node != NULL) {
+    const BpNodePtr &cur = node;
+    int i = BNodeBinarySearch(node, key);
+    if (IsLeaf(node)) {
+      return rank + (i >= 0 ? i + inclusive : -i - 1);
+    }
+    // 左边的子树整个都比key小
+    i = i >= 0 ? i + 1 : -i - 1;
+    for (int j = 0; j < i; j++) {
+      rank += cur.Count()[j];
+    }
+    node = NodeSeek(cur.Sub()[i]);
+  }
+  return rank;
+}
+
+int BMap::BplusTreeSelect(uint64_t k, key_t *key, long *value) {
+  // 没有子树计数只能从最左边的叶子沿链表数过去
+  BpNodePtr node = counted_ ? NodeSeek(boot_.root_offset)
+                            : LeafSeek(std::numeric_limits<key_t>::min());
+  if (!counted_) {
+    while (node != NULL && k >= std::as_const(node)->children) {
+      k -= std::as_const(node)->children;
+      node = NodeSeek(std::as_const(node)->next);
+    }
+  }
+  while (node != NULL) {
+    const BpNodePtr &cur = node;
+    if (IsLeaf(node)) {
+      if (k >= cur->children) {
+        return -1;
+      }
+      *key = cur.Key()[k];
+      if (value) {
+        *value = cur.Data()[k];
+      }
+      return 0;
+    }
+    uint32_t i = 0;
+    while (i + 1 < cur->children && k >= cur.Count()[i]) {
+      k -= cur.Count()[i];
+      i++;
+    }
+    node = NodeSeek(cur.Sub()[i]);
+  }
+  return -1;
+}
+
+int BMap::ShadowCommit() {
+  if (!cache_.Shadow()) {
+    return 0;
+  }
+  uint64_t gen = boot_.map_gen;
+  uint64_t len = boot_.map_len;
+  int ret = cache_.ShadowCommit(&gen, &len);
+  if (ret < 0) {
+    return -1;
+  }
+  // 没有页要写时,boot变了也要切换一次
+  bool boot_changed = trees_changed_ ||
+                      boot_.root_offset != committed_root_ ||
+                      boot_.file_size != committed_file_size_ ||
+                      extents_.Version() != committed_extents_.Version();
+  if (ret > 0 && !boot_changed) {
+    return 0;
+  }
+  boot_.map_gen = gen;
+  boot_.map_len = len;
+  if (BootCommit() != 0) {
+    return -1;
+  }
+  if (ret == 0) {
+    cache_.ShadowPublish();
+  }
+  return 0;
+}
+
+void BMap::ShadowRollback(const Boot &saved) {
+  cache_.ShadowAbort();
+  boot_ = saved;
+  extents_ = committed_extents_;
+}
+
+std::unique_ptr<BAsyncSearcher> BMap::AsyncSearcher(uint32_t max_inflight) {
+  return std::unique_ptr<BAsyncSearcher>(
+      new BAsyncSearcher(this, max_inflight));
+}
+
+std::unique_ptr<BTransaction> BMap::Begin() {
+  open_txns_++;
+  return std::unique_ptr<BTransaction>(new BTransaction(this));
+}
+
+int BMap::ApplyEntry(const WriteAheadLog::Entry &entry,
+                     std::vector<WriteAheadLog::Entry> *undo) {
+  key_t key = entry.key;
+  if (entry.op == WriteAheadLog::OP_PUT) {
+    long value = entry.value;
+    return TreeUpdate(
+        key,
+        [key, value, undo](const long *old) {
+          if (undo) {
+            undo->push_back(old ? WriteAheadLog::Entry{key,
+                                                       WriteAheadLog::OP_PUT,
+                                                       *old}
+                                : WriteAheadLog::Entry{
+                                      key, WriteAheadLog::OP_DELETE, 0});
+          }
+          return value;
+        },
+        true, nullptr);
+  }
+  if (entry.op == WriteAheadLog::OP_INSERT) {
+    return TreeInsert(key, entry.value);
+  }
+  std::function<void(long)> removed;
+  if (undo) {
+    removed = [key, undo](long old) {
+      undo->push_back(WriteAheadLog::Entry{key, WriteAheadLog::OP_PUT, old});
+    };
+  }
+  // 事务里删不存在的key不算失败
+  TreeDelete(key, removed);
+  return 0;
+}
+
+std::vector<WriteAheadLog::Entry>
+BMap::WalBatch(const std::vector<WriteAheadLog::Entry> &entries) const {
+  std::vector<WriteAheadLog::Entry> batch;
+  // 默认树也要写一段空名字,重做时不会沿用上一批的树
+  size_t i = 0;
+  do {
+    WriteAheadLog::Entry entry{(key_t)i, WriteAheadLog::OP_TREE, 0};
+    memcpy(&entry.value, tree_name_.data() + i,
+           std::min(sizeof(entry.value), tree_name_.size() - i));
+    batch.push_back(entry);
+    i += sizeof(entry.value);
+  } while (i < tree_name_.size());
+  batch.insert(batch.end(), entries.begin(), entries.end());
+  return batch;
+}
+
+int BMap::TxnApply(const std::map<key_t, BTransaction::Write> &writes) {
+  if (writes.empty()) {
+    return 0;
+  }
+  std::vector<WriteAheadLog::Entry> entries;
+  for (auto &[key, write] : writes) {
+    entries.push_back(WriteAheadLog::Entry{
+        key, write.first ? WriteAheadLog::OP_PUT : WriteAheadLog::OP_DELETE,
+        write.second});
+  }
+  // 原地写模式先写redo日志,应用到一半崩溃时打开后重做整个事务
+  bool shadow = cache_.Shadow();
+  if (!shadow && wal_.Append(WalBatch(entries)) != 0) {
+    return -1;
+  }
+
+  // 按key顺序应用。原地写模式下顺路记下原来的值用来回滚,
+  // 影子分页下回滚是丢掉没提交的页,不用记
+  Boot saved = WriteBegin();
+  std::vector<WriteAheadLog::Entry> undo;
+  bool failed = false;
+  for (auto &entry : entries) {
+    if (ApplyEntry(entry, shadow ? nullptr : &undo) != 0 || node_error_) {
+      failed = true;
+      break;
+    }
+  }
+
+  if (shadow) {
+    // 影子分页下整个事务一次提交,失败就丢掉所有没提交的页
+    if (failed || ShadowCommit() != 0) {
+      ShadowRollback(saved);
+      return -1;
+    }
+    FilterMaintain();
+    return 0;
+  }
+  if (failed) {
+    // 倒着撤销,再写进日志,重做时抵消掉
+    std::reverse(undo.begin(), undo.end());
+    for (auto &entry : undo) {
+      ApplyEntry(entry);
+    }
+    if (wal_.Append(WalBatch(undo)) == 0) {
+      WalCheckpoint();
+    }
+    return -1;
+  }
+  FilterMaintain();
+  // 普通的增删改不写日志,提交后马上清空日志,重做时不会盖掉之后的修改
+  return WalCheckpoint();
+}
+
+int BMap::WalCheckpoint() {
+  // 页和boot都落盘后日志就没用了;原地写的页在NodeFlush时已经写过,
+  // FlushAll不一定fsync
+  if (cache_.FlushAll() != 0 || fdatasync(tree_fd_) != 0 ||
+      BootWrite(boot_fd_) != 0 || fsync(boot_fd_) != 0) {
+    return -1;
+  }
+  return wal_.Reset();
+}
+
+int BMap::BootCommit() {
+  // 先写临时文件再rename,boot文件要么是旧的要么是新的
+  std::string boot_file = conf_.file_name + ".boot";
+  std::string tmp_file = boot_file + ".tmp";
+  int fd = open(tmp_file.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (BootWrite(fd) != 0 || fsync(fd) != 0 ||
+      rename(tmp_file.c_str(), boot_file.c_str()) != 0 ||
+      SyncParentDir(boot_file) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (boot_fd_ > 0) {
+    close(boot_fd_);
+  }
+  boot_fd_ = fd;
+  committed_root_ = boot_.root_offset;
+  trees_changed_ = false;
+  committed_file_size_ = boot_.file_size;
+  committed_extents_ = extents_;
+  return 0;
+}
+
 void BMapVisualizer::NodeKeyDraw(const BpNodePtr &node) {
   int i;
   if (bmap_.IsLeaf(node)) {
     printf("leaf:");
     for (i = 0; i < node->children; i++) {
-      printf(" %d", node.Key()[i]);
+      printf(" %s", std::to_string(node.Key()[i]).c_str());
     }
   } else {
     printf("node:");
     for (i = 0; i < node->children - 1; i++) {
-      printf(" %d", node.Key()[i]);
+      printf(" %s", std::to_string(node.Key()[i]).c_str());
     }
   }
   printf("\n");
 }
 
-void BMapVisualizer::Draw(const BpNodePtr &node, NodeBackLog *stack,
+void BMapVisualizer::Draw(const BpNodePtr &node, const NodeBackLog *stack,
                           int level) {
   int i;
   for (i = 1; i < level; i++) {
@@ -978,43 +2690,43 @@ void BMapVisualizer::Draw(const BpNodePtr &node, NodeBackLog *stack,
 void BMapVisualizer::Visualize() {
   int level = 0;
   BpNodePtr node = bmap_.NodeSeek(bmap_.boot_.root_offset);
-  // 下一个需要访问的指针,null代表继续深度,非null代表同层的
-  NodeBackLog *p_nbl = nullptr;
-  NodeBackLog nbl_stack[10];    // 回溯用的栈
-  NodeBackLog *top = nbl_stack; // 当前栈顶指针
+  // 回溯时下一个要访问的子节点,-1表示继续往深处走
+  int next_sub_idx = -1;
+  std::vector<NodeBackLog> nbl_stack; // 回溯用的栈,树多高都可以
 
   for (;;) {
     if (node != nullptr) {
-      int sub_idx = p_nbl != nullptr ? p_nbl->next_sub_idx : 0;
-      p_nbl = nullptr;
+      // 只读,不能把页标成脏页
+      const BpNodePtr &cur = node;
+      int sub_idx = next_sub_idx >= 0 ? next_sub_idx : 0;
+      next_sub_idx = -1;
 
       /* Backlog the node */
-      if (bmap_.IsLeaf(node) || sub_idx + 1 >= node->children) {
-        top->offset = INVALID_OFFSET;
-        top->next_sub_idx = 0;
+      if (bmap_.IsLeaf(cur) || sub_idx + 1 >= (int)cur->children) {
+        nbl_stack.push_back(NodeBackLog{INVALID_OFFSET, 0});
       } else {
-        top->offset = node->self;
-        top->next_sub_idx = sub_idx + 1;
+        nbl_stack.push_back(NodeBackLog{cur->self, sub_idx + 1});
       }
-      top++;
       level++;
 
       /* Draw the node when first passed through */
       if (sub_idx == 0) {
-        Draw(node, nbl_stack, level);
+        Draw(cur, nbl_stack.data(), level);
       }
 
       /* Move deep down */
-      node = bmap_.IsLeaf(node) ? BpNodePtr()
-                                : bmap_.NodeSeek(node.Sub()[sub_idx]);
+      node = bmap_.IsLeaf(cur) ? BpNodePtr()
+                               : bmap_.NodeSeek(cur.Sub()[sub_idx]);
     } else {
-      p_nbl = top == nbl_stack ? nullptr : --top;
-      if (p_nbl == nullptr) {
+      if (nbl_stack.empty()) {
         /* End of traversal */
         break;
       }
-      node = bmap_.NodeSeek(p_nbl->offset);
+      NodeBackLog back = nbl_stack.back();
+      nbl_stack.pop_back();
+      next_sub_idx = back.next_sub_idx;
+      node = bmap_.NodeSeek(back.offset);
       level--;
     }
   }
-}
\ No newline at end of file
+}
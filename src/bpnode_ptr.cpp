@@ -9,35 +9,40 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+// GetPage已经加过引用计数,这里直接接管
 BpNodePtr::BpNodePtr(BMap *bmap, PageCacheIter cache_iter)
-    : bmap_(bmap), cache_iter_(cache_iter) {
-  if (bmap_) {
-    cache_iter_->second.in_use_count++;
-  }
-}
+    : bmap_(bmap), cache_iter_(cache_iter) {}
 
-BpNodePtr::~BpNodePtr() {
-  if (bmap_ && cache_iter_->second.in_use_count > 0) {
-    cache_iter_->second.in_use_count--;
-    if (dirty_) {
-      cache_iter_->second.dirty = true;
-    }
-  }
-}
+BpNodePtr::~BpNodePtr() { Release(); }
 
 BpNodePtr::BpNodePtr(BpNodePtr &&other) {
   bmap_ = other.bmap_;
   cache_iter_ = other.cache_iter_;
+  dirty_ = other.dirty_;
   other.bmap_ = nullptr;
+  other.dirty_ = false;
 }
 
 BpNodePtr &BpNodePtr::operator=(BpNodePtr &&other) {
-  bmap_ = other.bmap_;
-  cache_iter_ = other.cache_iter_;
-  other.bmap_ = nullptr;
+  if (this != &other) {
+    Release();
+    bmap_ = other.bmap_;
+    cache_iter_ = other.cache_iter_;
+    dirty_ = other.dirty_;
+    other.bmap_ = nullptr;
+    other.dirty_ = false;
+  }
   return *this;
 }
 
+void BpNodePtr::Release() {
+  if (bmap_) {
+    bmap_->cache_.Unpin(cache_iter_, dirty_);
+    bmap_ = nullptr;
+    dirty_ = false;
+  }
+}
+
 BpNode *BpNodePtr::operator->() {
   dirty_ = true;
   return const_cast<BpNode *>(std::as_const(*this).operator->());
@@ -96,6 +101,15 @@ off_t *BpNodePtr::Sub() {
   return const_cast<off_t *>(std::as_const(*this).Sub());
 }
 
+const uint64_t *BpNodePtr::Count() const {
+  return (const uint64_t *)(Sub() + bmap_->GetMaxIndexNum());
+}
+
+uint64_t *BpNodePtr::Count() {
+  dirty_ = true;
+  return const_cast<uint64_t *>(std::as_const(*this).Count());
+}
+
 const long *BpNodePtr::Data() const {
   PageInfo &info = cache_iter_->second;
   BpNode *node = (BpNode *)*info.iter;
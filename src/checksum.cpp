@@ -0,0 +1,82 @@
+#include "checksum.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+struct Crc32cTable {
+  uint32_t table[256];
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) {
+        crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+      }
+      table[i] = crc;
+    }
+  }
+};
+
+uint32_t Crc32cSoft(const uint8_t *p, size_t len, uint32_t crc) {
+  static const Crc32cTable kTable;
+  for (size_t i = 0; i < len; i++) {
+    crc = kTable.table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t
+Crc32cHard(const uint8_t *p, size_t len, uint32_t crc) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+  for (; len > 0; p++, len--) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+
+bool HasSse42() {
+  static const bool has = __builtin_cpu_supports("sse4.2");
+  return has;
+}
+#endif
+
+} // namespace
+
+uint32_t Crc32c(const void *data, size_t len, uint32_t crc) {
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (HasSse42()) {
+    return ~Crc32cHard(p, len, crc);
+  }
+#endif
+  return ~Crc32cSoft(p, len, crc);
+}
+
+void PageSeal(char *page, uint32_t page_size, uint64_t lsn) {
+  PageTrailer *trailer =
+      (PageTrailer *)(page + page_size - sizeof(PageTrailer));
+  trailer->lsn = lsn;
+  trailer->magic = kPageTrailerMagic;
+  trailer->crc = Crc32c(page, page_size - sizeof(trailer->crc));
+}
+
+int PageVerify(const char *page, uint32_t page_size, uint64_t *lsn) {
+  const PageTrailer *trailer =
+      (const PageTrailer *)(page + page_size - sizeof(PageTrailer));
+  if (trailer->magic != kPageTrailerMagic ||
+      trailer->crc != Crc32c(page, page_size - sizeof(trailer->crc))) {
+    return -1;
+  }
+  *lsn = trailer->lsn;
+  return 0;
+}
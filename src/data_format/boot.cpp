@@ -1,4 +1,7 @@
 #include "data_format/boot.h"
+#include "checksum.h"
+#include <algorithm>
+#include <string.h>
 
 off_t INVALID_OFFSET = 0xdeadbeef;
 constexpr uint32_t ADDR_LEN_HEX = 16;
@@ -18,6 +21,28 @@ off_t WriteOffset(int fd, uint64_t offset) {
   return write(fd, buf, ADDR_LEN_HEX);
 }
 
+// 每个数最多写15个十六进制位,名字按4字节一段写
+constexpr uint32_t kNameChunk = 4;
+
+static void WriteName(int fd, const std::string &name) {
+  WriteOffset(fd, name.size());
+  for (size_t i = 0; i < name.size(); i += kNameChunk) {
+    uint32_t chunk = 0;
+    memcpy(&chunk, name.data() + i,
+           std::min<size_t>(kNameChunk, name.size() - i));
+    WriteOffset(fd, chunk);
+  }
+}
+
+static std::string ReadName(int fd) {
+  std::string name(ReadOffset(fd), '\0');
+  for (size_t i = 0; i < name.size(); i += kNameChunk) {
+    uint32_t chunk = ReadOffset(fd);
+    memcpy(&name[i], &chunk, std::min<size_t>(kNameChunk, name.size() - i));
+  }
+  return name;
+}
+
 int Boot::ParseFromFile(int fd) {
   if (lseek(fd, 0, SEEK_SET) == -1) {
     return -1;
@@ -29,6 +54,21 @@ int Boot::ParseFromFile(int fd) {
   while ((offset = ReadOffset(fd)) != INVALID_OFFSET) {
     free_blocks.push_back(offset);
   }
+  // 空闲块后面是可选的扩展字段,老的文件没有
+  if ((offset = ReadOffset(fd)) != INVALID_OFFSET) {
+    map_gen = offset;
+    map_len = ReadOffset(fd);
+  }
+  if ((offset = ReadOffset(fd)) != INVALID_OFFSET) {
+    flags = offset;
+    lsn = ReadOffset(fd);
+  }
+  if ((offset = ReadOffset(fd)) != INVALID_OFFSET) {
+    for (off_t i = 0; i < offset; i++) {
+      uint64_t root = ReadOffset(fd);
+      trees[ReadName(fd)] = root;
+    }
+  }
   return 0;
 }
 
@@ -42,5 +82,44 @@ int Boot::WriteToFile(int fd) {
   for (auto offset : free_blocks) {
     WriteOffset(fd, offset);
   }
+  // 扩展字段按顺序排,后面的有内容时前面的也要写
+  if (map_gen > 0 || flags != 0 || !trees.empty()) {
+    WriteOffset(fd, INVALID_OFFSET);
+    WriteOffset(fd, map_gen);
+    WriteOffset(fd, map_len);
+  }
+  if (flags != 0 || !trees.empty()) {
+    WriteOffset(fd, flags);
+    WriteOffset(fd, lsn);
+  }
+  if (!trees.empty()) {
+    WriteOffset(fd, trees.size());
+    for (auto &[name, root] : trees) {
+      WriteOffset(fd, root);
+      WriteName(fd, name);
+    }
+  }
+  // 空闲块变少时去掉后面旧的内容
+  off_t end = lseek(fd, 0, SEEK_CUR);
+  if (end == -1 || ftruncate(fd, end) != 0) {
+    return -1;
+  }
   return 0;
 }
+
+NodeLayout NodeLayout::FromBoot(const Boot &boot) {
+  NodeLayout layout;
+  layout.block_size = boot.block_size;
+  layout.checksum = boot.flags & BOOT_PAGE_CHECKSUM;
+  layout.counts = boot.flags & BOOT_SUBTREE_COUNT;
+  uint32_t payload = boot.block_size;
+  if (layout.checksum) {
+    payload -= sizeof(PageTrailer);
+  }
+  uint32_t sub_size = sizeof(off_t) + (layout.counts ? sizeof(uint64_t) : 0);
+  layout.max_index_num =
+      (payload - sizeof(BpNode)) / (sizeof(key_t) + sub_size);
+  layout.max_data_num =
+      (payload - sizeof(BpNode)) / (sizeof(key_t) + sizeof(long));
+  return layout;
+}
@@ -0,0 +1,108 @@
+#include "extent_allocator.h"
+#include <assert.h>
+
+off_t ExtentAllocator::Alloc(off_t hint) {
+  if (extents_.empty()) {
+    return -1;
+  }
+  if (hint < 0) {
+    auto iter = extents_.begin();
+    off_t block = iter->first;
+    Take(iter, block);
+    return block;
+  }
+  // hint后面第一段的开头,和前面一段的最后一块,取近的,一样近取后面的
+  auto next = extents_.upper_bound(hint);
+  if (next != extents_.begin()) {
+    auto prev = std::prev(next);
+    off_t last = End(prev) - block_size_;
+    if (last >= hint) {
+      // hint本身就在空闲段里
+      off_t block = hint - (hint - prev->first) % block_size_;
+      Take(prev, block);
+      return block;
+    }
+    if (next == extents_.end() || hint - last < next->first - hint) {
+      Take(prev, last);
+      return last;
+    }
+  }
+  off_t block = next->first;
+  Take(next, block);
+  return block;
+}
+
+void ExtentAllocator::Take(std::map<off_t, uint64_t>::iterator iter,
+                           off_t block) {
+  off_t start = iter->first;
+  off_t end = End(iter);
+  assert(block >= start && block < end);
+  extents_.erase(iter);
+  if (block > start) {
+    extents_.emplace(start, (block - start) / block_size_);
+  }
+  if (block + block_size_ < end) {
+    extents_.emplace(block + block_size_,
+                     (end - block - block_size_) / block_size_);
+  }
+  free_num_--;
+  version_++;
+}
+
+void ExtentAllocator::AddRange(off_t start, uint64_t blocks) {
+  if (blocks == 0) {
+    return;
+  }
+  uint64_t added = blocks;
+  off_t end = start + (off_t)blocks * block_size_;
+  auto next = extents_.lower_bound(start);
+  // 和后一段相接就合并
+  if (next != extents_.end() && next->first == end) {
+    blocks += next->second;
+    next = extents_.erase(next);
+  }
+  // 和前一段相接就并到前一段里
+  if (next != extents_.begin()) {
+    auto prev = std::prev(next);
+    assert(End(prev) <= start);
+    if (End(prev) == start) {
+      prev->second += blocks;
+      free_num_ += added;
+      version_++;
+      return;
+    }
+  }
+  extents_.emplace_hint(next, start, blocks);
+  free_num_ += added;
+  version_++;
+}
+
+bool ExtentAllocator::Remove(off_t block) {
+  auto iter = extents_.upper_bound(block);
+  if (iter == extents_.begin()) {
+    return false;
+  }
+  --iter;
+  if (block >= End(iter) || (block - iter->first) % block_size_ != 0) {
+    return false;
+  }
+  Take(iter, block);
+  return true;
+}
+
+void ExtentAllocator::Clear() {
+  extents_.clear();
+  free_num_ = 0;
+  version_++;
+}
+
+std::vector<off_t> ExtentAllocator::Blocks() const {
+  std::vector<off_t> blocks;
+  blocks.reserve(free_num_);
+  for (auto &[start, num] : extents_) {
+    for (uint64_t i = 0; i < num; i++) {
+      blocks.push_back(start + (off_t)i * block_size_);
+    }
+  }
+  return blocks;
+}
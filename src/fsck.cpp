@@ -0,0 +1,433 @@
+#include "fsck.h"
+#include "checksum.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <limits>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <unistd.h>
+
+int64_t PageScanner::Scan(uint32_t threads, const PageFn &fn) {
+  constexpr uint32_t kAlign = 4096;
+  uint64_t pages = file_size_ / block_size_;
+  uint64_t chunks = (pages + kChunkPages - 1) / kChunkPages;
+  std::atomic<uint64_t> next{0};
+  std::atomic<int64_t> bytes{0};
+  std::atomic<bool> failed{false};
+
+  auto worker = [&] {
+    // 物理位置连续时一次读一整块,否则逐页读
+    size_t buf_size = (size_t)block_size_ * (physical_ ? 1 : kChunkPages);
+    char *buf = (char *)aligned_alloc(kAlign, buf_size);
+    if (buf == nullptr) {
+      failed = true;
+      return;
+    }
+    for (;;) {
+      uint64_t chunk = next.fetch_add(1);
+      if (chunk >= chunks) {
+        break;
+      }
+      uint64_t first = chunk * kChunkPages;
+      uint64_t num = std::min<uint64_t>(kChunkPages, pages - first);
+      if (!physical_) {
+        ssize_t size = pread(fd_, buf, num * block_size_, first * block_size_);
+        uint64_t got = size > 0 ? size / block_size_ : 0;
+        bytes += got * block_size_;
+        for (uint64_t i = 0; i < num; i++) {
+          fn((first + i) * block_size_,
+             i < got ? buf + i * block_size_ : nullptr);
+        }
+        continue;
+      }
+      for (uint64_t i = 0; i < num; i++) {
+        off_t logical = (first + i) * block_size_;
+        off_t block = physical_(logical);
+        bool ok = block >= 0 &&
+                  pread(fd_, buf, block_size_, block) == (ssize_t)block_size_;
+        bytes += ok ? block_size_ : 0;
+        fn(logical, ok ? buf : nullptr);
+      }
+    }
+    free(buf);
+  };
+
+  threads = std::max<uint64_t>(1, std::min<uint64_t>(threads, chunks));
+  std::vector<std::thread> workers;
+  for (uint32_t i = 1; i < threads; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : workers) {
+    thread.join();
+  }
+  return failed ? -1 : bytes.load();
+}
+
+namespace {
+
+constexpr size_t kMaxErrors = 100;
+constexpr size_t kMaxLeaked = 100;
+
+enum PageState : uint8_t { PAGE_UNKNOWN = 0, PAGE_FREE, PAGE_REACHED };
+
+// 扫描时从页里取出来的信息,遍历树时只用它,不再读盘
+struct PageSummary {
+  bool read = false;
+  bool checksum_ok = true;
+  bool header_ok = true; // type和children合法
+  bool sorted = true;    // 页内key严格递增
+  BpNode head;
+  key_t first_key = 0;
+  key_t last_key = 0;
+  std::vector<key_t> keys; // 非叶子节点才记
+  std::vector<off_t> subs;
+  std::vector<uint64_t> counts; // 带子树计数时才有
+  uint64_t count = 0;           // 子树计数的和,叶子是key数
+};
+
+class Checker {
+public:
+  Checker(const Boot &boot, FsckReport *report)
+      : boot_(boot), layout_(NodeLayout::FromBoot(boot)), report_(report) {}
+  int Run(int fd, const PageScanner::PhysicalFn &physical, uint32_t threads);
+
+private:
+  // 父节点给子节点的key范围[lo, hi)
+  struct Visit {
+    off_t offset;
+    off_t parent;
+    int64_t lo;
+    int64_t hi;
+    uint64_t count; // 父节点记的子树key数
+  };
+
+  void Error(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+  void CheckFreeList();
+  void Summarize(off_t offset, const char *page);
+  void Walk();
+  void WalkTree(uint64_t root);
+  bool VisitNode(const Visit &visit, std::vector<Visit> *next_level);
+
+private:
+  const Boot &boot_;
+  NodeLayout layout_;
+  FsckReport *report_;
+  uint64_t pages_ = 0;
+  std::vector<uint8_t> state_;
+  std::vector<PageSummary> summaries_;
+  uint64_t leaf_slots_ = 0;
+  uint64_t index_slots_ = 0;
+  uint64_t index_children_ = 0;
+};
+
+void Checker::Error(const char *fmt, ...) {
+  report_->error_count++;
+  if (report_->errors.size() >= kMaxErrors) {
+    return;
+  }
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  report_->errors.emplace_back(buf);
+}
+
+void Checker::CheckFreeList() {
+  for (uint64_t block : boot_.free_blocks) {
+    if (block % layout_.block_size != 0 || block >= boot_.file_size) {
+      Error("free block %#lx out of file", block);
+      continue;
+    }
+    uint8_t &state = state_[block / layout_.block_size];
+    if (state == PAGE_FREE) {
+      Error("free block %#lx listed twice", block);
+    }
+    state = PAGE_FREE;
+    report_->free_blocks++;
+  }
+}
+
+void Checker::Summarize(off_t offset, const char *page) {
+  uint64_t idx = offset / layout_.block_size;
+  if (page == nullptr || state_[idx] == PAGE_FREE) {
+    return;
+  }
+  PageSummary &summary = summaries_[idx];
+  summary.read = true;
+  uint64_t lsn;
+  if (layout_.checksum &&
+      PageVerify(page, layout_.block_size, &lsn) != 0) {
+    summary.checksum_ok = false;
+  }
+  const BpNode *node = (const BpNode *)page;
+  summary.head = *node;
+  bool leaf = node->type == LEAF;
+  uint32_t max = leaf ? layout_.max_data_num : layout_.max_index_num;
+  if ((node->type != LEAF && node->type != NON_LEAF) || node->children == 0 ||
+      node->children > max || (!leaf && node->children < 2)) {
+    summary.header_ok = false;
+    return;
+  }
+  const key_t *keys = layout_.Key(node);
+  uint32_t key_num = leaf ? node->children : node->children - 1;
+  for (uint32_t i = 1; i < key_num; i++) {
+    if (keys[i - 1] >= keys[i]) {
+      summary.sorted = false;
+      break;
+    }
+  }
+  summary.first_key = keys[0];
+  summary.last_key = keys[key_num - 1];
+  summary.count = leaf ? node->children : 0;
+  if (!leaf) {
+    summary.keys.assign(keys, keys + key_num);
+    const off_t *subs = layout_.Sub(node);
+    summary.subs.assign(subs, subs + node->children);
+    if (layout_.counts) {
+      const uint64_t *counts = layout_.Count(node);
+      summary.counts.assign(counts, counts + node->children);
+      for (uint64_t count : summary.counts) {
+        summary.count += count;
+      }
+    }
+  }
+}
+
+bool Checker::VisitNode(const Visit &visit, std::vector<Visit> *next_level) {
+  off_t offset = visit.offset;
+  if (offset < 0 || offset % layout_.block_size != 0 ||
+      (uint64_t)offset >= boot_.file_size) {
+    Error("node %#lx referenced by %#lx is out of file", offset,
+          visit.parent);
+    return false;
+  }
+  uint64_t idx = offset / layout_.block_size;
+  if (state_[idx] == PAGE_REACHED) {
+    Error("node %#lx is reachable more than once", offset);
+    return false;
+  }
+  if (state_[idx] == PAGE_FREE) {
+    Error("node %#lx is in use but also in free_blocks", offset);
+  }
+  state_[idx] = PAGE_REACHED;
+  const PageSummary &summary = summaries_[idx];
+  if (!summary.read) {
+    Error("node %#lx can not be read", offset);
+    return false;
+  }
+  if (!summary.checksum_ok) {
+    report_->checksum_failures++;
+    Error("node %#lx checksum mismatch", offset);
+  }
+  const BpNode &node = summary.head;
+  if (node.self != offset) {
+    Error("node %#lx has self %#lx", offset, node.self);
+  }
+  if (node.parent != visit.parent) {
+    Error("node %#lx has parent %#lx, expected %#lx", offset, node.parent,
+          visit.parent);
+  }
+  if (!summary.header_ok) {
+    Error("node %#lx has bad type %d or children %u", offset, node.type,
+          node.children);
+    return false;
+  }
+  if (!summary.sorted) {
+    Error("node %#lx keys are not in order", offset);
+  }
+  if (summary.first_key < visit.lo || summary.last_key >= visit.hi) {
+    Error("node %#lx keys [%d, %d] outside parent range", offset,
+          summary.first_key, summary.last_key);
+  }
+  // 每个节点的计数和父节点记的一致,整棵树的计数就都对
+  if (layout_.counts && visit.parent != INVALID_OFFSET &&
+      summary.count != visit.count) {
+    Error("node %#lx holds %lu keys, parent counts %lu", offset,
+          summary.count, visit.count);
+  }
+  if (node.type == LEAF) {
+    report_->leaves++;
+    report_->keys += node.children;
+    leaf_slots_ += layout_.max_data_num;
+    return true;
+  }
+  report_->index_nodes++;
+  index_slots_ += layout_.max_index_num;
+  index_children_ += node.children;
+  for (uint32_t i = 0; i < node.children; i++) {
+    int64_t lo = i == 0 ? visit.lo : summary.keys[i - 1];
+    int64_t hi = i + 1 == node.children ? visit.hi : summary.keys[i];
+    uint64_t count = layout_.counts ? summary.counts[i] : 0;
+    next_level->push_back(Visit{summary.subs[i], offset, lo, hi, count});
+  }
+  return true;
+}
+
+void Checker::Walk() {
+  // 同一个文件里的每棵树分别走一遍,depth取最高的
+  WalkTree(boot_.root_offset);
+  for (auto &[name, root] : boot_.trees) {
+    WalkTree(root);
+  }
+}
+
+void Checker::WalkTree(uint64_t root) {
+  if (root == (uint64_t)INVALID_OFFSET) {
+    return;
+  }
+  std::vector<Visit> level{Visit{(off_t)root, INVALID_OFFSET,
+                                 std::numeric_limits<int64_t>::min(),
+                                 std::numeric_limits<int64_t>::max(), 0}};
+  uint32_t depth = 0;
+  while (!level.empty()) {
+    depth++;
+    report_->depth = std::max(report_->depth, depth);
+    std::vector<Visit> next_level;
+    // 同一层的节点从左到右用prev/next串起来,类型也相同
+    const PageSummary *prev = nullptr;
+    off_t prev_offset = INVALID_OFFSET;
+    int type = -1;
+    for (auto &visit : level) {
+      if (!VisitNode(visit, &next_level)) {
+        prev = nullptr;
+        continue;
+      }
+      const PageSummary &summary =
+          summaries_[visit.offset / layout_.block_size];
+      if (type < 0) {
+        type = summary.head.type;
+      } else if (type != summary.head.type) {
+        Error("node %#lx type differs from its level", visit.offset);
+      }
+      if (summary.head.prev != prev_offset) {
+        Error("node %#lx prev is %#lx, expected %#lx", visit.offset,
+              summary.head.prev, prev_offset);
+      }
+      if (prev && prev->head.next != visit.offset) {
+        Error("node %#lx next is %#lx, expected %#lx", prev_offset,
+              prev->head.next, visit.offset);
+      }
+      prev = &summary;
+      prev_offset = visit.offset;
+    }
+    if (prev && prev->head.next != INVALID_OFFSET) {
+      Error("last node %#lx of level %u has next %#lx", prev_offset, depth,
+            prev->head.next);
+    }
+    level.swap(next_level);
+  }
+}
+
+int Checker::Run(int fd, const PageScanner::PhysicalFn &physical,
+                 uint32_t threads) {
+  auto start = std::chrono::steady_clock::now();
+  if (layout_.block_size == 0) {
+    return -1;
+  }
+  pages_ = boot_.file_size / layout_.block_size;
+  report_->pages = pages_;
+  state_.assign(pages_, PAGE_UNKNOWN);
+  summaries_.assign(pages_, PageSummary());
+  CheckFreeList();
+
+  // 空闲页不用读
+  PageScanner::PhysicalFn skip_free;
+  if (physical) {
+    skip_free = [&](off_t logical) -> off_t {
+      return state_[logical / layout_.block_size] == PAGE_FREE
+                 ? -1
+                 : physical(logical);
+    };
+  }
+  PageScanner scanner(fd, layout_.block_size, boot_.file_size, skip_free);
+  int64_t bytes = scanner.Scan(
+      threads, [this](off_t offset, const char *page) { Summarize(offset, page); });
+  if (bytes < 0) {
+    return -1;
+  }
+  report_->bytes_read = bytes;
+
+  Walk();
+  for (uint64_t i = 0; i < pages_; i++) {
+    if (state_[i] == PAGE_UNKNOWN) {
+      report_->leaked_pages++;
+      if (report_->leaked.size() < kMaxLeaked) {
+        report_->leaked.push_back(i * layout_.block_size);
+      }
+    }
+  }
+  if (report_->leaked_pages > 0) {
+    Error("%lu pages are neither reachable nor free", report_->leaked_pages);
+  }
+  report_->leaf_fill =
+      leaf_slots_ ? (double)report_->keys / leaf_slots_ : 0;
+  report_->index_fill =
+      index_slots_ ? (double)index_children_ / index_slots_ : 0;
+  report_->seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  return report_->error_count > 0 ? 1 : 0;
+}
+
+} // namespace
+
+int Fsck(int fd, const Boot &boot, const PageScanner::PhysicalFn &physical,
+         uint32_t threads, FsckReport *report) {
+  *report = FsckReport();
+  Checker checker(boot, report);
+  return checker.Run(fd, physical, threads);
+}
+
+TreeFile::~TreeFile() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+int TreeFile::Open(const std::string &file_name, bool direct) {
+  int boot_fd = open((file_name + ".boot").c_str(), O_RDONLY);
+  if (boot_fd < 0) {
+    return -1;
+  }
+  int ret = boot_.ParseFromFile(boot_fd);
+  close(boot_fd);
+  if (ret != 0 || boot_.block_size == 0) {
+    return -1;
+  }
+  // 有的文件系统不支持O_DIRECT,退回普通读
+  fd_ = direct ? open(file_name.c_str(), O_RDONLY | O_DIRECT) : -1;
+  if (fd_ < 0) {
+    fd_ = open(file_name.c_str(), O_RDONLY);
+  }
+  if (fd_ < 0) {
+    return -1;
+  }
+  if (boot_.map_gen > 0 &&
+      shadow_.Open(file_name, fd_, boot_.block_size, boot_.file_size,
+                   boot_.map_gen, boot_.map_len, true) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+PageScanner::PhysicalFn TreeFile::Physical() {
+  if (!shadow_.Enabled()) {
+    return nullptr;
+  }
+  return [this](off_t logical) { return shadow_.Physical(logical); };
+}
+
+int FsckFile(const std::string &file_name, uint32_t threads,
+             FsckReport *report) {
+  TreeFile file;
+  if (file.Open(file_name) != 0) {
+    return -1;
+  }
+  return Fsck(file.Fd(), file.GetBoot(), file.Physical(), threads, report);
+}
@@ -1,14 +1,158 @@
 #include "page_cache.h"
+#include "checksum.h"
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
 #include <errno.h>
 #include <fcntl.h>
+#include <functional>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-int PageList::Init(uint32_t capacity, uint32_t page_size) {
+static size_t RoundUp(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
+// 从/proc/self/smaps找到addr所在的映射,返回其中透明大页的字节数
+static uint64_t ThpBytes(const char *addr) {
+  FILE *fp = fopen("/proc/self/smaps", "r");
+  if (!fp) {
+    return 0;
+  }
+  char line[512];
+  bool found = false;
+  uint64_t bytes = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    unsigned long begin = 0, end = 0;
+    if (sscanf(line, "%lx-%lx ", &begin, &end) == 2) {
+      if (found) {
+        break;
+      }
+      found = (uintptr_t)addr >= begin && (uintptr_t)addr < end;
+      continue;
+    }
+    unsigned long kb = 0;
+    if (found && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+      bytes = (uint64_t)kb << 10;
+    }
+  }
+  fclose(fp);
+  return bytes;
+}
+
+char *PageList::AllocArena(size_t size, const ArenaOptions &options,
+                           ArenaInfo *arena) {
+  constexpr size_t kPageSize = 4096;
+  constexpr size_t kHugePage2M = 2UL << 20;
+  constexpr size_t kHugePage1G = 1UL << 30;
+  constexpr int kHugeShift2M = 21;
+  constexpr int kHugeShift1G = 30;
+  constexpr int kMpolBind = 2;
+  constexpr int kMpolInterleave = 3;
+
+  *arena = ArenaInfo();
+  if (options.huge_page == HUGE_PAGE_NONE &&
+      options.numa_policy == NUMA_DEFAULT && !options.prefault) {
+    arena->backing = ARENA_MALLOC;
+    arena->size = RoundUp(size, kPageSize);
+    return (char *)aligned_alloc(kPageSize, arena->size);
+  }
+
+  constexpr int kProt = PROT_READ | PROT_WRITE;
+  constexpr int kFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *addr = MAP_FAILED;
+  // 先试hugetlbfs预留的大页,1GiB失败退到2MiB
+  if (options.huge_page == HUGE_PAGE_1G) {
+    arena->size = RoundUp(size, kHugePage1G);
+    addr = mmap(nullptr, arena->size, kProt,
+                kFlags | MAP_HUGETLB | (kHugeShift1G << MAP_HUGE_SHIFT), -1, 0);
+    arena->backing = ARENA_HUGETLB_1G;
+  }
+  if (addr == MAP_FAILED && (options.huge_page == HUGE_PAGE_1G ||
+                             options.huge_page == HUGE_PAGE_2M)) {
+    arena->size = RoundUp(size, kHugePage2M);
+    addr = mmap(nullptr, arena->size, kProt,
+                kFlags | MAP_HUGETLB | (kHugeShift2M << MAP_HUGE_SHIFT), -1, 0);
+    arena->backing = ARENA_HUGETLB_2M;
+  }
+  if (addr == MAP_FAILED) {
+    // 普通匿名映射,要透明大页的话按2MiB对齐,多映射一点再把头尾裁掉
+    bool thp = options.huge_page != HUGE_PAGE_NONE;
+    size_t align = thp ? kHugePage2M : kPageSize;
+    arena->size = RoundUp(size, align);
+    size_t map_size = arena->size + align - kPageSize;
+    char *raw = (char *)mmap(nullptr, map_size, kProt, kFlags, -1, 0);
+    if (raw == MAP_FAILED) {
+      return nullptr;
+    }
+    char *aligned = (char *)RoundUp((uintptr_t)raw, align);
+    if (aligned > raw) {
+      munmap(raw, aligned - raw);
+    }
+    size_t tail = (raw + map_size) - (aligned + arena->size);
+    if (tail > 0) {
+      munmap(aligned + arena->size, tail);
+    }
+    addr = aligned;
+    arena->backing = ARENA_MMAP;
+    if (thp && madvise(addr, arena->size, MADV_HUGEPAGE) == 0) {
+      arena->backing = ARENA_THP;
+    }
+  }
+  char *buffer = (char *)addr;
+
+  // NUMA策略要在第一次访问之前设置,节点掩码为0表示所有节点
+  if (options.numa_policy != NUMA_DEFAULT) {
+    int mode = options.numa_policy == NUMA_BIND ? kMpolBind : kMpolInterleave;
+    unsigned long mask = options.numa_nodes ? options.numa_nodes : ~0UL;
+    arena->numa_applied = syscall(SYS_mbind, addr, arena->size, mode, &mask,
+                                  sizeof(mask) * 8 + 1, 0) == 0;
+  }
+  if (options.prefault) {
+    for (size_t off = 0; off < arena->size; off += kPageSize) {
+      buffer[off] = 0;
+    }
+    arena->prefaulted = true;
+  }
+  return buffer;
+}
+
+void PageList::FreeArena(char *buffer, const ArenaInfo &arena) {
+  if (!buffer) {
+    return;
+  }
+  if (arena.backing == ARENA_MALLOC) {
+    free(buffer);
+  } else {
+    munmap(buffer, arena.size);
+  }
+}
+
+ArenaInfo PageList::GetArenaInfo() const {
+  ArenaInfo info = arena_;
+  if (info.backing == ARENA_THP && page_buffer_) {
+    info.thp_bytes = ThpBytes(page_buffer_);
+  }
+  // 扩容出来的段
+  for (auto &segment : segments_) {
+    info.size += segment.arena.size;
+    if (segment.arena.backing == ARENA_THP) {
+      info.thp_bytes += ThpBytes(segment.buffer);
+    }
+  }
+  return info;
+}
+
+int PageList::Init(uint32_t capacity, uint32_t page_size,
+                   const ArenaOptions &options) {
   constexpr uint32_t kPageSize = 4096;
   if (page_size % kPageSize != 0)
     return -1;
@@ -17,24 +161,152 @@ int PageList::Init(uint32_t capacity, uint32_t page_size) {
 
   // 分配内存需要按页对齐,同时第一个节点index是0，和初始化的link
   // index重复了,所以不用了
-  page_buffer_ = (char *)aligned_alloc(kPageSize, page_size_ * (capacity_ + 1));
+  options_ = options;
+  page_buffer_ = AllocArena((size_t)page_size_ * (capacity_ + 1), options_,
+                            &arena_);
   if (!page_buffer_)
     return -1;
-  link_info_ = new LinkInfo[capacity_ + 1]{};
-  if (!page_buffer_)
+  frame_num_ = base_frame_num_ = capacity_ + 1;
+  link_info_ = new LinkInfo[frame_num_]{};
+  if (!link_info_)
     return -1;
+  // 所有页帧串成空闲链表
+  for (uint32_t idx = 1; idx < capacity_; idx++) {
+    link_info_[idx].next_idx = idx + 1;
+  }
+  free_head_ = capacity_ > 0 ? 1 : kInvaildIndex;
   return 0;
 }
 
 PageList::~PageList() {
-  if (page_buffer_) {
-    free(page_buffer_);
+  FreeArena(page_buffer_, arena_);
+  for (auto &segment : segments_) {
+    FreeArena(segment.buffer, segment.arena);
   }
   if (link_info_) {
     delete[] link_info_;
   }
 }
 
+char *PageList::SegmentPage(uint32_t idx) {
+  for (auto &segment : segments_) {
+    if (idx < segment.first_idx + segment.count) {
+      return segment.buffer + (size_t)(idx - segment.first_idx) * page_size_;
+    }
+  }
+  return nullptr;
+}
+
+int PageList::Grow(uint32_t capacity) {
+  if (capacity <= capacity_) {
+    return 0;
+  }
+  // 之前缩容时没释放掉的页帧先用上
+  if (capacity <= frame_num_ - 1) {
+    capacity_ = capacity;
+    return 0;
+  }
+  // 新加一段内存,已有的页不动
+  Segment segment;
+  segment.first_idx = frame_num_;
+  segment.count = capacity - (frame_num_ - 1);
+  segment.buffer = AllocArena((size_t)page_size_ * segment.count, options_,
+                              &segment.arena);
+  if (!segment.buffer) {
+    return -1;
+  }
+  LinkInfo *link_info = new LinkInfo[frame_num_ + segment.count]{};
+  memcpy(link_info, link_info_, sizeof(LinkInfo) * frame_num_);
+  delete[] link_info_;
+  link_info_ = link_info;
+
+  // 新的页帧放到空闲链表头部
+  uint32_t last_idx = segment.first_idx + segment.count - 1;
+  for (uint32_t idx = segment.first_idx; idx < last_idx; idx++) {
+    link_info_[idx].next_idx = idx + 1;
+  }
+  link_info_[last_idx].next_idx = free_head_;
+  free_head_ = segment.first_idx;
+
+  frame_num_ += segment.count;
+  capacity_ = capacity;
+  segments_.push_back(segment);
+  return 0;
+}
+
+int PageList::SetCapacity(uint32_t capacity) {
+  if (capacity < size_ || capacity > frame_num_ - 1) {
+    return -1;
+  }
+  capacity_ = capacity;
+  return 0;
+}
+
+int PageList::Shrink(uint32_t capacity,
+                     const std::function<void(uint32_t, uint32_t)> &moved) {
+  if (capacity >= capacity_) {
+    return 0;
+  }
+  if (size_ > capacity) {
+    return -1;
+  }
+  capacity_ = capacity;
+  // 从后往前释放整段,剩下的页帧要能放下capacity个页
+  uint32_t release_idx = frame_num_;
+  size_t keep_segments = segments_.size();
+  while (keep_segments > 0 &&
+         segments_[keep_segments - 1].first_idx - 1 >= capacity) {
+    keep_segments--;
+    release_idx = segments_[keep_segments].first_idx;
+  }
+  if (release_idx == frame_num_) {
+    return 0;
+  }
+
+  // 重新串空闲链表,去掉要释放的页帧
+  uint32_t free_head = kInvaildIndex;
+  for (uint32_t idx = free_head_; idx != kInvaildIndex;) {
+    uint32_t next_idx = link_info_[idx].next_idx;
+    if (idx < release_idx) {
+      link_info_[idx].next_idx = free_head;
+      free_head = idx;
+    }
+    idx = next_idx;
+  }
+  free_head_ = free_head;
+
+  // 要释放的页帧上的页搬到留下来的空闲页帧上,在链表中的位置不变
+  for (uint32_t idx = using_head_; idx != kInvaildIndex;) {
+    uint32_t next_idx = link_info_[idx].next_idx;
+    if (idx >= release_idx) {
+      uint32_t new_idx = free_head_;
+      free_head_ = link_info_[new_idx].next_idx;
+      LinkInfo &node = link_info_[idx];
+      link_info_[new_idx] = node;
+      if (node.prev_idx != kInvaildIndex) {
+        link_info_[node.prev_idx].next_idx = new_idx;
+      } else {
+        using_head_ = new_idx;
+      }
+      if (node.next_idx != kInvaildIndex) {
+        link_info_[node.next_idx].prev_idx = new_idx;
+      } else {
+        using_tail_ = new_idx;
+      }
+      memcpy(GetPage(new_idx), GetPage(idx), page_size_);
+      moved(idx, new_idx);
+    }
+    idx = next_idx;
+  }
+
+  for (size_t i = keep_segments; i < segments_.size(); i++) {
+    FreeArena(segments_[i].buffer, segments_[i].arena);
+  }
+  segments_.resize(keep_segments);
+  frame_num_ = release_idx;
+  return 0;
+}
+
 PageList::Iterator PageList::PushFront() {
   if (Full()) {
     return End();
@@ -42,12 +314,7 @@ PageList::Iterator PageList::PushFront() {
   uint32_t return_idx = free_head_;
   LinkInfo &free_node = link_info_[free_head_];
   size_++;
-  // 后面没有节点了,需要扩容
-  if (free_node.next_idx == kInvaildIndex) {
-    free_head_ = (size_ + 1) % (capacity_ + 1);
-  } else {
-    free_head_ = free_node.next_idx;
-  }
+  free_head_ = free_node.next_idx;
 
   free_node.next_idx = using_head_;
   free_node.prev_idx = kInvaildIndex;
@@ -121,12 +388,7 @@ std::pair<PageList::Iterator, bool> PageList::Insert(Iterator iter) {
 
   LinkInfo &free_node = link_info_[free_head_];
   size_++;
-  // 需要扩容了
-  if (free_node.next_idx == kInvaildIndex) {
-    free_head_ = (size_ + 1) % (capacity_ + 1);
-  } else {
-    free_head_ = free_node.next_idx;
-  }
+  free_head_ = free_node.next_idx;
   free_node.next_idx = iter.idx_;
   free_node.prev_idx = node.prev_idx;
 
@@ -175,11 +437,7 @@ PageList::Iterator PageList::PushBack() {
     return End();
   uint32_t new_node_idx = free_head_;
   LinkInfo &new_node = link_info_[new_node_idx];
-  if (new_node.next_idx != kInvaildIndex) {
-    free_head_ = new_node.next_idx;
-  } else {
-    free_head_ = (size_ + 1) % (capacity_ + 1);
-  }
+  free_head_ = new_node.next_idx;
   new_node.next_idx = kInvaildIndex;
   new_node.prev_idx = using_tail_;
   if (Empty()) {
@@ -194,6 +452,12 @@ PageList::Iterator PageList::PushBack() {
 }
 
 PageLruCache::~PageLruCache() {
+  StopPreload();
+  if (aio_ctx_ != 0) {
+    // 会等还在读的页读完
+    syscall(SYS_io_destroy, aio_ctx_);
+  }
+  readahead_.Stop();
   if (fd_ >= 0) {
     close(fd_);
   }
@@ -221,98 +485,815 @@ int PageLruCache::CheckAlignFile(uint32_t page_size) const {
 }
 
 int PageLruCache::Init(const std::string &file_name, uint32_t page_size,
-                       uint32_t capacity) {
+                       uint32_t capacity, const ArenaOptions &options) {
   fd_ = open(file_name.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
   if (fd_ < 0 || CheckAlignMem(page_size) || CheckAlignFile(page_size)) {
     return -1;
   }
 
-  if (page_list_.Init(capacity, page_size) != 0) {
+  if (page_list_.Init(capacity, page_size, options) != 0) {
     return -1;
   }
 
+  base_capacity_ = capacity;
   page_info_.reserve(capacity);
+  frame_offset_.resize(capacity + 1);
   return 0;
 }
 
+void PageLruCache::SetOverflowLimit(uint32_t pages) {
+  max_overflow_pages_ = pages;
+  // 溢出时不能rehash,外面还拿着PageCacheIter
+  page_info_.reserve(base_capacity_ + max_overflow_pages_);
+}
+
+int PageLruCache::EnableReadahead(uint32_t max_window,
+                                  Readahead::NextFn next_fn) {
+  if (max_window == 0) {
+    return 0;
+  }
+  return readahead_.Init(fd_, page_list_.GetPageSize(), max_window,
+                         std::move(next_fn));
+}
+
+CacheStats PageLruCache::Stats() {
+  CacheStats stats = stats_;
+  stats.readahead_pages = readahead_.PrefetchedPages();
+  stats.readahead_window = readahead_.Window();
+  stats.arena = page_list_.GetArenaInfo();
+  stats.capacity = page_list_.Capacity();
+  stats.resident = page_list_.Size();
+  stats.overflow_pages = page_list_.Capacity() - base_capacity_;
+  if (shadow_.Enabled()) {
+    stats.retained_blocks = shadow_.RetainedBlocks();
+  }
+  return stats;
+}
+
+bool PageLruCache::EvictUnused() {
+  if (unused_head_ == page_list_.End()) {
+    return false;
+  }
+  // 淘汰一个最久没用的空余页，如果剩最后一个空余，把空余头节点改一下
+  PageIter tail = page_list_.Tail();
+  if (tail == unused_head_) {
+    unused_head_ = page_list_.End();
+  }
+  page_info_.erase(frame_offset_[tail.idx_]);
+  page_list_.PopBack();
+  return true;
+}
+
+PageIter PageLruCache::AllocFrame() {
+  // 满了且没有空余
+  if (page_list_.Full() && !EvictUnused()) {
+    return page_list_.End();
+  }
+  return page_list_.PushFront();
+}
+
+PageIter PageLruCache::ReclaimFrame() {
+  constexpr uint32_t kFlushBatch = 8;
+  constexpr uint32_t kOverflowChunk = 16;
+  stats_.pressure_events++;
+  // 先从最久没用的一端同步写回几个没被引用的脏页,写完就可以淘汰了
+  uint32_t flushed = 0;
+  for (PageIter iter = page_list_.Tail();
+       iter != page_list_.End() && flushed < kFlushBatch;) {
+    PageIter prev = iter;
+    --prev;
+    auto info_iter = page_info_.find(frame_offset_[iter.idx_]);
+    PageInfo &page_info = info_iter->second;
+    if (page_info.in_use_count == 0 && page_info.dirty &&
+        !page_info.loading) {
+      if (FlushPage(info_iter) != 0) {
+        break;
+      }
+      flushed++;
+    }
+    iter = prev;
+  }
+  stats_.pressure_flushes += flushed;
+  PageIter frame = AllocFrame();
+  if (frame != page_list_.End()) {
+    return frame;
+  }
+
+  // 全都被引用住了,临时借一个溢出页帧,引用释放后再还回去
+  uint32_t overflow = page_list_.Capacity() - base_capacity_;
+  if (overflow >= max_overflow_pages_) {
+    stats_.alloc_failures++;
+    return page_list_.End();
+  }
+  uint32_t capacity = page_list_.Capacity() + 1;
+  if (capacity > page_list_.FrameNum() - 1) {
+    // 一次多申请几个页帧,后面的溢出直接用
+    uint32_t chunk = std::min(kOverflowChunk, max_overflow_pages_ - overflow);
+    if (page_list_.Grow(capacity + chunk - 1) != 0) {
+      stats_.alloc_failures++;
+      return page_list_.End();
+    }
+    frame_offset_.resize(page_list_.FrameNum());
+  }
+  page_list_.SetCapacity(capacity);
+  stats_.overflow_allocs++;
+  return page_list_.PushFront();
+}
+
+void PageLruCache::ReturnOverflow() {
+  // 有溢出页帧时,一有能淘汰的页就淘汰掉,把容量还回去
+  while (page_list_.Capacity() > base_capacity_ &&
+         page_list_.Size() < page_list_.Capacity()) {
+    page_list_.SetCapacity(page_list_.Capacity() - 1);
+  }
+  while (page_list_.Capacity() > base_capacity_ && EvictUnused()) {
+    page_list_.SetCapacity(page_list_.Capacity() - 1);
+  }
+}
+
+void PageLruCache::MoveToUnusedTail(PageInfo &page_info) {
+  page_info.iter = page_list_.MoveToBack(page_info.iter);
+  if (unused_head_ == page_list_.End()) {
+    unused_head_ = page_info.iter;
+  }
+}
+
+void PageLruCache::MoveToUnusedHead(PageInfo &page_info) {
+  if (unused_head_ == page_list_.End()) {
+    unused_head_ = page_list_.MoveToBack(page_info.iter);
+  } else {
+    unused_head_ = page_list_.MoveBeforeIter(page_info.iter, unused_head_);
+  }
+  page_info.iter = unused_head_;
+}
+
 PageCacheIter PageLruCache::GetPage(off_t offset, bool is_new) {
+  if (loading_num_ > 0) {
+    ReapLoaded();
+  }
   auto iter = page_info_.find(offset);
+  if (iter != page_info_.end() && iter->second.loading) {
+    // 后台还没读完,等一下
+    WaitPage(offset);
+    iter = page_info_.find(offset);
+  }
   if (iter != page_info_.end()) {
     assert(is_new == false);
-    // 如果找到了,放在最前面
     PageInfo &page_info = iter->second;
-    page_info.iter = page_list_.MoveToHead(page_info.iter);
-    page_info.in_use_count++;
-    // 如果刚好是空闲头节点,需要改变一下
+    // 如果刚好是空闲头节点,需要改成下一个
     if (unused_head_ == page_info.iter) {
-      unused_head_ = page_info.iter++;
+      ++unused_head_;
     }
+    // 如果找到了,放在最前面
+    page_info.iter = page_list_.MoveToHead(page_info.iter);
+    page_info.in_use_count++;
+    stats_.hits++;
+    readahead_.OnAccess(offset, *page_info.iter, true);
     return iter;
   } else {
-    // 满了且没有空余
-    if (page_list_.Full() && unused_head_ == page_list_.End()) {
-      return page_info_.end();
+    PageList::Iterator iter = AllocFrame();
+    if (iter == page_list_.End()) {
+      iter = ReclaimFrame();
     }
-    if (unused_head_ != page_list_.End()) {
-      // 有空余淘汰一个，如果剩最后一个空余，把空余头节点改一下
-      if (page_list_.Tail() == unused_head_) {
-        unused_head_ = page_list_.End();
-      }
-      page_list_.PopBack();
+    if (iter == page_list_.End()) {
+      return page_info_.end();
     }
-    PageList::Iterator iter = page_list_.PushFront();
+    stats_.misses++;
     if (!is_new) {
-      uint32_t page_size = page_list_.GetPageSize();
-      // 如果没找到,从磁盘中读取
-      ssize_t size = pread(fd_, *iter, page_size, offset);
-      if (size != page_size) {
+      if (readahead_.Take(offset, *iter)) {
+        stats_.readahead_hits++;
+      } else {
+        uint32_t page_size = page_list_.GetPageSize();
+        // 如果没找到,从磁盘中读取
+        ssize_t size = pread(fd_, *iter, page_size, ReadBlock(offset));
+        if (size != page_size) {
+          page_list_.Erase(iter);
+          return page_info_.end();
+        }
+      }
+      if (VerifyPage(*iter) != 0) {
+        page_list_.Erase(iter);
         return page_info_.end();
       }
+      readahead_.OnAccess(offset, *iter, false);
+    } else {
+      readahead_.Invalidate(offset);
     }
+    frame_offset_[iter.idx_] = offset;
     auto &&[new_iter, insert] =
         page_info_.emplace(offset, PageInfo{offset, iter, 1, is_new});
     std::ignore = insert;
+    if (is_new) {
+      dirty_pages_.insert(offset);
+    }
     return new_iter;
   }
 }
 
+uint32_t PageLruCache::Preload(const std::vector<off_t> &offsets,
+                               uint32_t threads, bool async) {
+  if (loading_num_ > 0) {
+    ReapLoaded();
+  }
+  // 先在缓存里占好位置
+  std::vector<std::pair<off_t, PageInfo *>> pages;
+  uint32_t resident = 0;
+  for (off_t offset : offsets) {
+    if (page_info_.count(offset)) {
+      resident++;
+      continue;
+    }
+    PageIter iter = AllocFrame();
+    if (iter == page_list_.End()) {
+      break;
+    }
+    frame_offset_[iter.idx_] = offset;
+    auto &&[info_iter, insert] =
+        page_info_.emplace(offset, PageInfo{offset, iter, 0, false, true});
+    std::ignore = insert;
+    pages.emplace_back(offset, &info_iter->second);
+  }
+  if (pages.empty()) {
+    return resident;
+  }
+
+  // 文件中连续的页合并成一次读
+  constexpr uint32_t kMaxRunPages = 256;
+  uint32_t page_size = page_list_.GetPageSize();
+  std::vector<std::pair<off_t, PageInfo *>> sorted;
+  for (auto &[offset, info] : pages) {
+    sorted.emplace_back(ReadBlock(offset), info);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](auto &a, auto &b) { return a.first < b.first; });
+  std::vector<PreloadRun> runs;
+  for (auto &[block, info] : sorted) {
+    if (runs.empty() || runs.back().pages.size() >= kMaxRunPages ||
+        runs.back().offset + (off_t)runs.back().pages.size() * page_size !=
+            block) {
+      runs.push_back(PreloadRun{block, {}, {}});
+    }
+    runs.back().pages.push_back(*info->iter);
+    runs.back().page_offsets.push_back(info->page_offset);
+  }
+
+  loading_num_ += pages.size();
+  stats_.preload_pages += pages.size();
+  if (async) {
+    LoadRuns(std::move(runs), threads, &loaded_);
+    return resident + pages.size();
+  }
+  std::vector<std::pair<off_t, bool>> loaded;
+  std::vector<std::thread> loaders;
+  std::swap(loaders, loaders_);
+  LoadRuns(std::move(runs), threads, &loaded);
+  JoinLoaders();
+  std::swap(loaders, loaders_);
+  // 按传进来的顺序放到空闲区尾部,越靠前的越晚被淘汰
+  std::unordered_map<off_t, bool> result(loaded.begin(), loaded.end());
+  for (auto &[offset, info] : pages) {
+    bool ok = result[offset];
+    FinishLoad(offset, ok);
+    resident += ok;
+  }
+  return resident;
+}
+
+void PageLruCache::LoadRuns(std::vector<PreloadRun> runs, uint32_t threads,
+                            std::vector<std::pair<off_t, bool>> *loaded) {
+  auto shared_runs =
+      std::make_shared<std::vector<PreloadRun>>(std::move(runs));
+  auto next = std::make_shared<std::atomic<size_t>>(0);
+  threads = std::max(1u, std::min<uint32_t>(threads, shared_runs->size()));
+  uint32_t page_size = page_list_.GetPageSize();
+  for (uint32_t i = 0; i < threads; i++) {
+    loaders_.emplace_back([this, shared_runs, next, page_size, loaded] {
+      for (;;) {
+        size_t idx = next->fetch_add(1);
+        if (idx >= shared_runs->size()) {
+          break;
+        }
+        const PreloadRun &run = (*shared_runs)[idx];
+        bool ok = false;
+        {
+          std::lock_guard<std::mutex> lock(load_mutex_);
+          ok = !load_stop_;
+        }
+        if (ok) {
+          std::vector<iovec> iov(run.pages.size());
+          for (size_t j = 0; j < run.pages.size(); j++) {
+            iov[j].iov_base = run.pages[j];
+            iov[j].iov_len = page_size;
+          }
+          ssize_t size = preadv(fd_, iov.data(), iov.size(), run.offset);
+          ok = size == (ssize_t)page_size * (ssize_t)run.pages.size();
+        }
+        // 校验失败的页不放进缓存,之后访问时再同步读一次
+        std::vector<bool> valid(run.pages.size(), ok);
+        for (size_t j = 0; ok && verify_ && j < run.pages.size(); j++) {
+          uint64_t lsn;
+          valid[j] = PageVerify(run.pages[j], page_size, &lsn) == 0;
+        }
+        std::lock_guard<std::mutex> lock(load_mutex_);
+        for (size_t j = 0; j < run.page_offsets.size(); j++) {
+          loaded->emplace_back(run.page_offsets[j], valid[j]);
+        }
+        load_cond_.notify_all();
+      }
+    });
+  }
+}
+
+void PageLruCache::JoinLoaders() {
+  for (auto &loader : loaders_) {
+    loader.join();
+  }
+  loaders_.clear();
+}
+
+void PageLruCache::StopPreload() {
+  {
+    std::lock_guard<std::mutex> lock(load_mutex_);
+    load_stop_ = true;
+  }
+  JoinLoaders();
+  std::lock_guard<std::mutex> lock(load_mutex_);
+  load_stop_ = false;
+}
+
+void PageLruCache::FinishLoad(off_t offset, bool ok) {
+  auto iter = page_info_.find(offset);
+  assert(iter != page_info_.end() && iter->second.loading);
+  loading_num_--;
+  PageInfo &page_info = iter->second;
+  if (!ok) {
+    page_list_.Erase(page_info.iter);
+    page_info_.erase(iter);
+    return;
+  }
+  page_info.loading = false;
+  // FetchPage读的页还被引用着,留在使用区
+  if (page_info.in_use_count == 0) {
+    MoveToUnusedTail(page_info);
+  }
+}
+
+void PageLruCache::ReapLoaded() {
+  std::vector<std::pair<off_t, bool>> loaded;
+  {
+    std::lock_guard<std::mutex> lock(load_mutex_);
+    loaded.swap(loaded_);
+  }
+  for (auto &[offset, ok] : loaded) {
+    FinishLoad(offset, ok);
+  }
+}
+
+void PageLruCache::WaitLoaded(off_t offset) {
+  std::unique_lock<std::mutex> lock(load_mutex_);
+  load_cond_.wait(lock, [&] {
+    return std::find_if(loaded_.begin(), loaded_.end(), [&](auto &page) {
+             return page.first == offset;
+           }) != loaded_.end();
+  });
+}
+
+void PageLruCache::SetFetchDepth(uint32_t depth) {
+  if (aio_ctx_ != 0 || depth == 0) {
+    return;
+  }
+  if (syscall(SYS_io_setup, depth, &aio_ctx_) != 0) {
+    // 不支持AIO时FetchPage返回-1,调用方同步读
+    aio_ctx_ = 0;
+    return;
+  }
+  fetch_slots_.resize(depth);
+  fetch_events_.resize(depth);
+  for (uint32_t i = depth; i > 0; i--) {
+    free_slots_.push_back(i - 1);
+  }
+}
+
+int PageLruCache::FetchPage(off_t offset) {
+  if (loading_num_ > 0) {
+    ReapLoaded();
+  }
+  auto info_iter = page_info_.find(offset);
+  if (info_iter != page_info_.end()) {
+    if (!info_iter->second.loading) {
+      return 1;
+    }
+    info_iter->second.in_use_count++;
+    return 0;
+  }
+  if (aio_ctx_ == 0) {
+    return -1;
+  }
+  // 同时在读的页数到上限了,先等一个读完
+  while (free_slots_.empty()) {
+    if (ReapFetched(true) < 0) {
+      return -1;
+    }
+  }
+  PageIter iter = AllocFrame();
+  if (iter == page_list_.End()) {
+    iter = ReclaimFrame();
+  }
+  if (iter == page_list_.End()) {
+    return -1;
+  }
+
+  uint32_t slot = free_slots_.back();
+  iocb &cb = fetch_slots_[slot].cb;
+  memset(&cb, 0, sizeof(cb));
+  cb.aio_data = slot;
+  cb.aio_lio_opcode = IOCB_CMD_PREAD;
+  cb.aio_fildes = fd_;
+  cb.aio_buf = (uint64_t)*iter;
+  cb.aio_nbytes = page_list_.GetPageSize();
+  cb.aio_offset = ReadBlock(offset);
+  iocb *cbs[1] = {&cb};
+  if (syscall(SYS_io_submit, aio_ctx_, 1, cbs) != 1) {
+    page_list_.Erase(iter);
+    return -1;
+  }
+  free_slots_.pop_back();
+  fetch_slots_[slot].page_offset = offset;
+  fetching_num_++;
+  frame_offset_[iter.idx_] = offset;
+  page_info_.emplace(offset, PageInfo{offset, iter, 1, false, true});
+  loading_num_++;
+  stats_.async_reads++;
+  return 0;
+}
+
+int PageLruCache::ReapFetched(bool wait) {
+  if (fetching_num_ == 0) {
+    return 0;
+  }
+  long num;
+  do {
+    num = syscall(SYS_io_getevents, aio_ctx_, wait ? 1 : 0,
+                  fetch_events_.size(), fetch_events_.data(), nullptr);
+  } while (num < 0 && errno == EINTR);
+  if (num < 0) {
+    return -1;
+  }
+  uint32_t page_size = page_list_.GetPageSize();
+  for (long i = 0; i < num; i++) {
+    const io_event &event = fetch_events_[i];
+    uint32_t slot = event.data;
+    off_t offset = fetch_slots_[slot].page_offset;
+    fetch_slots_[slot].page_offset = -1;
+    free_slots_.push_back(slot);
+    fetching_num_--;
+    bool ok = event.res == (int64_t)page_size;
+    if (ok && verify_) {
+      ok = VerifyPage(*page_info_[offset].iter) == 0;
+    }
+    FinishLoad(offset, ok);
+  }
+  return num;
+}
+
+void PageLruCache::WaitPage(off_t offset) {
+  auto iter = page_info_.find(offset);
+  if (iter == page_info_.end() || !iter->second.loading) {
+    return;
+  }
+  if (!IsFetching(offset)) {
+    WaitLoaded(offset);
+    ReapLoaded();
+    return;
+  }
+  while (IsFetching(offset) && ReapFetched(true) >= 0) {
+  }
+}
+
+bool PageLruCache::IsFetching(off_t offset) const {
+  for (auto &slot : fetch_slots_) {
+    if (slot.page_offset == offset) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PageLruCache::Loading(off_t offset) const {
+  auto iter = page_info_.find(offset);
+  return iter != page_info_.end() && iter->second.loading;
+}
+
+void PageLruCache::ReapLoads(bool wait) {
+  if (loading_num_ > 0) {
+    ReapLoaded();
+  }
+  if (fetching_num_ > 0) {
+    ReapFetched(wait);
+  } else if (wait && loading_num_ > 0) {
+    // 只剩Preload在读
+    {
+      std::unique_lock<std::mutex> lock(load_mutex_);
+      load_cond_.wait(lock, [this] { return !loaded_.empty(); });
+    }
+    ReapLoaded();
+  }
+}
+
+std::vector<off_t> PageLruCache::ResidentPages() {
+  std::vector<off_t> offsets;
+  for (auto iter = page_list_.Begin(); iter != page_list_.End(); ++iter) {
+    off_t offset = frame_offset_[iter.idx_];
+    auto info_iter = page_info_.find(offset);
+    if (info_iter != page_info_.end() && !info_iter->second.loading) {
+      offsets.push_back(offset);
+    }
+  }
+  return offsets;
+}
+
 int PageLruCache::UnusePage(off_t offset) {
   auto iter = page_info_.find(offset);
   if (iter == page_info_.end()) {
     return 0;
   }
+  return Unpin(iter, false);
+}
+
+int PageLruCache::Unpin(PageCacheIter iter, bool dirty) {
   PageInfo &page_info = iter->second;
+  if (dirty && !page_info.dirty) {
+    page_info.dirty = true;
+    dirty_pages_.insert(page_info.page_offset);
+  }
   if (page_info.in_use_count == 0) {
     return 0;
   }
-  page_info.in_use_count--;
-  if (page_info.in_use_count == 0 && !page_info.dirty) {
-    if (unused_head_ == page_list_.End()) {
-      unused_head_ = page_list_.MoveToBack(page_info.iter);
-    } else {
-      unused_head_ = page_list_.MoveBeforeIter(page_info.iter, unused_head_);
-    }
+  int in_use_count = --page_info.in_use_count;
+  if (in_use_count > 0) {
+    return in_use_count;
+  }
+  if (page_info.dirty && page_list_.Capacity() > base_capacity_) {
+    // 借着溢出页帧,脏页直接写回,好尽快还回去
+    FlushPage(iter);
+  } else if (!page_info.dirty) {
+    // 没人用了并且是干净的,放到空余区,可以被淘汰
+    MoveToUnusedHead(page_info);
   }
-  return page_info.in_use_count;
+  if (!page_info.dirty) {
+    // 这里可能把这个页淘汰掉,之后不能再访问page_info
+    ReturnOverflow();
+  }
+  return in_use_count;
 }
 
 int PageLruCache::SyncPage(off_t page_offset) {
+  if (shadow_.Enabled()) {
+    // 影子分页在提交时统一写
+    return 0;
+  }
   auto iter = page_info_.find(page_offset);
   if (iter == page_info_.end()) {
     return 0;
   }
-  PageInfo &page_info = iter->second;
-  if (page_info.in_use_count == 0 || page_info.dirty == false) {
+  if (FlushPage(iter) != 0) {
+    return -1;
+  }
+  if (fsync(fd_) == -1) {
     return -1;
   }
-  ssize_t size =
-      pwrite(fd_, *page_info.iter, page_list_.GetPageSize(), page_offset);
+  return 0;
+}
+
+int PageLruCache::FlushPage(PageCacheIter iter) {
+  PageInfo &page_info = iter->second;
+  SealPage(*page_info.iter);
+  ssize_t size = pwrite(fd_, *page_info.iter, page_list_.GetPageSize(),
+                        WriteBlock(page_info.page_offset));
   if (size != page_list_.GetPageSize()) {
     return -1;
   }
-  if (fsync(fd_) == -1) {
+  stats_.page_writes++;
+  readahead_.Invalidate(page_info.page_offset);
+  if (page_info.dirty) {
+    page_info.dirty = false;
+    dirty_pages_.erase(page_info.page_offset);
+    if (page_info.in_use_count == 0) {
+      MoveToUnusedHead(page_info);
+    }
+  }
+  return 0;
+}
+
+int PageLruCache::FlushAll() {
+  // 按偏移顺序写,尽量顺序IO
+  std::vector<PageCacheIter> dirty_pages;
+  for (off_t offset : dirty_pages_) {
+    auto iter = page_info_.find(offset);
+    if (!iter->second.loading) {
+      dirty_pages.push_back(iter);
+    }
+  }
+  std::sort(dirty_pages.begin(), dirty_pages.end(),
+            [](auto &a, auto &b) { return a->first < b->first; });
+  for (auto iter : dirty_pages) {
+    if (FlushPage(iter) != 0) {
+      return -1;
+    }
+  }
+  if (!dirty_pages.empty() && fsync(fd_) == -1) {
     return -1;
   }
-  page_info.dirty = false;
   return 0;
-}
\ No newline at end of file
+}
+
+int PageLruCache::Resize(uint32_t capacity) {
+  if (capacity == 0) {
+    return -1;
+  }
+  // 后台Preload和FetchPage直接往页帧里写,先等它们读完
+  JoinLoaders();
+  ReapLoaded();
+  while (fetching_num_ > 0 && ReapFetched(true) >= 0) {
+  }
+  if (capacity >= page_list_.Capacity()) {
+    if (page_list_.Grow(capacity) != 0) {
+      return -1;
+    }
+    frame_offset_.resize(page_list_.FrameNum());
+    page_info_.reserve(capacity + max_overflow_pages_);
+    base_capacity_ = capacity;
+    return 0;
+  }
+
+  // 缩容:脏页先写回,再淘汰最久没用的页,直到放得下
+  if (page_list_.Size() > capacity && FlushAll() != 0) {
+    return -1;
+  }
+  while (page_list_.Size() > capacity && EvictUnused()) {
+  }
+  if (page_list_.Size() > capacity) {
+    // 剩下的都被pin住了
+    return -1;
+  }
+  base_capacity_ = capacity;
+  return page_list_.Shrink(capacity, [this](uint32_t from, uint32_t to) {
+    off_t offset = frame_offset_[from];
+    frame_offset_[to] = offset;
+    page_info_[offset].iter.idx_ = to;
+    if (unused_head_.idx_ == from) {
+      unused_head_.idx_ = to;
+    }
+  });
+}
+
+int PageLruCache::EnableShadow(const std::string &file_name,
+                               uint64_t logical_size, uint64_t gen,
+                               uint64_t len) {
+  return shadow_.Open(file_name, fd_, page_list_.GetPageSize(), logical_size,
+                      gen, len);
+}
+
+int PageLruCache::ShadowCommit(uint64_t *gen, uint64_t *len) {
+  constexpr uint32_t kMaxRunPages = 256;
+  // 脏页按逻辑偏移分配新块,这样新块基本是连续的
+  std::vector<std::pair<off_t, PageCacheIter>> dirty_pages;
+  for (off_t offset : dirty_pages_) {
+    auto iter = page_info_.find(offset);
+    if (!iter->second.loading) {
+      dirty_pages.emplace_back(offset, iter);
+    }
+  }
+  std::sort(dirty_pages.begin(), dirty_pages.end(),
+            [](auto &a, auto &b) { return a.first < b.first; });
+  for (auto &page : dirty_pages) {
+    page.first = shadow_.PendingBlock(page.first);
+  }
+  std::sort(dirty_pages.begin(), dirty_pages.end(),
+            [](auto &a, auto &b) { return a.first < b.first; });
+
+  // 连续的块合并成一次写
+  uint32_t page_size = page_list_.GetPageSize();
+  for (size_t i = 0; i < dirty_pages.size();) {
+    size_t j = i + 1;
+    while (j < dirty_pages.size() && j - i < kMaxRunPages &&
+           dirty_pages[j].first ==
+               dirty_pages[i].first + (off_t)(j - i) * page_size) {
+      j++;
+    }
+    std::vector<iovec> iov(j - i);
+    for (size_t k = i; k < j; k++) {
+      iov[k - i].iov_base = *dirty_pages[k].second->second.iter;
+      iov[k - i].iov_len = page_size;
+      SealPage(*dirty_pages[k].second->second.iter);
+    }
+    ssize_t size = pwritev(fd_, iov.data(), iov.size(), dirty_pages[i].first);
+    if (size != (ssize_t)page_size * (ssize_t)iov.size()) {
+      return -1;
+    }
+    stats_.page_writes += iov.size();
+    i = j;
+  }
+  for (auto &page : dirty_pages) {
+    PageInfo &page_info = page.second->second;
+    page_info.dirty = false;
+    dirty_pages_.erase(page_info.page_offset);
+    if (page_info.in_use_count == 0) {
+      MoveToUnusedHead(page_info);
+    }
+  }
+  if (!shadow_.HasPending()) {
+    return 1;
+  }
+  if (fdatasync(fd_) != 0) {
+    return -1;
+  }
+  return shadow_.Commit(gen, len);
+}
+
+void PageLruCache::ShadowPublish() { shadow_.Publish(); }
+
+void PageLruCache::ShadowAbort() {
+  // 改过的页和写到新块上的页都丢掉,之后从提交过的块重新读
+  std::vector<PageCacheIter> drop;
+  for (auto iter = page_info_.begin(); iter != page_info_.end(); ++iter) {
+    if (iter->second.dirty || shadow_.IsPending(iter->first)) {
+      drop.push_back(iter);
+    }
+  }
+  for (auto iter : drop) {
+    DropPage(iter);
+  }
+  shadow_.Abort();
+}
+
+void PageLruCache::EnableChecksum(bool verify, uint64_t lsn) {
+  checksum_ = true;
+  verify_ = verify;
+  lsn_ = lsn;
+}
+
+void PageLruCache::SealPage(char *page) {
+  if (!checksum_) {
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  PageSeal(page, page_list_.GetPageSize(), ++lsn_);
+  stats_.checksum_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+}
+
+int PageLruCache::VerifyPage(const char *page) {
+  if (!verify_) {
+    return 0;
+  }
+  auto start = std::chrono::steady_clock::now();
+  uint64_t lsn = 0;
+  int ret = PageVerify(page, page_list_.GetPageSize(), &lsn);
+  stats_.checksum_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+  stats_.checksum_pages++;
+  if (ret != 0) {
+    stats_.checksum_failures++;
+    return -1;
+  }
+  // 崩溃后boot里的序号可能比页上的旧
+  lsn_ = std::max(lsn_, lsn);
+  return 0;
+}
+
+void PageLruCache::Discard(off_t page_offset) {
+  if (loading_num_ > 0) {
+    WaitPage(page_offset);
+  }
+  auto iter = page_info_.find(page_offset);
+  if (iter != page_info_.end()) {
+    DropPage(iter);
+  }
+  readahead_.Invalidate(page_offset);
+}
+
+void PageLruCache::DropPage(PageCacheIter iter) {
+  PageInfo &page_info = iter->second;
+  assert(page_info.in_use_count == 0 && !page_info.loading);
+  if (unused_head_ == page_info.iter) {
+    ++unused_head_;
+  }
+  page_list_.Erase(page_info.iter);
+  dirty_pages_.erase(page_info.page_offset);
+  page_info_.erase(iter);
+}
+
+int PageLruCache::ReadSnapshotPage(off_t page_offset, uint64_t seq,
+                                   char *page) {
+  uint32_t page_size = page_list_.GetPageSize();
+  off_t block = shadow_.SnapshotBlock(page_offset, seq);
+  if (pread(fd_, page, page_size, block) != (ssize_t)page_size) {
+    return -1;
+  }
+  // 可能在别的线程,不更新统计
+  uint64_t lsn;
+  return verify_ ? PageVerify(page, page_size, &lsn) : 0;
+}
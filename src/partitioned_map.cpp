@@ -0,0 +1,245 @@
+#include "partitioned_map.h"
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <string>
+
+namespace {
+
+// 在分区的线程里从from开始取一批,取不满说明这个分区扫完了
+// 节点读不到时返回-1,from不动
+int Collect(BMap &bmap, std::vector<std::pair<key_t, long>> *entries,
+            int64_t *from, key_t end, uint32_t batch) {
+  entries->clear();
+  if (*from > end) {
+    return 0;
+  }
+  if (bmap.BplusTreeScan((key_t)*from, end,
+                         [entries, batch](key_t key, long value) {
+                           entries->emplace_back(key, value);
+                           return entries->size() < batch;
+                         }) < 0) {
+    entries->clear();
+    return -1;
+  }
+  *from = entries->size() < batch ? (int64_t)end + 1
+                                   : (int64_t)entries->back().first + 1;
+  return 0;
+}
+
+} // namespace
+
+BPartitionedMap::~BPartitionedMap() { Close(); }
+
+int BPartitionedMap::Open() {
+  if (!shards_.empty() || conf_.partitions == 0) {
+    return -1;
+  }
+  if (conf_.mode == PARTITION_RANGE &&
+      (conf_.splits.size() + 1 != conf_.partitions ||
+       !std::is_sorted(conf_.splits.begin(), conf_.splits.end()))) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < conf_.partitions; i++) {
+    BConfig conf = conf_.conf;
+    conf.file_name += "." + std::to_string(i);
+    auto shard = std::make_unique<Shard>();
+    shard->bmap = std::make_unique<BMap>(conf);
+    shard->worker = std::thread(&BPartitionedMap::Work, this, shard.get());
+    shards_.push_back(std::move(shard));
+  }
+  return RunAll([this](uint32_t partition, BMap &bmap) {
+    int ret = bmap.BOpen();
+    shards_[partition]->opened = ret == 0;
+    return ret;
+  });
+}
+
+int BPartitionedMap::Close() {
+  if (shards_.empty()) {
+    return 0;
+  }
+  // 打开失败的分区不用关
+  int ret = RunAll([this](uint32_t partition, BMap &bmap) {
+    return shards_[partition]->opened ? bmap.BClose() : 0;
+  });
+  for (auto &shard : shards_) {
+    {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      shard->stop = true;
+    }
+    shard->cond.notify_one();
+    shard->worker.join();
+  }
+  shards_.clear();
+  return ret;
+}
+
+uint32_t BPartitionedMap::Partition(key_t key) const {
+  if (conf_.mode == PARTITION_RANGE) {
+    return std::upper_bound(conf_.splits.begin(), conf_.splits.end(), key) -
+           conf_.splits.begin();
+  }
+  // 乘法哈希取高位,连续的key也能分散开
+  uint64_t hash = (uint64_t)(uint32_t)key * 0x9e3779b97f4a7c15ull >> 32;
+  return hash * shards_.size() >> 32;
+}
+
+void BPartitionedMap::Work(Shard *shard) {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(shard->mutex);
+      shard->cond.wait(
+          lock, [shard] { return shard->stop || !shard->tasks.empty(); });
+      if (shard->tasks.empty()) {
+        return;
+      }
+      task = std::move(shard->tasks.front());
+      shard->tasks.pop_front();
+    }
+    task();
+  }
+}
+
+void BPartitionedMap::Post(uint32_t partition, std::function<void()> task) {
+  Shard *shard = shards_[partition].get();
+  {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    shard->tasks.push_back(std::move(task));
+  }
+  shard->cond.notify_one();
+}
+
+int BPartitionedMap::Run(uint32_t partition,
+                         const std::function<int(BMap &)> &fn) {
+  if (partition >= shards_.size()) {
+    return -1;
+  }
+  std::promise<int> done;
+  std::future<int> result = done.get_future();
+  BMap *bmap = shards_[partition]->bmap.get();
+  Post(partition, [&done, &fn, bmap] { done.set_value(fn(*bmap)); });
+  return result.get();
+}
+
+int BPartitionedMap::RunAll(
+    const std::function<int(uint32_t partition, BMap &)> &fn) {
+  std::vector<std::promise<int>> done(shards_.size());
+  for (uint32_t i = 0; i < shards_.size(); i++) {
+    BMap *bmap = shards_[i]->bmap.get();
+    Post(i, [&done, &fn, i, bmap] { done[i].set_value(fn(i, *bmap)); });
+  }
+  int ret = 0;
+  for (auto &result : done) {
+    if (result.get_future().get() != 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+int BPartitionedMap::Insert(key_t key, long value) {
+  return Run(Partition(key), [key, value](BMap &bmap) {
+    return bmap.BplusTreeInsert(key, value);
+  });
+}
+
+int BPartitionedMap::Upsert(key_t key, long value) {
+  return Run(Partition(key), [key, value](BMap &bmap) {
+    return bmap.BplusTreeUpsert(key, value);
+  });
+}
+
+int BPartitionedMap::Delete(key_t key) {
+  return Run(Partition(key),
+             [key](BMap &bmap) { return bmap.BplusTreeDelete(key); });
+}
+
+std::pair<long, bool> BPartitionedMap::Search(key_t key) {
+  std::pair<long, bool> result{0, false};
+  Run(Partition(key), [key, &result](BMap &bmap) {
+    result = bmap.BplusTreeSearch(key);
+    return 0;
+  });
+  return result;
+}
+
+uint32_t BPartitionedMap::MultiInsert(
+    const std::vector<std::pair<key_t, long>> &entries) {
+  if (shards_.empty()) {
+    return 0;
+  }
+  std::vector<std::vector<std::pair<key_t, long>>> parts(shards_.size());
+  for (auto &entry : entries) {
+    parts[Partition(entry.first)].push_back(entry);
+  }
+  std::atomic<uint32_t> count{0};
+  RunAll([&parts, &count](uint32_t partition, BMap &bmap) {
+    for (auto &[key, value] : parts[partition]) {
+      count += bmap.BplusTreeInsert(key, value) == 0;
+    }
+    return 0;
+  });
+  return count;
+}
+
+int BPartitionedMap::Fill(uint32_t partition, Cursor *cursor, key_t end) {
+  cursor->pos = 0;
+  return Run(partition, [cursor, end](BMap &bmap) {
+    return Collect(bmap, &cursor->entries, &cursor->from, end, kScanBatch);
+  });
+}
+
+int BPartitionedMap::Scan(key_t start, key_t end,
+                          const std::function<bool(key_t, long)> &fn) {
+  if (start > end || shards_.empty()) {
+    return 0;
+  }
+  // 按范围分区时只有[first, last]这几个分区和区间有交集
+  uint32_t first = 0;
+  uint32_t last = shards_.size() - 1;
+  if (conf_.mode == PARTITION_RANGE) {
+    first = Partition(start);
+    last = Partition(end);
+  }
+  std::vector<Cursor> cursors(shards_.size());
+  for (uint32_t i = 0; i < cursors.size(); i++) {
+    cursors[i].from = i < first || i > last ? (int64_t)end + 1 : start;
+  }
+  // 第一批各分区同时取
+  if (RunAll([&cursors, end](uint32_t partition, BMap &bmap) {
+        Cursor &cursor = cursors[partition];
+        return Collect(bmap, &cursor.entries, &cursor.from, end,
+                       kScanBatch);
+      }) != 0) {
+    return -1;
+  }
+
+  int count = 0;
+  for (;;) {
+    // 分区数不多,直接挑各游标里最小的key
+    int best = -1;
+    for (uint32_t i = first; i <= last; i++) {
+      Cursor &cursor = cursors[i];
+      if (cursor.pos == cursor.entries.size() && cursor.from <= end &&
+          Fill(i, &cursor, end) != 0) {
+        return -1;
+      }
+      if (cursor.pos < cursor.entries.size() &&
+          (best < 0 || cursor.entries[cursor.pos].first <
+                           cursors[best].entries[cursors[best].pos].first)) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    auto &entry = cursors[best].entries[cursors[best].pos++];
+    count++;
+    if (!fn(entry.first, entry.second)) {
+      break;
+    }
+  }
+  return count;
+}
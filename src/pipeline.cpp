@@ -0,0 +1,164 @@
+#include "pipeline.h"
+#include <memory>
+
+int BPipeline::Open() {
+  if (running_ || bmap_.BOpen() != 0) {
+    return -1;
+  }
+  stop_ = false;
+  running_ = true;
+  worker_ = std::thread(&BPipeline::Work, this);
+  return 0;
+}
+
+int BPipeline::Close() {
+  if (!running_) {
+    return 0;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  worker_.join();
+  running_ = false;
+  return bmap_.BClose();
+}
+
+std::future<BResult> BPipeline::Insert(key_t key, long value) {
+  return Submit(OP_INSERT, key, value);
+}
+
+std::future<BResult> BPipeline::Upsert(key_t key, long value) {
+  return Submit(OP_UPSERT, key, value);
+}
+
+std::future<BResult> BPipeline::Delete(key_t key) {
+  return Submit(OP_DELETE, key, 0);
+}
+
+std::future<BResult> BPipeline::Search(key_t key) {
+  return Submit(OP_SEARCH, key, 0);
+}
+
+PipelineStats BPipeline::Stats() const {
+  PipelineStats stats;
+  stats.requests = requests_.load(std::memory_order_relaxed);
+  stats.batches = batches_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+std::future<BResult> BPipeline::Submit(Op op, key_t key, long value) {
+  Request request;
+  request.op = op;
+  request.key = key;
+  request.value = value;
+  std::future<BResult> result = request.result.get_future();
+  // 队列满了就让出CPU,等处理线程取走一些
+  while (!ring_.TryPush(std::move(request))) {
+    std::this_thread::yield();
+  }
+  // 和Wait里的sleeping_配对:要么处理线程睡前看到了这个请求,要么这里看到它睡了
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cond_.notify_one();
+  }
+  return result;
+}
+
+void BPipeline::Wait() {
+  for (uint32_t i = 0; i < kSpins; i++) {
+    if (!ring_.Empty()) {
+      return;
+    }
+#if defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  sleeping_.store(true);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  cond_.wait(lock, [this] { return !ring_.Empty() || stop_; });
+  sleeping_.store(false);
+}
+
+void BPipeline::Work() {
+  std::vector<Request> batch;
+  batch.reserve(max_batch_);
+  for (;;) {
+    Request request;
+    while (batch.size() < max_batch_ && ring_.TryPop(&request)) {
+      batch.push_back(std::move(request));
+    }
+    if (batch.empty()) {
+      // 关闭前已经提交的请求都要做完
+      if (stop_ && ring_.Empty()) {
+        return;
+      }
+      Wait();
+      continue;
+    }
+    // 连续的查找和连续的写分别一起做,查找和写之间保持提交的顺序
+    for (size_t begin = 0; begin < batch.size();) {
+      bool search = batch[begin].op == OP_SEARCH;
+      size_t end = begin + 1;
+      while (end < batch.size() && (batch[end].op == OP_SEARCH) == search) {
+        end++;
+      }
+      if (search) {
+        ApplySearches(batch, begin, end);
+      } else {
+        ApplyWrites(batch, begin, end);
+      }
+      begin = end;
+    }
+    requests_.fetch_add(batch.size(), std::memory_order_relaxed);
+    batches_.fetch_add(1, std::memory_order_relaxed);
+    batch.clear();
+  }
+}
+
+void BPipeline::ApplySearches(std::vector<Request> &batch, size_t begin,
+                              size_t end) {
+  size_t num = end - begin;
+  std::vector<key_t> keys(num);
+  std::vector<long> values(num);
+  std::unique_ptr<bool[]> found(new bool[num]);
+  for (size_t i = 0; i < num; i++) {
+    keys[i] = batch[begin + i].key;
+  }
+  int ret =
+      bmap_.BplusTreeMultiSearch(keys.data(), num, values.data(), found.get());
+  for (size_t i = 0; i < num; i++) {
+    BResult result;
+    // 有节点读不到时分不清是哪个key,这一批查找都算失败
+    result.ret = ret < 0 ? -1 : 0;
+    result.value = values[i];
+    result.found = found[i];
+    batch[begin + i].result.set_value(result);
+  }
+}
+
+void BPipeline::ApplyWrites(std::vector<Request> &batch, size_t begin,
+                            size_t end) {
+  size_t num = end - begin;
+  std::vector<BWriteOp> ops(num);
+  std::vector<int> rets(num);
+  for (size_t i = 0; i < num; i++) {
+    const Request &request = batch[begin + i];
+    ops[i].key = request.key;
+    ops[i].value = request.value;
+    ops[i].type = request.op == OP_INSERT   ? BWriteOp::INSERT
+                  : request.op == OP_UPSERT ? BWriteOp::UPSERT
+                                            : BWriteOp::DELETE;
+  }
+  // 提交失败时这一批都返回-1:影子分页下都没有生效;原地写模式下可能
+  // 已经改到树上,之后的查找能看到,重新打开时还会按日志重做
+  int ret = bmap_.BplusTreeWriteBatch(ops.data(), num, rets.data());
+  for (size_t i = 0; i < num; i++) {
+    BResult result;
+    result.ret = ret != 0 ? -1 : rets[i];
+    batch[begin + i].result.set_value(result);
+  }
+}
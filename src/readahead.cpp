@@ -0,0 +1,268 @@
+#include "readahead.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+Readahead::~Readahead() {
+  Stop();
+  if (io_buffer_) {
+    free(io_buffer_);
+  }
+  if (pool_buffer_) {
+    free(pool_buffer_);
+  }
+}
+
+int Readahead::Init(int fd, uint32_t page_size, uint32_t max_window,
+                    NextFn next_fn) {
+  constexpr uint32_t kAlign = 4096;
+  if (max_window == 0 || page_size % kAlign != 0) {
+    return -1;
+  }
+  fd_ = fd;
+  page_size_ = page_size;
+  next_fn_ = std::move(next_fn);
+
+  // 后台读盘的缓冲区一次最多读一个窗口,暂存区留两个窗口
+  io_buffer_ = (char *)aligned_alloc(kAlign, (size_t)page_size_ * max_window);
+  pool_buffer_ =
+      (char *)aligned_alloc(kAlign, (size_t)page_size_ * max_window * 2);
+  if (!io_buffer_ || !pool_buffer_) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < max_window * 2; i++) {
+    free_bufs_.push_back(pool_buffer_ + (size_t)i * page_size_);
+  }
+  max_window_ = max_window;
+  worker_ = std::thread(&Readahead::Worker, this);
+  return 0;
+}
+
+void Readahead::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+}
+
+void Readahead::OnAccess(off_t offset, const char *page, bool hit) {
+  if (!Enabled() || offset == stream_pos_) {
+    return;
+  }
+  off_t next = next_fn_(page);
+  bool from_staging = offset == last_taken_;
+
+  if (stream_pos_ >= 0 &&
+      (offset == stream_next_ || offset == stream_pos_ + page_size_)) {
+    // 顺序流继续
+    stream_chain_ = offset == stream_next_;
+    if (issued_ahead_ > 0) {
+      issued_ahead_--;
+    }
+    if (!hit && !from_staging) {
+      // 预读落后于访问,从当前位置重新开始
+      Restart();
+    }
+  } else {
+    // 和最近访问过的页比较,看能不能组成新的顺序流
+    bool matched = false;
+    for (auto &access : history_) {
+      if (access.offset < 0) {
+        continue;
+      }
+      if (offset == access.next || offset == access.offset + page_size_) {
+        stream_chain_ = offset == access.next;
+        matched = true;
+        break;
+      }
+    }
+    history_[history_pos_] = Access{offset, next};
+    history_pos_ = (history_pos_ + 1) % kHistoryNum;
+    if (!matched) {
+      return;
+    }
+    window_ = 0;
+    Restart();
+  }
+  stream_pos_ = offset;
+  stream_next_ = next;
+
+  // 都在缓存里就不用预读了
+  if (hit && !from_staging) {
+    return;
+  }
+  Issue();
+}
+
+void Readahead::Restart() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  gen_++;
+  cursor_ = kNoCursor;
+  issued_ahead_ = 0;
+}
+
+void Readahead::Issue() {
+  // 还剩一半以上没被访问,等下次再发
+  if (window_ != 0 && issued_ahead_ > window_ / 2) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (busy_ || !jobs_.empty() || cursor_ == kEndCursor) {
+    return;
+  }
+  off_t start = cursor_;
+  if (start == kNoCursor) {
+    start = stream_chain_ ? stream_next_ : stream_pos_ + page_size_;
+  }
+  if (!ValidOffset(start)) {
+    return;
+  }
+  // 模式持续窗口就翻倍
+  window_ = window_ == 0 ? std::min(kMinWindow, max_window_)
+                         : std::min(window_ * 2, max_window_);
+  if (issued_ahead_ >= window_) {
+    return;
+  }
+  Job job{start, window_ - issued_ahead_, stream_chain_, gen_};
+  issued_ahead_ += job.count;
+  jobs_.push_back(job);
+  cond_.notify_all();
+}
+
+void Readahead::Worker() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cond_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+    if (stop_) {
+      break;
+    }
+    Job job = jobs_.front();
+    jobs_.pop_front();
+    busy_ = true;
+    lock.unlock();
+    RunJob(job);
+    lock.lock();
+    busy_ = false;
+    cond_.notify_all();
+  }
+}
+
+void Readahead::RunJob(const Job &job) {
+  off_t cur = job.start;
+  uint32_t left = job.count;
+  // 按链表预读时先假设下一页是物理相邻的,连续命中就加大一次读的页数
+  uint32_t span = job.chain ? 1 : job.count;
+  while (left > 0 && ValidOffset(cur)) {
+    uint32_t num = std::min(span, left);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) {
+        return;
+      }
+      reading_begin_ = cur;
+      reading_end_ = cur + (off_t)num * page_size_;
+    }
+    ssize_t size = pread(fd_, io_buffer_, (size_t)num * page_size_, cur);
+    uint32_t read_num = size > 0 ? size / page_size_ : 0;
+    uint32_t used = 0;
+    off_t next = -1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (; used < read_num; used++) {
+        off_t offset = cur + (off_t)used * page_size_;
+        if (job.chain && used > 0 && offset != next) {
+          break;
+        }
+        const char *page = io_buffer_ + (size_t)used * page_size_;
+        Stage(offset, page);
+        next = job.chain ? next_fn_(page) : offset + page_size_;
+      }
+      reading_begin_ = reading_end_ = 0;
+      stale_.clear();
+      if (job.gen == gen_) {
+        cursor_ = ValidOffset(next) ? next : kEndCursor;
+      }
+    }
+    cond_.notify_all();
+    if (used == 0) {
+      break;
+    }
+    left -= used;
+    cur = next;
+    if (job.chain) {
+      span = used == num ? std::min(span * 2, max_window_) : 1;
+    }
+  }
+}
+
+void Readahead::Stage(off_t offset, const char *page) {
+  // 读的过程中页被写过,读到的内容可能是旧的
+  if (stale_.count(offset)) {
+    return;
+  }
+  auto iter = staged_.find(offset);
+  if (iter != staged_.end()) {
+    memcpy(iter->second, page, page_size_);
+    return;
+  }
+  if (free_bufs_.empty()) {
+    // 暂存区满了,丢掉最早的
+    off_t oldest = staged_order_.front();
+    staged_order_.pop_front();
+    auto old_iter = staged_.find(oldest);
+    free_bufs_.push_back(old_iter->second);
+    staged_.erase(old_iter);
+  }
+  char *buf = free_bufs_.back();
+  free_bufs_.pop_back();
+  memcpy(buf, page, page_size_);
+  staged_.emplace(offset, buf);
+  staged_order_.push_back(offset);
+  prefetched_pages_++;
+}
+
+bool Readahead::Take(off_t offset, char *page) {
+  if (!Enabled()) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  // 正在读的页等读完再取,避免重复IO
+  cond_.wait(lock, [&] { return !Reading(offset); });
+  auto iter = staged_.find(offset);
+  if (iter == staged_.end()) {
+    return false;
+  }
+  memcpy(page, iter->second, page_size_);
+  free_bufs_.push_back(iter->second);
+  staged_.erase(iter);
+  staged_order_.erase(
+      std::find(staged_order_.begin(), staged_order_.end(), offset));
+  last_taken_ = offset;
+  return true;
+}
+
+void Readahead::Invalidate(off_t offset) {
+  if (!Enabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (Reading(offset)) {
+    stale_.insert(offset);
+  }
+  auto iter = staged_.find(offset);
+  if (iter != staged_.end()) {
+    free_bufs_.push_back(iter->second);
+    staged_.erase(iter);
+    staged_order_.erase(
+        std::find(staged_order_.begin(), staged_order_.end(), offset));
+  }
+}
+
+uint64_t Readahead::PrefetchedPages() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return prefetched_pages_;
+}
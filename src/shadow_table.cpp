@@ -0,0 +1,279 @@
+#include "shadow_table.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unordered_set>
+
+int SyncParentDir(const std::string &path) {
+  size_t pos = path.rfind('/');
+  std::string dir = pos == std::string::npos ? "." : path.substr(0, pos + 1);
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return -1;
+  }
+  int ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+ShadowTable::~ShadowTable() {
+  if (journal_fd_ >= 0) {
+    close(journal_fd_);
+  }
+  if (new_journal_fd_ >= 0) {
+    close(new_journal_fd_);
+  }
+}
+
+std::string ShadowTable::JournalName(uint64_t gen) const {
+  return file_name_ + ".map." + std::to_string(gen);
+}
+
+int ShadowTable::Open(const std::string &file_name, int fd, uint32_t page_size,
+                      uint64_t logical_size, uint64_t gen, uint64_t len,
+                      bool read_only) {
+  file_name_ = file_name;
+  fd_ = fd;
+  gen_ = gen;
+  identity_limit_ = logical_size;
+  if (gen > 0) {
+    journal_fd_ =
+        open(JournalName(gen).c_str(), read_only ? O_RDONLY : O_RDWR);
+    Header header;
+    if (journal_fd_ < 0 || len < sizeof(header) ||
+        pread(journal_fd_, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != kMagic) {
+      return -1;
+    }
+    identity_limit_ = header.identity_limit;
+    std::vector<Entry> entries((len - sizeof(header)) / sizeof(Entry));
+    ssize_t size = entries.size() * sizeof(Entry);
+    if (pread(journal_fd_, entries.data(), size, sizeof(header)) != size) {
+      return -1;
+    }
+    for (auto &entry : entries) {
+      committed_[entry.logical] = entry.physical;
+    }
+    journal_entries_ = entries.size();
+    // 丢掉没提交完的尾巴,以及压缩到一半留下的新日志
+    if (!read_only) {
+      if (ftruncate(journal_fd_, len) != 0) {
+        return -1;
+      }
+      unlink(JournalName(gen + 1).c_str());
+    }
+  }
+  len_ = len;
+
+  // 既不是映射目标,也不是原位页的块都是空闲的
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    return -1;
+  }
+  file_end_ = (st.st_size + page_size - 1) / page_size * page_size;
+  file_end_ = std::max<off_t>(file_end_, identity_limit_);
+  std::unordered_set<off_t> used;
+  for (auto &[logical, physical] : committed_) {
+    used.insert(physical);
+    file_end_ = std::max<off_t>(file_end_, physical + page_size);
+  }
+  for (off_t offset = 0; offset < (off_t)identity_limit_;
+       offset += page_size) {
+    if (!committed_.count(offset)) {
+      used.insert(offset);
+    }
+  }
+  for (off_t offset = 0; offset < file_end_; offset += page_size) {
+    if (!used.count(offset)) {
+      free_.insert(offset);
+    }
+  }
+  page_size_ = page_size;
+  return 0;
+}
+
+off_t ShadowTable::CommittedBlock(off_t logical) const {
+  auto iter = committed_.find(logical);
+  return iter == committed_.end() ? logical : iter->second;
+}
+
+off_t ShadowTable::Physical(off_t logical) const {
+  auto iter = pending_.find(logical);
+  return iter == pending_.end() ? CommittedBlock(logical) : iter->second;
+}
+
+off_t ShadowTable::PendingBlock(off_t logical) {
+  auto iter = pending_.find(logical);
+  if (iter != pending_.end()) {
+    return iter->second;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  off_t block;
+  if (!free_.empty()) {
+    block = *free_.begin();
+    free_.erase(free_.begin());
+  } else {
+    block = file_end_;
+    file_end_ += page_size_;
+  }
+  pending_.emplace(logical, block);
+  return block;
+}
+
+int ShadowTable::WriteJournal(int fd, off_t pos,
+                              const std::vector<Entry> &entries,
+                              uint64_t *len) {
+  ssize_t size = entries.size() * sizeof(Entry);
+  if (pwrite(fd, entries.data(), size, pos) != size || fdatasync(fd) != 0) {
+    return -1;
+  }
+  *len = pos + size;
+  return 0;
+}
+
+int ShadowTable::Commit(uint64_t *gen, uint64_t *len) {
+  constexpr uint64_t kMinCompactEntries = 4096;
+  std::vector<Entry> entries;
+  for (auto &[logical, physical] : pending_) {
+    entries.push_back(Entry{logical, physical});
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](auto &a, auto &b) { return a.logical < b.logical; });
+
+  uint64_t live = committed_.size() + pending_.size();
+  if (gen_ > 0 &&
+      journal_entries_ + entries.size() <= 2 * live + kMinCompactEntries) {
+    new_len_ = 0;
+    if (WriteJournal(journal_fd_, len_, entries, &new_len_) != 0) {
+      return -1;
+    }
+    *gen = gen_;
+    *len = new_len_;
+    return 0;
+  }
+
+  // 日志太长了,把整张表写到下一代日志里
+  std::unordered_map<off_t, off_t> table = committed_;
+  for (auto &[logical, physical] : pending_) {
+    table[logical] = physical;
+  }
+  std::vector<Entry> all;
+  for (auto &[logical, physical] : table) {
+    all.push_back(Entry{logical, physical});
+  }
+  std::string name = JournalName(gen_ + 1);
+  if (new_journal_fd_ >= 0) {
+    close(new_journal_fd_);
+  }
+  new_journal_fd_ = open(name.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+  Header header{kMagic, identity_limit_};
+  if (new_journal_fd_ < 0 ||
+      pwrite(new_journal_fd_, &header, sizeof(header), 0) != sizeof(header) ||
+      WriteJournal(new_journal_fd_, sizeof(header), all, &new_len_) != 0 ||
+      SyncParentDir(name) != 0) {
+    return -1;
+  }
+  new_entries_ = all.size();
+  *gen = gen_ + 1;
+  *len = new_len_;
+  return 0;
+}
+
+void ShadowTable::Publish() {
+  if (new_journal_fd_ >= 0) {
+    if (journal_fd_ >= 0) {
+      close(journal_fd_);
+      unlink(JournalName(gen_).c_str());
+    }
+    journal_fd_ = new_journal_fd_;
+    new_journal_fd_ = -1;
+    gen_++;
+    journal_entries_ = new_entries_;
+  } else {
+    journal_entries_ += pending_.size();
+  }
+  len_ = new_len_;
+
+  // 新的映射生效,原来的块没有快照要看就可以回收了
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t seq = seq_ + 1;
+  for (auto &[logical, physical] : pending_) {
+    if (committed_.count(logical) || logical < (off_t)identity_limit_) {
+      off_t old = CommittedBlock(logical);
+      auto since = since_.find(logical);
+      uint64_t from = since == since_.end() ? 0 : since->second;
+      if (SnapshotNeeds(from, seq)) {
+        retired_.emplace(logical, Retired{old, from, seq});
+      } else {
+        free_.insert(old);
+      }
+    }
+    committed_[logical] = physical;
+    since_[logical] = seq;
+  }
+  pending_.clear();
+  seq_ = seq;
+}
+
+bool ShadowTable::SnapshotNeeds(uint64_t from, uint64_t to) const {
+  auto iter = snapshots_.lower_bound(from);
+  return iter != snapshots_.end() && *iter < to;
+}
+
+uint64_t ShadowTable::AcquireSnapshot() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  snapshots_.insert(seq_);
+  return seq_;
+}
+
+void ShadowTable::ReleaseSnapshot(uint64_t seq) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = snapshots_.find(seq);
+  if (iter == snapshots_.end()) {
+    return;
+  }
+  snapshots_.erase(iter);
+  // 回收没有快照再看的旧块
+  for (auto iter = retired_.begin(); iter != retired_.end();) {
+    if (!SnapshotNeeds(iter->second.from, iter->second.to)) {
+      free_.insert(iter->second.physical);
+      iter = retired_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+off_t ShadowTable::SnapshotBlock(off_t logical, uint64_t seq) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto range = retired_.equal_range(logical);
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (iter->second.from <= seq && seq < iter->second.to) {
+      return iter->second.physical;
+    }
+  }
+  return CommittedBlock(logical);
+}
+
+uint64_t ShadowTable::RetainedBlocks() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return retired_.size();
+}
+
+void ShadowTable::Abort() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &[logical, physical] : pending_) {
+    free_.insert(physical);
+  }
+  pending_.clear();
+  if (new_journal_fd_ >= 0) {
+    close(new_journal_fd_);
+    new_journal_fd_ = -1;
+    unlink(JournalName(gen_ + 1).c_str());
+  }
+}
+
+uint64_t ShadowTable::UsedBlocks() const {
+  return file_end_ / page_size_ - free_.size();
+}
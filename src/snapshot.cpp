@@ -0,0 +1,89 @@
+#include "snapshot.h"
+#include "bmap.h"
+#include <stdlib.h>
+
+BSnapshot::BSnapshot(BMap *bmap, uint64_t seq, off_t root)
+    : bmap_(bmap), seq_(seq), root_(root) {
+  constexpr uint32_t kAlign = 4096;
+  page_ = (char *)aligned_alloc(kAlign, bmap_->conf_.block_size);
+}
+
+BSnapshot::~BSnapshot() {
+  bmap_->cache_.ReleaseSnapshot(seq_);
+  free(page_);
+}
+
+const key_t *BSnapshot::Key(const BpNode *node) const {
+  return (const key_t *)offset_ptr(node);
+}
+
+const off_t *BSnapshot::Sub(const BpNode *node) const {
+  return (const off_t *)(offset_ptr(node) +
+                         (bmap_->max_index_num_ - 1) * sizeof(key_t));
+}
+
+const long *BSnapshot::Data(const BpNode *node) const {
+  return (const long *)(offset_ptr(node) +
+                        bmap_->max_data_num_ * sizeof(key_t));
+}
+
+const BpNode *BSnapshot::ReadNode(off_t offset) {
+  if ((uint64_t)offset == BMap::INVALID_OFFSET || page_ == nullptr ||
+      bmap_->cache_.ReadSnapshotPage(offset, seq_, page_) != 0) {
+    return nullptr;
+  }
+  return (const BpNode *)page_;
+}
+
+const BpNode *BSnapshot::FindLeaf(key_t key) {
+  const BpNode *node = ReadNode(root_);
+  while (node != nullptr && node->type != LEAF) {
+    int i = BMap::KeySearch(Key(node), node->children - 1, key,
+                            bmap_->conf_.node_search);
+    node = ReadNode(Sub(node)[i >= 0 ? i + 1 : -i - 1]);
+  }
+  return node;
+}
+
+std::pair<long, bool> BSnapshot::Search(key_t key) {
+  const BpNode *leaf = FindLeaf(key);
+  if (leaf == nullptr) {
+    return {0, false};
+  }
+  int i = BMap::KeySearch(Key(leaf), leaf->children, key,
+                          bmap_->conf_.node_search);
+  if (i < 0) {
+    return {0, false};
+  }
+  return {Data(leaf)[i], true};
+}
+
+int BSnapshot::Scan(key_t start, key_t end,
+                    const std::function<bool(key_t, long)> &fn) {
+  if (start > end) {
+    return 0;
+  }
+  const BpNode *leaf = FindLeaf(start);
+  if (leaf == nullptr) {
+    return 0;
+  }
+  int i = BMap::KeySearch(Key(leaf), leaf->children, start,
+                          bmap_->conf_.node_search);
+  i = i >= 0 ? i : -i - 1;
+  int count = 0;
+  while (leaf != nullptr) {
+    for (; i < (int)leaf->children; i++) {
+      key_t key = Key(leaf)[i];
+      if (key > end) {
+        return count;
+      }
+      count++;
+      if (!fn(key, Data(leaf)[i])) {
+        return count;
+      }
+    }
+    leaf = ReadNode(leaf->next);
+    i = 0;
+  }
+  return count;
+}
@@ -0,0 +1,48 @@
+#include "transaction.h"
+#include "bmap.h"
+
+int BTransaction::Put(key_t key, long value) {
+  if (done_) {
+    return -1;
+  }
+  writes_[key] = Write{true, value};
+  return 0;
+}
+
+int BTransaction::Delete(key_t key) {
+  if (done_) {
+    return -1;
+  }
+  writes_[key] = Write{false, 0};
+  return 0;
+}
+
+std::pair<long, bool> BTransaction::Get(key_t key) {
+  auto iter = writes_.find(key);
+  if (iter != writes_.end()) {
+    return {iter->second.second, iter->second.first};
+  }
+  return bmap_->BplusTreeSearch(key);
+}
+
+int BTransaction::Commit() {
+  if (done_) {
+    return -1;
+  }
+  Finish();
+  int ret = bmap_->TxnApply(writes_);
+  writes_.clear();
+  return ret;
+}
+
+void BTransaction::Abort() {
+  Finish();
+  writes_.clear();
+}
+
+void BTransaction::Finish() {
+  if (!done_) {
+    done_ = true;
+    bmap_->open_txns_--;
+  }
+}
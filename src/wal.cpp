@@ -0,0 +1,80 @@
+#include "wal.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+WriteAheadLog::~WriteAheadLog() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+int WriteAheadLog::Open(const std::string &file_name) {
+  fd_ = open(file_name.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd_ < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    return -1;
+  }
+  size_ = st.st_size;
+  return 0;
+}
+
+uint32_t WriteAheadLog::Checksum(const std::vector<Entry> &entries) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  const unsigned char *data = (const unsigned char *)entries.data();
+  for (size_t i = 0; i < entries.size() * sizeof(Entry); i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+int WriteAheadLog::Append(const std::vector<Entry> &entries) {
+  BatchHeader header{kMagic, (uint32_t)entries.size(), Checksum(entries)};
+  std::vector<char> buf(sizeof(header) + entries.size() * sizeof(Entry));
+  memcpy(buf.data(), &header, sizeof(header));
+  memcpy(buf.data() + sizeof(header), entries.data(),
+         entries.size() * sizeof(Entry));
+  if (pwrite(fd_, buf.data(), buf.size(), size_) != (ssize_t)buf.size() ||
+      fdatasync(fd_) != 0) {
+    return -1;
+  }
+  size_ += buf.size();
+  return 0;
+}
+
+int WriteAheadLog::Replay(const ReplayFn &fn) {
+  int batches = 0;
+  off_t pos = 0;
+  BatchHeader header;
+  while (pread(fd_, &header, sizeof(header), pos) == sizeof(header) &&
+         header.magic == kMagic) {
+    std::vector<Entry> entries(header.count);
+    ssize_t size = header.count * sizeof(Entry);
+    if (pread(fd_, entries.data(), size, pos + sizeof(header)) != size ||
+        Checksum(entries) != header.checksum) {
+      // 写到一半的批
+      break;
+    }
+    for (auto &entry : entries) {
+      fn(entry);
+    }
+    pos += sizeof(header) + size;
+    batches++;
+  }
+  return batches;
+}
+
+int WriteAheadLog::Reset() {
+  if (size_ == 0) {
+    return 0;
+  }
+  if (ftruncate(fd_, 0) != 0 || fsync(fd_) != 0) {
+    return -1;
+  }
+  size_ = 0;
+  return 0;
+}
@@ -1,7 +1,298 @@
 #include "bmap.h"
+#include "partitioned_map.h"
+#include "pipeline.h"
 #include <iostream>
+#include <fcntl.h>
+#include <memory>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
 
 constexpr uint32_t kLoopNum = 20000;
+constexpr uint32_t kShadowNum = 2000;
+
+// 把key 1的值挪到key 2,提交后生效,放弃的事务不留痕迹
+static void TxnTest(BMap &bmap, const char *name) {
+  bmap.BplusTreeInsert(1, 100);
+  auto txn = bmap.Begin();
+  txn->Delete(1);
+  txn->Put(2, 100);
+  if (bmap.BplusTreeSearch(2).second || txn->Get(1).second ||
+      txn->Commit()) {
+    std::cout << name << " txn commit error" << std::endl;
+  }
+  txn = bmap.Begin();
+  txn->Put(1, 1);
+  txn->Delete(2);
+  txn->Abort();
+  if (txn->Commit() == 0 || bmap.BplusTreeSearch(1).second ||
+      bmap.BplusTreeSearch(2).first != 100) {
+    std::cout << name << " txn abort error" << std::endl;
+  }
+  bmap.BplusTreeDelete(2);
+}
+
+// 原地写模式下事务之后的删除不写日志,崩溃重新打开时不能被重做的事务盖掉
+static void CrashTest() {
+  BConfig conf{4096, "crash_test.db", 64};
+  pid_t pid = fork();
+  if (pid == 0) {
+    BMap bmap(conf);
+    if (bmap.BOpen() == 0) {
+      auto txn = bmap.Begin();
+      for (int i = 0; i < 10; i++) {
+        txn->Put(i, 555);
+      }
+      txn->Commit();
+      bmap.BplusTreeDelete(5);
+    }
+    _exit(0); // 不关闭,模拟崩溃
+  }
+  waitpid(pid, nullptr, 0);
+  BMap bmap(conf);
+  if (bmap.BOpen() || bmap.BplusTreeSearch(5).second ||
+      bmap.BplusTreeSearch(6).first != 555) {
+    std::cout << "crash replay error" << std::endl;
+  }
+  bmap.BClose();
+}
+
+// 带校验的文件坏了一个叶子:异步查找(AIO读回来的页)、同步查找、
+// 扫描(预读的页)和写都报错,读不到的key不会当成不存在
+static void CorruptPageTest() {
+  constexpr uint32_t kNum = 2000;
+  BConfig conf{4096, "checksum_test.db", 64};
+  conf.page_checksum = true;
+  for (const char *suffix : {"", ".boot", ".wal"}) {
+    unlink((std::string(conf.file_name) + suffix).c_str());
+  }
+  {
+    BMap bmap(conf);
+    if (bmap.BOpen()) {
+      return;
+    }
+    for (uint32_t i = 0; i < kNum; i++) {
+      bmap.BplusTreeInsert(i, i);
+    }
+    bmap.BClose();
+  }
+  // 顺序插入时第5块是一个中间的叶子
+  int fd = open(conf.file_name.c_str(), O_WRONLY);
+  pwrite(fd, "bad", 3, 5 * 4096 + 100);
+  close(fd);
+
+  BMap bmap(conf);
+  if (bmap.BOpen()) {
+    std::cout << "checksum open error" << std::endl;
+    return;
+  }
+  uint32_t found = 0;
+  uint32_t bad = 0;
+  auto searcher = bmap.AsyncSearcher();
+  for (uint32_t i = 0; i < kNum; i++) {
+    searcher->Search(i, [&](key_t key, long value, bool find) {
+      found += find;
+      bad += find && value != key;
+    });
+  }
+  searcher->Run();
+  uint64_t failures = bmap.GetCacheStats().checksum_failures;
+  if (searcher->Errors() == 0 || found + searcher->Errors() != kNum ||
+      bad != 0 || failures == 0) {
+    std::cout << "checksum async error" << std::endl;
+  }
+  searcher.reset();
+  uint32_t errors = 0;
+  key_t broken = -1;
+  for (uint32_t i = 0; i < kNum; i++) {
+    int error = 0;
+    auto [value, find] = bmap.BplusTreeSearch(i, &error);
+    if (error != 0) {
+      errors++;
+      broken = i;
+    } else if (!find || value != (long)i) {
+      bad++;
+    }
+  }
+  if (errors == 0 || bad != 0 ||
+      bmap.GetCacheStats().checksum_failures == failures) {
+    std::cout << "checksum search error" << std::endl;
+  }
+  // 缩小缓存把好的叶子也挤出去,扫描时沿着叶子链表预读
+  bmap.ResizeCache(4);
+  bmap.ResizeCache(64);
+  failures = bmap.GetCacheStats().checksum_failures;
+  if (bmap.BplusTreeScan(0, kNum, [](key_t, long) { return true; }) != -1 ||
+      bmap.GetCacheStats().checksum_failures == failures ||
+      bmap.BplusTreeUpsert(broken, 0) == 0 ||
+      bmap.BplusTreeDelete(broken) == 0) {
+    std::cout << "checksum scan error" << std::endl;
+  }
+  // 事务写到坏叶子时失败,前面已经做了的修改要撤销掉
+  auto txn = bmap.Begin();
+  txn->Put(0, -1);
+  txn->Delete(1);
+  txn->Put(broken, 0);
+  if (txn->Commit() == 0 || bmap.BplusTreeSearch(0).first != 0 ||
+      bmap.BplusTreeSearch(1).first != 1) {
+    std::cout << "checksum txn error" << std::endl;
+  }
+  bmap.BClose();
+}
+
+// 文件不许变大时影子提交会失败,之后空闲块和树都要回到提交前
+static void FailedCommitTest(BMap &bmap, key_t num) {
+  signal(SIGXFSZ, SIG_IGN);
+  rlimit old, limit;
+  getrlimit(RLIMIT_FSIZE, &old);
+  limit = old;
+  limit.rlim_cur = 0;
+  setrlimit(RLIMIT_FSIZE, &limit);
+  auto txn = bmap.Begin();
+  for (key_t i = 0; i < num; i++) {
+    txn->Delete(i);
+  }
+  txn->Put(num, num);
+  int ret = txn->Commit();
+  std::vector<BWriteOp> ops(num);
+  std::vector<int> rets(num);
+  for (key_t i = 0; i < num; i++) {
+    ops[i] = BWriteOp{BWriteOp::DELETE, i, 0};
+  }
+  int batch = bmap.BplusTreeWriteBatch(ops.data(), num, rets.data());
+  setrlimit(RLIMIT_FSIZE, &old);
+  FsckReport report;
+  if (ret == 0 || batch == 0 || bmap.Check(&report) != 0 ||
+      bmap.BplusTreeSearch(num).second || bmap.BplusTreeInsert(num, num) ||
+      bmap.BplusTreeDelete(num) ||
+      bmap.BplusTreeSearch(num - 1).first != num - 1) {
+    std::cout << "failed commit error" << std::endl;
+  }
+}
+
+// 延迟合并下删掉大部分key,Rebalance整理到没有不到半满的节点为止
+static void RebalanceTest() {
+  constexpr uint32_t kNum = 100000;
+  BConfig conf{4096, "rebalance_test.db", 256};
+  conf.merge_percent = 0;
+  for (const char *suffix : {"", ".boot", ".wal"}) {
+    unlink((std::string(conf.file_name) + suffix).c_str());
+  }
+  BMap bmap(conf);
+  if (bmap.BOpen()) {
+    return;
+  }
+  for (uint32_t i = 0; i < kNum; i++) {
+    bmap.BplusTreeInsert(i, i);
+  }
+  for (uint32_t i = 0; i < kNum; i++) {
+    if (i % 64 != 0) {
+      bmap.BplusTreeDelete(i);
+    }
+  }
+  while (bmap.Rebalance(kNum) > 0) {
+  }
+  FsckReport report;
+  TreeStats stats;
+  if (bmap.Check(&report) != 0 || bmap.AnalyzeTree(&stats) != 0 ||
+      stats.keys != kNum / 64 + 1) {
+    std::cout << "rebalance check error" << std::endl;
+  }
+  // 除了根,每层都至少半满
+  for (size_t level = 1; level < stats.levels.size(); level++) {
+    uint32_t max_num =
+        level + 1 == stats.levels.size() ? stats.max_data_num
+                                         : stats.max_index_num;
+    if (stats.levels[level].min_entries < (max_num + 1) / 2) {
+      std::cout << "rebalance underfull level " << level << std::endl;
+    }
+  }
+  for (uint32_t i = 0; i < kNum; i += 64) {
+    if (bmap.BplusTreeSearch(i).first != (long)i) {
+      std::cout << "rebalance not find " << i << std::endl;
+    }
+  }
+  bmap.BClose();
+}
+
+// 删掉大部分key再整理:剩下的key都在,叶子按顺序排在文件前部,文件变小
+static void VacuumTest() {
+  constexpr uint32_t kNum = 20000;
+  BConfig conf{4096, "vacuum_test.db", 256};
+  for (const char *suffix : {"", ".boot", ".wal"}) {
+    unlink((std::string(conf.file_name) + suffix).c_str());
+  }
+  BMap bmap(conf);
+  if (bmap.BOpen()) {
+    return;
+  }
+  // 倒着插入,叶子在文件里是逆序的
+  for (uint32_t i = kNum; i > 0; i--) {
+    bmap.BplusTreeInsert(i, i);
+  }
+  for (uint32_t i = 1; i <= kNum; i++) {
+    if (i % 4 != 0) {
+      bmap.BplusTreeDelete(i);
+    }
+  }
+  TreeStats before;
+  bmap.AnalyzeTree(&before);
+  bool done = false;
+  while (!done) {
+    if (bmap.Vacuum(64, &done) < 0) {
+      std::cout << "vacuum tree error" << std::endl;
+      break;
+    }
+  }
+  FsckReport report;
+  TreeStats stats;
+  struct stat st;
+  if (bmap.Check(&report) != 0 || bmap.AnalyzeTree(&stats) != 0 ||
+      stats.keys != kNum / 4 || stats.file_size >= before.file_size ||
+      stats.leaf_sequential + 1 != stats.leaves ||
+      stat(conf.file_name.c_str(), &st) != 0 ||
+      (uint64_t)st.st_size != stats.file_size) {
+    std::cout << "vacuum tree check error" << std::endl;
+  }
+  for (uint32_t i = 4; i <= kNum; i += 4) {
+    if (bmap.BplusTreeSearch(i).first != (long)i) {
+      std::cout << "vacuum not find " << i << std::endl;
+    }
+  }
+  bmap.BClose();
+}
+
+// 从空树开始插入,过滤器要随着key数重建,哈希函数个数跟着变
+static void FilterGrowTest() {
+  constexpr uint32_t kNum = 20000;
+  BConfig conf{4096, "filter_test.db", 256};
+  conf.filter_bytes = 16384;
+  for (const char *suffix : {"", ".boot", ".wal"}) {
+    unlink((std::string(conf.file_name) + suffix).c_str());
+  }
+  BMap bmap(conf);
+  if (bmap.BOpen()) {
+    return;
+  }
+  uint32_t hashes = bmap.GetFilterStats().hashes;
+  for (uint32_t i = 0; i < kNum; i++) {
+    bmap.BplusTreeInsert(i, i);
+  }
+  uint32_t missed = 0;
+  for (uint32_t i = 0; i < kNum; i++) {
+    missed += bmap.BplusTreeSearch(i).first != (long)i;
+    bmap.BplusTreeSearch(kNum + i);
+  }
+  FilterStats stats = bmap.GetFilterStats();
+  if (missed != 0 || stats.rebuilds < 2 || stats.hashes >= hashes ||
+      stats.false_positives > kNum / 10) {
+    std::cout << "filter grow error" << std::endl;
+  }
+  bmap.BClose();
+}
 
 int main() {
   BConfig conf{4096, "test.db", 2000};
@@ -15,6 +306,10 @@ int main() {
       std::cout << "insert error " << i << std::endl;
     }
   }
+  // 预热
+  if (bmap.Warm(10) == 0) {
+    std::cout << "warm error" << std::endl;
+  }
   // 查找
   for (int i = 0; i < kLoopNum; i++) {
     auto [value, find] = bmap.BplusTreeSearch(i);
@@ -22,10 +317,89 @@ int main() {
       std::cout << "not find " << i << std::endl;
     }
   }
+  // 批量查找,包括不存在的key
+  {
+    std::vector<key_t> keys;
+    for (int i = -10; i < (int)kLoopNum + 10; i++) {
+      keys.push_back(i);
+    }
+    std::vector<long> values(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    if (bmap.BplusTreeMultiSearch(keys.data(), keys.size(), values.data(),
+                                  found.get()) != (int)kLoopNum) {
+      std::cout << "multi search count error" << std::endl;
+    }
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (found[i] != (keys[i] >= 0 && keys[i] < (int)kLoopNum) ||
+          (found[i] && values[i] != keys[i])) {
+        std::cout << "multi search error " << keys[i] << std::endl;
+      }
+    }
+  }
+  // 缩小缓存后再查一遍,再扩回来
+  if (bmap.ResizeCache(64)) {
+    std::cout << "shrink cache error" << std::endl;
+  }
+  for (int i = 0; i < kLoopNum; i++) {
+    auto [value, find] = bmap.BplusTreeSearch(i);
+    if (!find || value != i) {
+      std::cout << "not find after shrink " << i << std::endl;
+    }
+  }
+  // 缓存小的时候交错查找,大部分节点要异步读
+  {
+    auto searcher = bmap.AsyncSearcher();
+    for (int i = kLoopNum - 1; i >= -1; i--) {
+      searcher->Search(i, [](key_t key, long value, bool find) {
+        if (find != (key >= 0) || (find && value != key)) {
+          std::cout << "async not find " << key << std::endl;
+        }
+      });
+    }
+    searcher->Run();
+  }
+  if (bmap.ResizeCache(4000) || bmap.GetCacheStats().capacity != 4000) {
+    std::cout << "grow cache error" << std::endl;
+  }
+  // 范围扫描
+  {
+    key_t expect = 100;
+    int count = bmap.BplusTreeScan(100, 5099, [&](key_t key, long value) {
+      if (key != expect || value != key) {
+        std::cout << "scan error " << key << std::endl;
+      }
+      expect++;
+      return true;
+    });
+    if (count != 5000) {
+      std::cout << "scan count error " << count << std::endl;
+    }
+  }
+  // 原地改值
+  {
+    long result = 0;
+    if (bmap.BplusTreeUpdate(10, 11) || bmap.BplusTreeUpdate(-1, 0) == 0 ||
+        bmap.BplusTreeMerge(10, [](long v) { return v * 2; }, &result) ||
+        result != 22 || bmap.BplusTreeIncrement(10, -12, &result) ||
+        result != 10 || bmap.BplusTreeUpsert(kLoopNum, kLoopNum) ||
+        bmap.BplusTreeSearch(kLoopNum).first != kLoopNum ||
+        bmap.BplusTreeDelete(kLoopNum)) {
+      std::cout << "update error" << std::endl;
+    }
+  }
   BMapVisualizer visualizer(bmap);
   visualizer.Visualize();
-  // 删除
-  for (int i = 0; i < kLoopNum; i++) {
+  // 后一半按范围删除,前一半一个个删
+  {
+    uint64_t deleted = 0;
+    if (bmap.BplusTreeCountRange(kLoopNum / 2, kLoopNum) != kLoopNum / 2 ||
+        bmap.BplusTreeDeleteRange(kLoopNum / 2, kLoopNum, &deleted) ||
+        deleted != kLoopNum / 2 ||
+        bmap.BplusTreeCountRange(0, kLoopNum) != kLoopNum / 2) {
+      std::cout << "delete range error" << std::endl;
+    }
+  }
+  for (uint32_t i = 0; i < kLoopNum / 2; i++) {
     if (bmap.BplusTreeDelete(i)) {
       std::cout << "delete error " << i << std::endl;
     }
@@ -38,6 +412,156 @@ int main() {
     }
   }
 
+  // 全删空之后整理,文件应该截断到0
+  {
+    bool done = false;
+    while (!done) {
+      if (bmap.Vacuum(64, &done) < 0) {
+        std::cout << "vacuum error" << std::endl;
+        break;
+      }
+    }
+    TreeStats stats;
+    struct stat st;
+    if (bmap.AnalyzeTree(&stats) != 0 || stats.file_size != 0 ||
+        stat(conf.file_name.c_str(), &st) != 0 || st.st_size != 0) {
+      std::cout << "vacuum truncate error" << std::endl;
+    }
+  }
+  TxnTest(bmap, "in place");
   bmap.BClose();
+  CrashTest();
+  CorruptPageTest();
+  RebalanceTest();
+  VacuumTest();
+  FilterGrowTest();
+
+  // 影子分页,关闭后重新打开数据还在
+  BConfig shadow_conf{4096, "shadow_test.db", 64};
+  shadow_conf.durability = DURABILITY_SHADOW;
+  shadow_conf.subtree_counts = true;
+  shadow_conf.filter_bytes = 4096;
+  shadow_conf.node_search = NODE_SEARCH_INTERPOLATION;
+  {
+    BMap shadow(shadow_conf);
+    if (shadow.BOpen()) {
+      return -1;
+    }
+    for (uint32_t i = 0; i < kShadowNum; i++) {
+      if (shadow.BplusTreeInsert(i, i)) {
+        std::cout << "shadow insert error " << i << std::endl;
+      }
+    }
+    // 同一个文件里的另一棵树
+    shadow.UseTree("index");
+    for (int i = 0; i < 100; i++) {
+      shadow.BplusTreeInsert(i, -i);
+    }
+    shadow.UseTree("");
+    shadow.BClose();
+  }
+  {
+    BMap shadow(shadow_conf);
+    if (shadow.BOpen()) {
+      return -1;
+    }
+    FsckReport report;
+    if (shadow.Check(&report) != 0) {
+      std::cout << "shadow check error" << std::endl;
+    }
+    TreeStats stats;
+    if (shadow.AnalyzeTree(&stats) != 0 || stats.keys != kShadowNum) {
+      std::cout << "shadow analyze error" << std::endl;
+    }
+    // 子树计数
+    key_t key = 0;
+    if (shadow.BplusTreeRank(kShadowNum / 2) != kShadowNum / 2 ||
+        shadow.BplusTreeSelect(kShadowNum - 1, &key, nullptr) ||
+        key != kShadowNum - 1 ||
+        shadow.BplusTreeSelect(kShadowNum, &key, nullptr) == 0 ||
+        shadow.BplusTreeCountRange(10, 19) != 10) {
+      std::cout << "shadow rank error" << std::endl;
+    }
+    // 过滤器在BOpen时建好,不存在的key不用读页
+    if (shadow.BplusTreeSearch(kShadowNum + 1).second ||
+        shadow.GetFilterStats().rejects + shadow.GetFilterStats()
+                .false_positives != 1) {
+      std::cout << "shadow filter error" << std::endl;
+    }
+    if (shadow.ListTrees().size() != 1 || shadow.UseTree("index") ||
+        shadow.BplusTreeSearch(1).first != -1 || shadow.UseTree("") ||
+        shadow.BplusTreeSearch(1).first != 1) {
+      std::cout << "shadow tree error" << std::endl;
+    }
+    // 事务没提交时不能切换树,提交后写在开始时的树上;不新建时名字要存在
+    {
+      auto txn = shadow.Begin();
+      txn->Put(kShadowNum, 1);
+      if (shadow.UseTree("index") == 0 || txn->Commit() ||
+          shadow.BplusTreeSearch(kShadowNum).first != 1 ||
+          shadow.BplusTreeDelete(kShadowNum) || shadow.UseTree("index") ||
+          shadow.BplusTreeSearch(kShadowNum).second || shadow.UseTree("") ||
+          shadow.UseTree("indx", false) == 0 ||
+          shadow.ListTrees().size() != 1) {
+        std::cout << "shadow txn tree error" << std::endl;
+      }
+    }
+    FailedCommitTest(shadow, kShadowNum);
+    // 快照看到的是删除之前的数据
+    auto snapshot = shadow.Snapshot();
+    for (uint32_t i = 0; i < kShadowNum; i++) {
+      auto [value, find] = shadow.BplusTreeSearch(i);
+      if (!find || value != i) {
+        std::cout << "shadow not find " << i << std::endl;
+      }
+      if (shadow.BplusTreeDelete(i)) {
+        std::cout << "shadow delete error " << i << std::endl;
+      }
+    }
+    if (snapshot->Scan(0, kShadowNum, [](key_t, long) { return true; }) !=
+        (int)kShadowNum) {
+      std::cout << "snapshot scan error" << std::endl;
+    }
+    snapshot.reset();
+    TxnTest(shadow, "shadow");
+    shadow.BClose();
+  }
+
+  // 按哈希分到两个分区,归并扫描是有序的
+  PartitionConfig part_conf;
+  part_conf.conf = BConfig{4096, "part_test.db", 64};
+  part_conf.partitions = 2;
+  BPartitionedMap part(part_conf);
+  if (part.Open()) {
+    return -1;
+  }
+  for (int i = 0; i < 100; i++) {
+    part.Upsert(i, i);
+  }
+  key_t last = -1;
+  if (part.Scan(0, 99, [&last](key_t key, long) {
+        bool ordered = key == last + 1;
+        last = key;
+        return ordered;
+      }) != 100 ||
+      !part.Search(42).second) {
+    std::cout << "partition error" << std::endl;
+  }
+  part.Close();
+
+  // 流水线里同一个线程的请求按提交的顺序生效
+  BPipeline pipe(BConfig{4096, "pipe_test.db", 64});
+  if (pipe.Open()) {
+    return -1;
+  }
+  pipe.Delete(7);
+  auto first = pipe.Insert(7, 1);
+  auto again = pipe.Insert(7, 2);
+  auto get = pipe.Search(7);
+  if (first.get().ret != 0 || again.get().ret != -1 ||
+      get.get().value != 1) {
+    std::cout << "pipeline error" << std::endl;
+  }
+  pipe.Close();
   return 0;
 }
\ No newline at end of file
@@ -1,5 +1,8 @@
+#include "extent_allocator.h"
 #include "page_cache.h"
 #include <assert.h>
+#include <unistd.h>
+#include <vector>
 
 int main() {
   PageList list;
@@ -70,5 +73,95 @@ int main() {
     assert((*iter)[0] == 'a' + 4 - i);
     i++;
   }
+  {
+    // 大页拿不到时要退回到普通映射
+    ArenaOptions options;
+    options.huge_page = HUGE_PAGE_2M;
+    options.prefault = true;
+    PageList huge_list;
+    if (huge_list.Init(20, 4096, options))
+      return -1;
+    ArenaInfo info = huge_list.GetArenaInfo();
+    assert(info.backing != ARENA_MALLOC && info.prefaulted);
+    assert(info.size >= 21 * 4096);
+    for (int i = 0; i < 20; i++) {
+      (*huge_list.PushFront())[0] = 'a' + i;
+    }
+    assert((*huge_list.Begin())[0] == 'a' + 19);
+  }
+  {
+    // 页都被引用住时借溢出页帧,引用释放后还回去
+    PageLruCache cache;
+    if (cache.Init("page_cache_test.db", 4096, 4))
+      return -1;
+    cache.SetOverflowLimit(2);
+    std::vector<PageCacheIter> pinned;
+    for (int i = 0; i < 6; i++) {
+      auto iter = cache.GetPage((off_t)i * 4096, true);
+      assert(iter != cache.End());
+      pinned.push_back(iter);
+    }
+    assert(cache.GetPage(6 * 4096, true) == cache.End());
+    CacheStats stats = cache.Stats();
+    assert(stats.overflow_allocs == 2 && stats.overflow_pages == 2);
+    assert(stats.alloc_failures == 1);
+    // 没被引用的脏页满的时候同步写回后淘汰
+    for (auto iter : pinned) {
+      cache.Unpin(iter, true);
+    }
+    assert(cache.Stats().overflow_pages == 0);
+    for (int i = 6; i < 10; i++) {
+      auto iter = cache.GetPage((off_t)i * 4096, true);
+      assert(iter != cache.End());
+      cache.Unpin(iter, false);
+    }
+    stats = cache.Stats();
+    assert(stats.pressure_flushes > 0 && stats.resident == 4);
+    unlink("page_cache_test.db");
+  }
+  {
+    // 空闲段:前后相接的段合并,分配取离hint最近的块
+    constexpr off_t kBlock = 4096;
+    ExtentAllocator extents;
+    extents.Init(kBlock);
+    assert(extents.Alloc(0) == -1);
+    extents.AddRange(0, 2);
+    extents.AddRange(5 * kBlock, 2);
+    extents.AddRange(2 * kBlock, 1);
+    assert(extents.Extents() == 2 && extents.FreeBlocks() == 5);
+    extents.Free(4 * kBlock);
+    extents.Free(3 * kBlock);
+    assert(extents.Extents() == 1 && extents.FreeBlocks() == 7);
+    assert(extents.Blocks().size() == 7 && extents.Blocks()[6] == 6 * kBlock);
+
+    // 剩下[0, 2)和[9, 11)
+    assert(extents.Remove(3 * kBlock) && !extents.Remove(3 * kBlock));
+    assert(!extents.Remove(7 * kBlock) && !extents.Remove(kBlock + 1));
+    assert(extents.Extents() == 2 && extents.FreeBlocks() == 6);
+    for (off_t block : {2, 4, 5, 6}) {
+      assert(extents.Remove(block * kBlock));
+    }
+    extents.AddRange(9 * kBlock, 2);
+    assert(extents.Extents() == 2 && extents.FreeBlocks() == 4);
+    // hint在空闲段里取它本身,不对齐时取所在的块
+    assert(extents.Alloc(10 * kBlock + 100) == 10 * kBlock);
+    extents.Free(10 * kBlock);
+    // 离前一段的最后一块近
+    assert(extents.Alloc(4 * kBlock) == kBlock);
+    extents.Free(kBlock);
+    // 离后一段的开头近
+    assert(extents.Alloc(6 * kBlock) == 9 * kBlock);
+    extents.Free(9 * kBlock);
+    // 一样近取后面的
+    assert(extents.Alloc(5 * kBlock) == 9 * kBlock);
+    extents.Free(9 * kBlock);
+    // 在所有段后面取最后一块,hint为负数取偏移最小的
+    assert(extents.Alloc(100 * kBlock) == 10 * kBlock);
+    assert(extents.Alloc(-1) == 0);
+    assert(extents.Extents() == 2 && extents.FreeBlocks() == 2);
+    assert(extents.Blocks()[0] == kBlock && extents.Blocks()[1] == 9 * kBlock);
+    extents.Clear();
+    assert(extents.FreeBlocks() == 0 && extents.Alloc(-1) == -1);
+  }
   return 0;
 }
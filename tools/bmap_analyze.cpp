@@ -0,0 +1,74 @@
+#include "analyze.h"
+#include <iomanip>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+// 用法: bmap_analyze [-j 线程数] 文件名
+// 成功返回0,树的链接有问题返回1,文件读不了返回2
+int main(int argc, char *argv[]) {
+  uint32_t threads = 4;
+  const char *file_name = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else {
+      file_name = argv[i];
+    }
+  }
+  if (file_name == nullptr) {
+    std::cerr << "usage: " << argv[0] << " [-j threads] <file>" << std::endl;
+    return 2;
+  }
+
+  TreeStats stats;
+  int ret = AnalyzeFile(file_name, threads, &stats);
+  if (ret < 0) {
+    std::cerr << "can not read " << file_name << std::endl;
+    return 2;
+  }
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "block size:   " << stats.block_size << " (index "
+            << stats.max_index_num << ", leaf " << stats.max_data_num
+            << ")" << std::endl
+            << "file:         " << stats.pages << " pages, "
+            << stats.file_size / (1 << 20) << " MiB" << std::endl
+            << "height:       " << stats.height << std::endl
+            << "leaves:       " << stats.leaves << std::endl
+            << "keys:         " << stats.keys << std::endl;
+
+  std::cout << "level   nodes      min  max  fill   histogram(0-100%)"
+            << std::endl;
+  for (size_t i = 0; i < stats.levels.size(); i++) {
+    const LevelStats &level = stats.levels[i];
+    std::cout << std::setw(5) << i << std::setw(10) << level.nodes
+              << std::setw(6) << level.min_entries << std::setw(5)
+              << level.max_entries << std::setw(6) << level.fill * 100
+              << "% ";
+    for (uint64_t count : level.fill_histogram) {
+      std::cout << " " << count;
+    }
+    std::cout << std::endl;
+  }
+
+  uint64_t links = stats.leaf_sequential + stats.leaf_forward +
+                   stats.leaf_backward;
+  std::cout << "leaf chain:   " << stats.leaf_runs << " runs, "
+            << stats.leaf_sequential << " sequential, " << stats.leaf_forward
+            << " forward, " << stats.leaf_backward << " backward";
+  if (links > 0) {
+    std::cout << " (" << stats.leaf_sequential * 100.0 / links
+              << "% sequential, avg jump " << stats.leaf_avg_jump
+              << " pages)";
+  }
+  std::cout << std::endl
+            << "free:         " << stats.free_blocks << " blocks in "
+            << stats.free_extents << " extents, largest "
+            << stats.largest_free_extent << std::endl
+            << "read:         " << stats.bytes_read / (1 << 20) << " MiB in "
+            << std::setprecision(3) << stats.seconds << " s" << std::endl;
+  if (ret != 0) {
+    std::cout << "error: broken sibling or child links" << std::endl;
+  }
+  return ret;
+}
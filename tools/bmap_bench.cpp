@@ -0,0 +1,334 @@
+#include "bmap.h"
+#include "partitioned_map.h"
+#include "pipeline.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <glob.h>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// 用法: bmap_bench [-n key数] [-q查找数] [-c缓存页数]
+//                   [-d dense|uniform|skewed] [-m binary|interpolation|both]
+//                   [-p 分区数] [-t 线程数] 文件名
+// 文件是空的时候先按-d的分布插入n个key,之后比较逐个查找和批量查找的吞吐;
+// -m both时两种节点内查找方式各跑一遍
+// 给了-p时改为比较1个分区和p个分区下p个线程同时插入的吞吐,
+// 分区文件是"文件名.p分区数.i",每次先删掉重建
+// 给了-t时改为比较t个线程通过互斥锁直接用BMap和通过BPipeline插入再查找的吞吐,
+// 文件是"文件名.mutex"和"文件名.pipe",每次先删掉重建
+namespace {
+
+// 插入的key的分布
+enum KeyDist {
+  DIST_DENSE,   // 0..n-1
+  DIST_UNIFORM, // 在整个int范围内均匀随机
+  DIST_SKEWED,  // 越往后越稀,插值估计偏得多
+};
+
+struct Options {
+  uint32_t keys = 1000000;
+  uint32_t queries = 2000000;
+  uint32_t cache_pages = 65536;
+  KeyDist dist = DIST_DENSE;
+  std::vector<NodeSearchMode> modes = {NODE_SEARCH_BINARY,
+                                       NODE_SEARCH_INTERPOLATION};
+  uint32_t partitions = 0;
+  uint32_t threads = 0;
+  const char *file_name = nullptr;
+};
+
+// 按分布生成的key,有序不重复,同样的参数每次一样
+std::vector<key_t> MakeKeys(const Options &options) {
+  std::vector<key_t> keys(options.keys);
+  std::mt19937 rng(2);
+  for (uint32_t i = 0; i < options.keys; i++) {
+    if (options.dist == DIST_DENSE) {
+      keys[i] = i;
+    } else if (options.dist == DIST_UNIFORM) {
+      keys[i] = (key_t)rng();
+    } else {
+      double x = (double)i / options.keys;
+      keys[i] = (key_t)(x * x * x * x * 2e9) + i;
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+void Report(const char *name, uint32_t num, double seconds, long sum) {
+  std::cout << name << ": " << num / seconds / 1e6 << " Mops/s (" << seconds
+            << " s, checksum " << sum << ")" << std::endl;
+}
+
+int BenchSearch(BMap &bmap, const Options &options,
+                const std::vector<key_t> &inserted) {
+  std::mt19937 rng(1);
+  std::vector<key_t> keys(options.queries);
+  for (auto &key : keys) {
+    key = inserted[rng() % inserted.size()];
+  }
+  // 先查一遍,让节点都在缓存里
+  for (size_t i = 0; i < inserted.size(); i += 16) {
+    bmap.BplusTreeSearch(inserted[i]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  long sum = 0;
+  for (key_t key : keys) {
+    sum += bmap.BplusTreeSearch(key).first;
+  }
+  Report("search", options.queries, Seconds(start), sum);
+
+  std::vector<long> values(options.queries);
+  std::unique_ptr<bool[]> found(new bool[options.queries]);
+  start = std::chrono::steady_clock::now();
+  bmap.BplusTreeMultiSearch(keys.data(), options.queries, values.data(),
+                            found.get());
+  sum = 0;
+  for (long value : values) {
+    sum += value;
+  }
+  Report("multi search", options.queries, Seconds(start), sum);
+  return 0;
+}
+
+// 只比较节点内的查找:把key按叶子大小切成段,在段内找
+void BenchNodeSearch(const Options &options, const std::vector<key_t> &keys,
+                     uint32_t node_keys) {
+  std::mt19937 rng(3);
+  std::vector<uint32_t> queries(options.queries);
+  for (auto &query : queries) {
+    query = rng() % keys.size();
+  }
+  for (NodeSearchMode mode : options.modes) {
+    auto start = std::chrono::steady_clock::now();
+    long sum = 0;
+    for (uint32_t query : queries) {
+      size_t base = query / node_keys * node_keys;
+      int len = std::min<size_t>(node_keys, keys.size() - base);
+      sum += BMap::KeySearch(&keys[base], len, keys[query], mode);
+    }
+    Report(mode == NODE_SEARCH_BINARY ? "node binary search"
+                                      : "node interpolation search",
+           options.queries, Seconds(start), sum);
+  }
+}
+
+// 删掉file和它的boot、日志、影子页表
+void RemoveFile(const std::string &file) {
+  for (const char *suffix : {"", ".boot", ".wal"}) {
+    unlink((file + suffix).c_str());
+  }
+  glob_t maps;
+  if (glob((file + ".map.*").c_str(), 0, nullptr, &maps) == 0) {
+    for (size_t i = 0; i < maps.gl_pathc; i++) {
+      unlink(maps.gl_pathv[i]);
+    }
+  }
+  globfree(&maps);
+}
+
+// threads个线程同时往partitions个分区里插入keys
+int BenchPartitioned(const Options &options, const std::vector<key_t> &keys,
+                     uint32_t partitions, uint32_t threads) {
+  PartitionConfig conf;
+  std::string prefix =
+      std::string(options.file_name) + ".p" + std::to_string(partitions);
+  conf.conf = BConfig{4096, prefix, options.cache_pages / partitions};
+  conf.partitions = partitions;
+  for (uint32_t i = 0; i < partitions; i++) {
+    RemoveFile(prefix + "." + std::to_string(i));
+  }
+  BPartitionedMap map(conf);
+  if (map.Open()) {
+    std::cerr << "can not open " << prefix << std::endl;
+    return 2;
+  }
+  std::atomic<long> sum{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      long local = 0;
+      for (size_t i = t; i < keys.size(); i += threads) {
+        local += map.Insert(keys[i], keys[i]) == 0;
+      }
+      sum += local;
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  std::string name = std::to_string(partitions) + " partitions insert";
+  Report(name.c_str(), keys.size(), Seconds(start), sum);
+  return map.Close();
+}
+
+// threads个线程各自插入一部分keys,再各自查找这些keys,
+// fn(t, insert, key)做一次操作,返回成功的次数
+template <typename Fn>
+long RunThreads(const char *name, const std::vector<key_t> &keys,
+                uint32_t threads, Fn &&fn) {
+  long total = 0;
+  for (bool insert : {true, false}) {
+    std::atomic<long> sum{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; t++) {
+      workers.emplace_back([&, t] { sum += fn(t, insert); });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    std::string op = std::string(name) + (insert ? " insert" : " search");
+    Report(op.c_str(), keys.size(), Seconds(start), sum);
+    total += sum;
+  }
+  return total;
+}
+
+// 互斥锁包着的BMap和单写者流水线比较,都用影子分页,每次提交都要落盘
+int BenchPipeline(const Options &options, const std::vector<key_t> &keys,
+                  uint32_t threads) {
+  BConfig conf{4096, std::string(options.file_name) + ".mutex",
+               options.cache_pages};
+  conf.durability = DURABILITY_SHADOW;
+  std::string file = conf.file_name;
+  RemoveFile(file);
+  BMap bmap(conf);
+  if (bmap.BOpen()) {
+    std::cerr << "can not open " << file << std::endl;
+    return 2;
+  }
+  std::mutex mutex;
+  RunThreads("mutex", keys, threads, [&](uint32_t t, bool insert) {
+    long count = 0;
+    for (size_t i = t; i < keys.size(); i += threads) {
+      std::lock_guard<std::mutex> lock(mutex);
+      count += insert ? bmap.BplusTreeInsert(keys[i], keys[i]) == 0
+                      : bmap.BplusTreeSearch(keys[i]).second;
+    }
+    return count;
+  });
+  bmap.BClose();
+
+  file = conf.file_name = std::string(options.file_name) + ".pipe";
+  RemoveFile(file);
+  BPipeline pipeline(conf);
+  if (pipeline.Open()) {
+    std::cerr << "can not open " << file << std::endl;
+    return 2;
+  }
+  // 每个线程最多同时等这么多个结果
+  const size_t window = 64;
+  RunThreads("pipeline", keys, threads, [&](uint32_t t, bool insert) {
+    long count = 0;
+    std::deque<std::future<BResult>> pending;
+    for (size_t i = t; i < keys.size() || !pending.empty(); i += threads) {
+      if (i < keys.size()) {
+        pending.push_back(insert ? pipeline.Insert(keys[i], keys[i])
+                                 : pipeline.Search(keys[i]));
+      }
+      if (pending.size() >= window || i >= keys.size()) {
+        BResult result = pending.front().get();
+        pending.pop_front();
+        count += insert ? result.ret == 0 : result.found;
+      }
+    }
+    return count;
+  });
+  PipelineStats stats = pipeline.Stats();
+  std::cout << "pipeline batch size: "
+            << (double)stats.requests / std::max<uint64_t>(stats.batches, 1)
+            << std::endl;
+  return pipeline.Close();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+      options.keys = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-q") == 0) {
+      options.queries = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+      options.cache_pages = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-d") == 0) {
+      i++;
+      options.dist = strcmp(argv[i], "uniform") == 0  ? DIST_UNIFORM
+                     : strcmp(argv[i], "skewed") == 0 ? DIST_SKEWED
+                                                      : DIST_DENSE;
+    } else if (i + 1 < argc && strcmp(argv[i], "-p") == 0) {
+      options.partitions = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-t") == 0) {
+      options.threads = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-m") == 0) {
+      i++;
+      if (strcmp(argv[i], "binary") == 0) {
+        options.modes = {NODE_SEARCH_BINARY};
+      } else if (strcmp(argv[i], "interpolation") == 0) {
+        options.modes = {NODE_SEARCH_INTERPOLATION};
+      }
+    } else {
+      options.file_name = argv[i];
+    }
+  }
+  if (options.file_name == nullptr || options.keys == 0) {
+    std::cerr << "usage: " << argv[0]
+              << " [-n keys] [-q queries] [-c cache_pages]"
+                 " [-d dense|uniform|skewed] [-m binary|interpolation|both]"
+                 " [-p partitions] [-t threads] <file>"
+              << std::endl;
+    return 2;
+  }
+
+  std::vector<key_t> keys = MakeKeys(options);
+  if (options.threads > 0) {
+    return BenchPipeline(options, keys, options.threads);
+  }
+  if (options.partitions > 0) {
+    uint32_t threads = options.partitions;
+    return BenchPartitioned(options, keys, 1, threads) ||
+           BenchPartitioned(options, keys, options.partitions, threads);
+  }
+  int ret = 0;
+  uint32_t node_keys = 0;
+  for (NodeSearchMode mode : options.modes) {
+    BConfig conf{4096, options.file_name, options.cache_pages};
+    conf.node_search = mode;
+    BMap bmap(conf);
+    if (bmap.BOpen()) {
+      std::cerr << "can not open " << options.file_name << std::endl;
+      return 2;
+    }
+    if (!bmap.BplusTreeSearch(keys[0]).second) {
+      for (key_t key : keys) {
+        bmap.BplusTreeInsert(key, key);
+      }
+    }
+    std::cout << (mode == NODE_SEARCH_BINARY ? "binary" : "interpolation")
+              << ":" << std::endl;
+    ret |= BenchSearch(bmap, options, keys);
+    node_keys = bmap.GetMaxDataNum();
+    bmap.BClose();
+  }
+  BenchNodeSearch(options, keys, node_keys);
+  return ret;
+}
@@ -0,0 +1,51 @@
+#include "fsck.h"
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+// 用法: bmap_fsck [-j 线程数] 文件名
+// 没有问题返回0,发现问题返回1,文件读不了返回2
+int main(int argc, char *argv[]) {
+  uint32_t threads = 4;
+  const char *file_name = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else {
+      file_name = argv[i];
+    }
+  }
+  if (file_name == nullptr) {
+    std::cerr << "usage: " << argv[0] << " [-j threads] <file>" << std::endl;
+    return 2;
+  }
+
+  FsckReport report;
+  int ret = FsckFile(file_name, threads, &report);
+  if (ret < 0) {
+    std::cerr << "can not read " << file_name << std::endl;
+    return 2;
+  }
+  std::cout << "pages:        " << report.pages << std::endl
+            << "depth:        " << report.depth << std::endl
+            << "index nodes:  " << report.index_nodes << std::endl
+            << "leaves:       " << report.leaves << std::endl
+            << "keys:         " << report.keys << std::endl
+            << "free blocks:  " << report.free_blocks << std::endl
+            << "leaked pages: " << report.leaked_pages << std::endl
+            << "leaf fill:    " << report.leaf_fill * 100 << "%" << std::endl
+            << "index fill:   " << report.index_fill * 100 << "%" << std::endl
+            << "read:         " << report.bytes_read / (1 << 20) << " MiB in "
+            << report.seconds << " s" << std::endl;
+  for (auto &error : report.errors) {
+    std::cout << "error: " << error << std::endl;
+  }
+  if (report.error_count > report.errors.size()) {
+    std::cout << "... " << report.error_count - report.errors.size()
+              << " more errors" << std::endl;
+  }
+  for (off_t offset : report.leaked) {
+    std::cout << "leaked: " << std::hex << offset << std::dec << std::endl;
+  }
+  return ret;
+}
@@ -0,0 +1,281 @@
+#include "bmap_protocol.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// 用法: bmap_load [-C 连接数] [-D 每个连接同时在途的请求数] [-n 每个连接的请求数]
+//                  [-k key范围] [-r 读的百分比] [-M 每个MULTI_GET的key数]
+//                  [-S 每个SCAN的条数] [-l] socket路径
+// 每个连接一个线程,连续发请求不等应答,最多D个在途,最后打印吞吐和延迟分布。
+// 读默认是GET,给了-M时是MULTI_GET,给了-S时是SCAN;写是PUT。
+// -l先把[0, k)都PUT一遍再开始计时
+namespace {
+
+struct Options {
+  uint32_t connections = 4;
+  uint32_t depth = 32;
+  uint32_t requests = 100000;
+  uint32_t key_range = 1000000;
+  uint32_t read_percent = 90;
+  uint32_t multi_get = 0;
+  uint32_t scan = 0;
+  bool load = false;
+  const char *path = nullptr;
+};
+
+// 一个连接上的统计
+struct Result {
+  std::vector<double> latencies; // 微秒
+  uint64_t errors = 0;
+  uint64_t hits = 0; // 读到的条数
+};
+
+int Connect(const char *path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+int WriteAll(int fd, const std::string &buf) {
+  for (size_t pos = 0; pos < buf.size();) {
+    ssize_t ret = send(fd, buf.data() + pos, buf.size() - pos, MSG_NOSIGNAL);
+    if (ret <= 0) {
+      return -1;
+    }
+    pos += ret;
+  }
+  return 0;
+}
+
+// 读请求的应答里读到的条数
+uint64_t CountHits(int32_t op, const ProtoHeader &header, const char *body) {
+  if (header.code != PROTO_OK) {
+    return 0;
+  }
+  ProtoReader reader(body, header.length);
+  uint32_t count = 0;
+  if (op == PROTO_GET) {
+    return 1;
+  } else if (op == PROTO_SCAN) {
+    reader.Get(&count);
+    return count;
+  } else if (op != PROTO_MULTI_GET || !reader.Get(&count)) {
+    return 0;
+  }
+  uint64_t hits = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t found = 0;
+    long value;
+    reader.Get(&found);
+    reader.Get(&value);
+    hits += found;
+  }
+  return hits;
+}
+
+// 在一个连接上发requests个请求;load为true时按顺序PUT这个连接的那一份key
+int RunConnection(const Options &options, uint32_t index, uint32_t requests,
+                  bool load, Result *result) {
+  int fd = Connect(options.path);
+  if (fd < 0) {
+    return -1;
+  }
+  std::mt19937 rng(index);
+  // 在途请求的操作和发出的时间
+  std::deque<std::pair<int32_t, std::chrono::steady_clock::time_point>> sent;
+  std::string out;
+  std::string in;
+  size_t in_pos = 0;
+  char buf[65536];
+  uint32_t issued = 0;
+  uint32_t done = 0;
+  int ret = 0;
+  while (done < requests && ret == 0) {
+    out.clear();
+    while (issued < requests && sent.size() < options.depth) {
+      key_t key = load ? issued * options.connections + index
+                       : rng() % options.key_range;
+      int32_t op = PROTO_GET;
+      if (load || rng() % 100 >= options.read_percent) {
+        op = PROTO_PUT;
+        ProtoWriter writer(&out, issued, op);
+        writer.Put(key);
+        writer.Put((long)key);
+      } else if (options.multi_get > 0) {
+        op = PROTO_MULTI_GET;
+        ProtoWriter writer(&out, issued, op);
+        writer.Put(options.multi_get);
+        for (uint32_t i = 0; i < options.multi_get; i++) {
+          writer.Put((key_t)(rng() % options.key_range));
+        }
+      } else if (options.scan > 0) {
+        op = PROTO_SCAN;
+        ProtoWriter writer(&out, issued, op);
+        writer.Put(key);
+        writer.Put((key_t)(options.key_range - 1));
+        writer.Put(options.scan);
+      } else {
+        ProtoWriter writer(&out, issued, op);
+        writer.Put(key);
+      }
+      sent.emplace_back(op, std::chrono::steady_clock::now());
+      issued++;
+    }
+    if (!out.empty() && WriteAll(fd, out) != 0) {
+      ret = -1;
+      break;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      ret = -1;
+      break;
+    }
+    if (in_pos > 0) {
+      in.erase(0, in_pos);
+      in_pos = 0;
+    }
+    in.append(buf, len);
+    ProtoHeader header;
+    const char *body;
+    while ((body = ProtoNextFrame(in, &in_pos, &header)) != nullptr) {
+      // 应答按请求的顺序回来
+      if (sent.empty() || header.id != done) {
+        ret = -1;
+        break;
+      }
+      auto now = std::chrono::steady_clock::now();
+      result->latencies.push_back(
+          std::chrono::duration<double, std::micro>(now - sent.front().second)
+              .count());
+      result->errors += header.code == PROTO_ERROR;
+      result->hits += CountHits(sent.front().first, header, body);
+      sent.pop_front();
+      done++;
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+// 所有连接同时跑,返回用的秒数,失败时返回-1
+double RunAll(const Options &options, uint32_t requests, bool load,
+              std::vector<Result> *results) {
+  results->assign(options.connections, Result());
+  std::atomic<int> failed{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < options.connections; i++) {
+    workers.emplace_back([&, i] {
+      if (RunConnection(options, i, requests, load, &(*results)[i]) != 0) {
+        failed++;
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  if (failed > 0) {
+    return -1;
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+void Report(const char *name, const std::vector<Result> &results,
+            double seconds) {
+  std::vector<double> latencies;
+  uint64_t errors = 0;
+  uint64_t hits = 0;
+  for (auto &result : results) {
+    latencies.insert(latencies.end(), result.latencies.begin(),
+                     result.latencies.end());
+    errors += result.errors;
+    hits += result.hits;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) {
+    return latencies.empty() ? 0.0
+                             : latencies[(size_t)(p * (latencies.size() - 1))];
+  };
+  std::cout << name << ": " << latencies.size() / seconds / 1e6
+            << " Mreq/s (" << latencies.size() << " requests, " << seconds
+            << " s, " << errors << " errors, " << hits << " hits)" << std::endl
+            << "latency us: p50 " << percentile(0.5) << ", p99 "
+            << percentile(0.99) << ", p99.9 " << percentile(0.999)
+            << ", max " << percentile(1) << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && strcmp(argv[i], "-C") == 0) {
+      options.connections = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-D") == 0) {
+      options.depth = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+      options.requests = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-k") == 0) {
+      options.key_range = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-r") == 0) {
+      options.read_percent = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-M") == 0) {
+      options.multi_get = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-S") == 0) {
+      options.scan = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-l") == 0) {
+      options.load = true;
+    } else {
+      options.path = argv[i];
+    }
+  }
+  if (options.path == nullptr || options.connections == 0 ||
+      options.depth == 0 || options.key_range == 0 ||
+      options.multi_get > kProtoMaxKeys) {
+    std::cerr << "usage: " << argv[0]
+              << " [-C connections] [-D depth] [-n requests] [-k key_range]"
+                 " [-r read_percent] [-M multi_get] [-S scan] [-l] <socket>"
+              << std::endl;
+    return 2;
+  }
+
+  std::vector<Result> results;
+  if (options.load) {
+    uint32_t requests =
+        (options.key_range + options.connections - 1) / options.connections;
+    double seconds = RunAll(options, requests, true, &results);
+    if (seconds < 0) {
+      std::cerr << "can not talk to " << options.path << std::endl;
+      return 2;
+    }
+    Report("load", results, seconds);
+  }
+  double seconds = RunAll(options, options.requests, false, &results);
+  if (seconds < 0) {
+    std::cerr << "can not talk to " << options.path << std::endl;
+    return 2;
+  }
+  Report("run", results, seconds);
+  return 0;
+}
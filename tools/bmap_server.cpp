@@ -0,0 +1,510 @@
+#include "bmap.h"
+#include "bmap_protocol.h"
+#include <errno.h>
+#include <iostream>
+#include <memory>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// 用法: bmap_server [-c 缓存页数] [-b 每批最多请求数] [-s] 文件名 socket路径
+// 在Unix域socket上按bmap_protocol.h的协议提供GET/PUT/DELETE/SCAN/MULTI_GET,
+// 多个进程可以通过它共用一个文件。-s用影子分页。收到SIGINT/SIGTERM时关闭
+namespace {
+
+volatile sig_atomic_t g_stop = 0;
+
+void OnSignal(int) { g_stop = 1; }
+
+// 一个连接上没发出去的应答超过这么多字节时先不读新的请求
+constexpr size_t kMaxPending = 4 << 20;
+
+struct Conn {
+  int fd = -1;
+  std::string in;
+  size_t in_pos = 0; // in里已经解析过的字节数
+  std::string out;
+  size_t out_pos = 0; // out里已经发出去的字节数
+  uint32_t events = 0; // 当前在epoll里关注的事件
+  bool eof = false;    // 对方关了写端,做完已经收到的请求后关闭
+  bool dead = false;   // 出错了,这一轮结束时关闭
+  bool active = false; // 已经在这一轮的active_里
+
+  size_t Pending() const { return out.size() - out_pos; }
+};
+
+// 解析出来等着执行的请求
+struct Request {
+  Conn *conn = nullptr;
+  uint32_t id = 0;
+  int32_t op = 0;
+  key_t key = 0; // SCAN时是start
+  key_t end = 0;
+  long value = 0;
+  uint32_t limit = 0;
+  uint32_t first = 0; // MULTI_GET的key在keys_里的位置
+  uint32_t count = 0;
+};
+
+class Server {
+public:
+  Server(const BConfig &conf, uint32_t max_batch)
+      : bmap_(conf), max_batch_(max_batch) {}
+
+  int Open(const char *path);
+  // 等事件时用mask作为信号掩码,SIGINT/SIGTERM只在等的时候处理
+  int Run(const sigset_t *mask);
+  void Close();
+
+private:
+  void Accept();
+  void Read(Conn *conn);
+  void Flush(Conn *conn);
+  void Activate(Conn *conn);
+  // 解析conn里完整的请求放进batch_,格式不对时返回-1
+  int Parse(Conn *conn);
+  void Execute();
+  // 连续的读和连续的写分别一起做,读和写之间保持到达的顺序
+  void ExecuteReads(size_t begin, size_t end);
+  void ExecuteWrites(size_t begin, size_t end);
+  // 处理完一轮后更新连接关注的事件,关掉该关的连接
+  void Finish(Conn *conn);
+
+private:
+  BMap bmap_;
+  uint32_t max_batch_;
+  std::string path_;
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  std::vector<Conn *> active_;
+  std::vector<Request> batch_;
+  std::vector<key_t> keys_;
+  uint64_t requests_ = 0;
+  uint64_t batches_ = 0;
+};
+
+int Server::Open(const char *path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  path_ = path;
+  if (bmap_.BOpen() != 0) {
+    return -1;
+  }
+  unlink(path);
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0 || bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) ||
+      listen(listen_fd_, 128)) {
+    return -1;
+  }
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr; // 监听socket
+  if (epoll_fd_ < 0 ||
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+void Server::Close() {
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(path_.c_str());
+  }
+  bmap_.BClose();
+  std::cout << "requests: " << requests_ << ", engine batches: " << batches_
+            << std::endl;
+}
+
+int Server::Run(const sigset_t *mask) {
+  std::vector<epoll_event> events(256);
+  std::vector<Conn *> conns;
+  while (!g_stop) {
+    // 还有没处理完的请求时不等
+    int timeout = active_.empty() ? -1 : 0;
+    int num = epoll_pwait(epoll_fd_, events.data(), events.size(), timeout,
+                          mask);
+    if (num < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (int i = 0; i < num; i++) {
+      Conn *conn = (Conn *)events[i].data.ptr;
+      if (conn == nullptr) {
+        Accept();
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        Read(conn);
+      }
+      if (events[i].events & EPOLLOUT) {
+        Flush(conn);
+      }
+      Activate(conn);
+    }
+
+    // 每个连接轮流取,取满一批就执行,没取完的留到下一轮
+    conns.swap(active_);
+    active_.clear();
+    for (Conn *conn : conns) {
+      conn->active = false;
+      if (!conn->dead && Parse(conn) != 0) {
+        conn->dead = true;
+      }
+    }
+    Execute();
+    for (Conn *conn : conns) {
+      Finish(conn);
+    }
+  }
+  return 0;
+}
+
+void Server::Accept() {
+  for (;;) {
+    int fd =
+        accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    Conn *conn = new Conn;
+    conn->fd = fd;
+    conn->events = EPOLLIN;
+    epoll_event event;
+    event.events = conn->events;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      close(fd);
+      delete conn;
+    }
+  }
+}
+
+void Server::Read(Conn *conn) {
+  // 已经解析过的部分丢掉
+  if (conn->in_pos > 0) {
+    conn->in.erase(0, conn->in_pos);
+    conn->in_pos = 0;
+  }
+  char buf[65536];
+  for (;;) {
+    ssize_t ret = read(conn->fd, buf, sizeof(buf));
+    if (ret > 0) {
+      conn->in.append(buf, ret);
+      if (conn->in.size() >= kMaxPending) {
+        return;
+      }
+    } else if (ret == 0) {
+      conn->eof = true;
+      return;
+    } else {
+      if (errno != EAGAIN && errno != EINTR) {
+        conn->dead = true;
+      }
+      if (errno != EINTR) {
+        return;
+      }
+    }
+  }
+}
+
+void Server::Flush(Conn *conn) {
+  while (conn->Pending() > 0) {
+    ssize_t ret = send(conn->fd, conn->out.data() + conn->out_pos,
+                       conn->Pending(), MSG_NOSIGNAL);
+    if (ret > 0) {
+      conn->out_pos += ret;
+    } else if (ret < 0 && errno == EINTR) {
+      continue;
+    } else {
+      if (ret < 0 && errno != EAGAIN) {
+        conn->dead = true;
+      }
+      return;
+    }
+  }
+  conn->out.clear();
+  conn->out_pos = 0;
+}
+
+void Server::Activate(Conn *conn) {
+  if (!conn->active) {
+    conn->active = true;
+    active_.push_back(conn);
+  }
+}
+
+int Server::Parse(Conn *conn) {
+  ProtoHeader header;
+  // 应答积压太多时等连接可写后再取
+  while (conn->Pending() < kMaxPending) {
+    if (batch_.size() >= max_batch_) {
+      // 这一轮没取完的下一轮接着取
+      Activate(conn);
+      return 0;
+    }
+    // 先看长度,太长的帧不等它收完
+    if (conn->in.size() - conn->in_pos >= sizeof(header.length)) {
+      memcpy(&header.length, conn->in.data() + conn->in_pos,
+             sizeof(header.length));
+      if (header.length > kProtoMaxFrame) {
+        return -1;
+      }
+    }
+    const char *body = ProtoNextFrame(conn->in, &conn->in_pos, &header);
+    if (body == nullptr) {
+      return 0;
+    }
+    ProtoReader reader(body, header.length);
+    Request request;
+    request.conn = conn;
+    request.id = header.id;
+    request.op = header.code;
+    bool ok = false;
+    switch (header.code) {
+    case PROTO_GET:
+    case PROTO_DELETE:
+      ok = reader.Get(&request.key);
+      break;
+    case PROTO_PUT:
+      ok = reader.Get(&request.key) && reader.Get(&request.value);
+      break;
+    case PROTO_SCAN:
+      ok = reader.Get(&request.key) && reader.Get(&request.end) &&
+           reader.Get(&request.limit);
+      if (request.limit == 0 || request.limit > kProtoMaxKeys) {
+        request.limit = kProtoMaxKeys;
+      }
+      break;
+    case PROTO_MULTI_GET:
+      ok = reader.Get(&request.count) && request.count <= kProtoMaxKeys;
+      request.first = keys_.size();
+      for (uint32_t i = 0; ok && i < request.count; i++) {
+        key_t key;
+        ok = reader.Get(&key);
+        keys_.push_back(key);
+      }
+      break;
+    }
+    if (!ok || !reader.Done()) {
+      return -1;
+    }
+    batch_.push_back(request);
+  }
+  return 0;
+}
+
+void Server::Execute() {
+  for (size_t begin = 0; begin < batch_.size();) {
+    bool read = batch_[begin].op == PROTO_GET ||
+                batch_[begin].op == PROTO_SCAN ||
+                batch_[begin].op == PROTO_MULTI_GET;
+    size_t end = begin + 1;
+    while (end < batch_.size() &&
+           (batch_[end].op == PROTO_PUT || batch_[end].op == PROTO_DELETE) ==
+               !read) {
+      end++;
+    }
+    if (read) {
+      ExecuteReads(begin, end);
+    } else {
+      ExecuteWrites(begin, end);
+    }
+    batches_++;
+    begin = end;
+  }
+  requests_ += batch_.size();
+  batch_.clear();
+  keys_.clear();
+}
+
+void Server::ExecuteReads(size_t begin, size_t end) {
+  // GET和MULTI_GET的key一起查
+  std::vector<key_t> keys;
+  for (size_t i = begin; i < end; i++) {
+    const Request &request = batch_[i];
+    if (request.op == PROTO_GET) {
+      keys.push_back(request.key);
+    } else if (request.op == PROTO_MULTI_GET) {
+      keys.insert(keys.end(), keys_.begin() + request.first,
+                  keys_.begin() + request.first + request.count);
+    }
+  }
+  std::vector<long> values(keys.size());
+  std::unique_ptr<bool[]> found(new bool[keys.size()]);
+  // 有节点读不到时分不清是哪个key,这一批的GET和MULTI_GET都回错误
+  bool failed = !keys.empty() &&
+                bmap_.BplusTreeMultiSearch(keys.data(), keys.size(),
+                                           values.data(), found.get()) < 0;
+  size_t pos = 0;
+  for (size_t i = begin; i < end; i++) {
+    const Request &request = batch_[i];
+    if (failed && request.op != PROTO_SCAN) {
+      ProtoWriter writer(&request.conn->out, request.id, PROTO_ERROR);
+    } else if (request.op == PROTO_GET) {
+      ProtoWriter writer(&request.conn->out, request.id,
+                         found[pos] ? PROTO_OK : PROTO_NOT_FOUND);
+      if (found[pos]) {
+        writer.Put(values[pos]);
+      }
+      pos++;
+    } else if (request.op == PROTO_MULTI_GET) {
+      ProtoWriter writer(&request.conn->out, request.id, PROTO_OK);
+      writer.Put(request.count);
+      for (uint32_t j = 0; j < request.count; j++, pos++) {
+        writer.Put((uint8_t)found[pos]);
+        writer.Put(values[pos]);
+      }
+    } else {
+      // 条数最后回填
+      std::string &out = request.conn->out;
+      size_t start = out.size();
+      int ret = 0;
+      {
+        ProtoWriter writer(&out, request.id, PROTO_OK);
+        size_t count_pos = out.size();
+        uint32_t count = 0;
+        writer.Put(count);
+        if (request.key <= request.end) {
+          ret = bmap_.BplusTreeScan(
+              request.key, request.end,
+              [&writer, &count, &request](key_t key, long value) {
+                writer.Put(key);
+                writer.Put(value);
+                return ++count < request.limit;
+              });
+        }
+        memcpy(&out[count_pos], &count, sizeof(count));
+      }
+      if (ret < 0) {
+        // 扫到一半读不到节点,换成错误应答
+        out.resize(start);
+        ProtoWriter writer(&out, request.id, PROTO_ERROR);
+      }
+    }
+  }
+}
+
+void Server::ExecuteWrites(size_t begin, size_t end) {
+  size_t num = end - begin;
+  std::vector<BWriteOp> ops(num);
+  std::vector<int> rets(num);
+  for (size_t i = 0; i < num; i++) {
+    const Request &request = batch_[begin + i];
+    ops[i].type =
+        request.op == PROTO_PUT ? BWriteOp::UPSERT : BWriteOp::DELETE;
+    ops[i].key = request.key;
+    ops[i].value = request.value;
+  }
+  // 一批写只提交一次。失败时影子分页(-s)下这一批都没有生效;原地写模式下
+  // 可能已经改到树上,日志还留着,重新打开时会重做,所以结果是不确定的
+  int ret = bmap_.BplusTreeWriteBatch(ops.data(), num, rets.data());
+  for (size_t i = 0; i < num; i++) {
+    const Request &request = batch_[begin + i];
+    int32_t status = PROTO_OK;
+    if (ret != 0 || (request.op == PROTO_PUT && rets[i] != 0)) {
+      status = PROTO_ERROR;
+    } else if (rets[i] != 0) {
+      status = PROTO_NOT_FOUND;
+    }
+    ProtoWriter writer(&request.conn->out, request.id, status);
+  }
+}
+
+void Server::Finish(Conn *conn) {
+  if (conn->active) {
+    // 还有请求没取完,下一轮再处理
+    Flush(conn);
+    return;
+  }
+  if (!conn->dead) {
+    Flush(conn);
+  }
+  if (conn->dead || (conn->eof && conn->Pending() == 0)) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn->fd, nullptr);
+    close(conn->fd);
+    delete conn;
+    return;
+  }
+  uint32_t events = 0;
+  if (!conn->eof && conn->in.size() - conn->in_pos < kMaxPending) {
+    events |= EPOLLIN;
+  }
+  if (conn->Pending() > 0) {
+    events |= EPOLLOUT;
+  }
+  if (events != conn->events) {
+    conn->events = events;
+    epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn->fd, &event);
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  uint32_t cache_pages = 65536;
+  uint32_t max_batch = 1024;
+  bool shadow = false;
+  std::vector<const char *> args;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+      cache_pages = atoi(argv[++i]);
+    } else if (i + 1 < argc && strcmp(argv[i], "-b") == 0) {
+      max_batch = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      shadow = true;
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  if (args.size() != 2 || max_batch == 0) {
+    std::cerr << "usage: " << argv[0]
+              << " [-c cache_pages] [-b max_batch] [-s] <file> <socket>"
+              << std::endl;
+    return 2;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = OnSignal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+  sigset_t block, mask;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  sigprocmask(SIG_BLOCK, &block, &mask);
+
+  BConfig conf{4096, args[0], cache_pages};
+  if (shadow) {
+    conf.durability = DURABILITY_SHADOW;
+  }
+  Server server(conf, max_batch);
+  if (server.Open(args[1]) != 0) {
+    std::cerr << "can not open " << args[0] << " on " << args[1] << std::endl;
+    return 2;
+  }
+  int ret = server.Run(&mask);
+  server.Close();
+  return ret == 0 ? 0 : 1;
+}